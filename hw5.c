@@ -2,10 +2,34 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
 #ifdef USEGLEW
 #include <GL/glew.h>
 #endif
 #define GL_GLEXT_PROTOTYPES
+#ifdef USEEGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -76,6 +100,22 @@ Light mainLight = {
     .direction = {-1.0f, -1.0f, -1.0f},
     .cutoff = 45.0f
 };
+
+// Lights of the advanced lighting mode, also baked into lightmaps. They are
+// directional, shining from where these positions point, so lighting does not
+// depend on where a building stands and shared meshes light alike everywhere.
+Light advancedLights[2] = {
+    // Main light (sun-like)
+    {.position = {100.0f, 100.0f, 100.0f, 0.0f},
+     .ambient = {0.3f, 0.3f, 0.3f, 1.0f},
+     .diffuse = {1.0f, 1.0f, 0.9f, 1.0f},
+     .specular = {1.0f, 1.0f, 1.0f, 1.0f}},
+    // Secondary light (fill light)
+    {.position = {-50.0f, 50.0f, -50.0f, 0.0f},
+     .ambient = {0.1f, 0.1f, 0.1f, 1.0f},
+     .diffuse = {0.4f, 0.4f, 0.5f, 1.0f},
+     .specular = {0.3f, 0.3f, 0.3f, 1.0f}}
+};
 // Add new parameters for stairs
 typedef struct {
     float width;      // Width of staircase
@@ -150,38 +190,37 @@ int mouseX = 0, mouseY = 0;
 
 bool advancedLighting = true;
 bool shadowsEnabled = false;
+bool showAxes = true;
 
-// Add light toggle function
-void toggleAdvancedLighting() {
-    advancedLighting = !advancedLighting;
-    
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Number of online cores, which sizes the default thread pools
+int coreCount() {
+    int cores = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return cores > 0 ? cores : 1;
+}
+
+// Set up GL lighting state for the current advancedLighting mode
+void applyLightingMode() {
     if (advancedLighting) {
         // Enhanced lighting settings
         glEnable(GL_LIGHTING);
-        glEnable(GL_LIGHT0);
-        glEnable(GL_LIGHT1);
-        
-        // Main light (sun-like)
-        GLfloat lightPos[] = {100.0f, 100.0f, 100.0f, 1.0f};
-        GLfloat lightAmbient[] = {0.3f, 0.3f, 0.3f, 1.0f};
-        GLfloat lightDiffuse[] = {1.0f, 1.0f, 0.9f, 1.0f};
-        GLfloat lightSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
-        
-        glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
-        glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
-        glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
-        
-        // Secondary light (fill light)
-        GLfloat light1Pos[] = {-50.0f, 50.0f, -50.0f, 1.0f};
-        GLfloat light1Ambient[] = {0.1f, 0.1f, 0.1f, 1.0f};
-        GLfloat light1Diffuse[] = {0.4f, 0.4f, 0.5f, 1.0f};
-        GLfloat light1Specular[] = {0.3f, 0.3f, 0.3f, 1.0f};
-        
-        glLightfv(GL_LIGHT1, GL_POSITION, light1Pos);
-        glLightfv(GL_LIGHT1, GL_AMBIENT, light1Ambient);
-        glLightfv(GL_LIGHT1, GL_DIFFUSE, light1Diffuse);
-        glLightfv(GL_LIGHT1, GL_SPECULAR, light1Specular);
+        
+        // Main light and fill light
+        for (int i = 0; i < 2; i++) {
+            glEnable(GL_LIGHT0 + i);
+            glLightfv(GL_LIGHT0 + i, GL_POSITION, advancedLights[i].position);
+            glLightfv(GL_LIGHT0 + i, GL_AMBIENT, advancedLights[i].ambient);
+            glLightfv(GL_LIGHT0 + i, GL_DIFFUSE, advancedLights[i].diffuse);
+            glLightfv(GL_LIGHT0 + i, GL_SPECULAR, advancedLights[i].specular);
+        }
         
         // Material properties
         GLfloat matAmbient[] = {0.7f, 0.7f, 0.7f, 1.0f};
@@ -202,6 +241,21 @@ void toggleAdvancedLighting() {
         glEnable(GL_COLOR_MATERIAL);
         glColor3f(0.8f, 0.8f, 0.8f);  // Default color when lighting is off
     }
+}
+
+// Place the advanced lights under the current modelview. They are
+// directional, so only its rotation matters.
+void positionLights() {
+    if (!advancedLighting) return;
+    for (int i = 0; i < 2; i++) {
+        glLightfv(GL_LIGHT0 + i, GL_POSITION, advancedLights[i].position);
+    }
+}
+
+// Add light toggle function
+void toggleAdvancedLighting() {
+    advancedLighting = !advancedLighting;
+    applyLightingMode();
     glutPostRedisplay();
 }
 void applyMaterial(Material* mat) {
@@ -216,14 +270,204 @@ void applyMaterial(Material* mat) {
     }
 }
 
-void drawWindow() {
-    applyMaterial(&materials[2]); // Glass material
-    glBegin(GL_QUADS);
-    glVertex3f(-windowWidth/2, 0, 0.01f);
-    glVertex3f(windowWidth/2, 0, 0.01f);
-    glVertex3f(windowWidth/2, windowHeight, 0.01f);
-    glVertex3f(-windowWidth/2, windowHeight, 0.01f);
-    glEnd();
+// Mesh builder
+// Geometry is generated once into indexed triangle meshes and redrawn from
+// vertex arrays, instead of being re-emitted with glBegin/glEnd every frame.
+// Parts group index ranges by material slot so that material changes (M, L)
+// do not require regeneration.
+typedef enum {
+    SLOT_WALL,      // materials[currentMaterial]
+    SLOT_GLASS,     // materials[2]
+    SLOT_CONCRETE,  // materials[0], stairs and balconies
+    SLOT_ROOF,      // materials[3]
+    SLOT_OPENING,   // darker stairwell opening
+    NUM_SLOTS
+} MaterialSlot;
+
+typedef struct {
+    float x, y, z;
+    float nx, ny, nz;
+} Vertex;
+
+typedef struct {
+    MaterialSlot slot;
+    int firstIndex;
+    int numIndices;
+} MeshPart;
+
+// What a triangle belongs to, for picking
+typedef enum {
+    ELEMENT_WALL,
+    ELEMENT_WINDOW,   // index: bay along the wall
+    ELEMENT_BALCONY,  // index: bay along the wall
+    ELEMENT_FLOOR,    // slab, ceiling and stair opening
+    ELEMENT_STAIR,    // index: step, the landing comes after the last step
+    ELEMENT_ROOF,     // index: roof face
+    NUM_ELEMENTS
+} ElementKind;
+
+typedef struct {
+    uint8_t kind;
+    int8_t wall;      // WallSide, -1 when not part of a wall
+    int16_t index;
+} MeshTag;
+
+typedef struct {
+    Vertex* verts;
+    int numVerts, capVerts;
+    GLuint* indices;
+    int numIndices, capIndices;
+    MeshPart* parts;
+    int numParts, capParts;
+    MeshTag* tags;    // one per triangle
+    MeshTag tag;      // given to triangles as they are added
+    GLuint vbo, ibo;  // GPU copies, uploaded on first draw
+    bool mapped;      // arrays point into a mapped scene file, not the heap
+} Mesh;
+
+void meshClear(Mesh* mesh) {
+    mesh->numVerts = mesh->numIndices = mesh->numParts = 0;
+}
+
+void meshFree(Mesh* mesh) {
+    if (mesh->vbo) {
+        glDeleteBuffers(1, &mesh->vbo);
+        glDeleteBuffers(1, &mesh->ibo);
+    }
+    if (!mesh->mapped) {
+        free(mesh->verts);
+        free(mesh->indices);
+        free(mesh->parts);
+        free(mesh->tags);
+    }
+    memset(mesh, 0, sizeof(Mesh));
+}
+
+// Start a new part unless the last one already uses this slot
+void meshSetSlot(Mesh* mesh, MaterialSlot slot) {
+    if (mesh->numParts && mesh->parts[mesh->numParts - 1].slot == slot) return;
+    if (mesh->numParts == mesh->capParts) {
+        mesh->capParts = mesh->capParts ? mesh->capParts * 2 : 8;
+        mesh->parts = realloc(mesh->parts, mesh->capParts * sizeof(MeshPart));
+    }
+    mesh->parts[mesh->numParts++] = (MeshPart){slot, mesh->numIndices, 0};
+}
+
+// Tag the triangles added from now on
+void meshSetElement(Mesh* mesh, ElementKind kind, int index) {
+    mesh->tag = (MeshTag){kind, -1, index};
+}
+
+// Overwrite fields of the tags of triangles added since firstTriangle;
+// -1 leaves a field as it is
+void meshRetag(Mesh* mesh, int firstTriangle, int kind, int wall, int index) {
+    for (int i = firstTriangle; i < mesh->numIndices / 3; i++) {
+        if (kind >= 0) mesh->tags[i].kind = kind;
+        if (wall >= 0) mesh->tags[i].wall = wall;
+        if (index >= 0) mesh->tags[i].index = index;
+    }
+}
+
+GLuint meshVertex(Mesh* mesh, float x, float y, float z, float nx, float ny, float nz) {
+    if (mesh->numVerts == mesh->capVerts) {
+        mesh->capVerts = mesh->capVerts ? mesh->capVerts * 2 : 64;
+        mesh->verts = realloc(mesh->verts, mesh->capVerts * sizeof(Vertex));
+    }
+    mesh->verts[mesh->numVerts] = (Vertex){x, y, z, nx, ny, nz};
+    return mesh->numVerts++;
+}
+
+void meshTriangle(Mesh* mesh, GLuint a, GLuint b, GLuint c) {
+    if (mesh->numIndices + 3 > mesh->capIndices) {
+        mesh->capIndices = mesh->capIndices ? mesh->capIndices * 2 : 96;
+        mesh->indices = realloc(mesh->indices, mesh->capIndices * sizeof(GLuint));
+        mesh->tags = realloc(mesh->tags, mesh->capIndices / 3 * sizeof(MeshTag));
+    }
+    mesh->tags[mesh->numIndices / 3] = mesh->tag;
+    mesh->indices[mesh->numIndices++] = a;
+    mesh->indices[mesh->numIndices++] = b;
+    mesh->indices[mesh->numIndices++] = c;
+    mesh->parts[mesh->numParts - 1].numIndices += 3;
+}
+
+// Emit a quad given as four corners in GL_QUADS order
+void meshQuad(Mesh* mesh, float nx, float ny, float nz, const float p[4][3]) {
+    GLuint first = mesh->numVerts;
+    for (int i = 0; i < 4; i++) {
+        meshVertex(mesh, p[i][0], p[i][1], p[i][2], nx, ny, nz);
+    }
+    meshTriangle(mesh, first, first + 1, first + 2);
+    meshTriangle(mesh, first, first + 2, first + 3);
+}
+
+// Append src rotated by quarterTurns * 90 degrees about +y (as glRotatef)
+// and then translated
+void meshAppend(Mesh* dst, const Mesh* src, int quarterTurns, float tx, float ty, float tz) {
+    static const float cosTable[4] = {1, 0, -1, 0};
+    static const float sinTable[4] = {0, 1, 0, -1};
+    float c = cosTable[quarterTurns & 3];
+    float s = sinTable[quarterTurns & 3];
+    GLuint base = dst->numVerts;
+    
+    for (int i = 0; i < src->numVerts; i++) {
+        const Vertex* v = &src->verts[i];
+        meshVertex(dst, c * v->x + s * v->z + tx, v->y + ty, -s * v->x + c * v->z + tz,
+                   c * v->nx + s * v->nz, v->ny, -s * v->nx + c * v->nz);
+    }
+    MeshTag tag = dst->tag;
+    for (int p = 0; p < src->numParts; p++) {
+        const MeshPart* part = &src->parts[p];
+        meshSetSlot(dst, part->slot);
+        for (int i = part->firstIndex; i < part->firstIndex + part->numIndices; i += 3) {
+            dst->tag = src->tags[i / 3];
+            meshTriangle(dst, base + src->indices[i], base + src->indices[i + 1],
+                         base + src->indices[i + 2]);
+        }
+    }
+    dst->tag = tag;
+}
+
+Material* slotMaterial(MaterialSlot slot) {
+    switch (slot) {
+        case SLOT_WALL:
+            return &materials[currentMaterial];
+        case SLOT_GLASS:
+            return &materials[2];
+        case SLOT_ROOF:
+            return &materials[3];
+        default:
+            return &materials[0];
+    }
+}
+
+void applySlot(MaterialSlot slot) {
+    applyMaterial(slotMaterial(slot));
+    if (!advancedLighting) {
+        if (slot == SLOT_WALL) glColor3f(0.8f, 0.8f, 0.8f);  // Light gray color
+        if (slot == SLOT_OPENING) glColor3f(0.3f, 0.3f, 0.3f);
+    }
+}
+
+// Window geometry in wall space: centered on x = 0, sill at y = 0, facing +z
+void buildWindow(Mesh* mesh, float width, float height) {
+    meshSetSlot(mesh, SLOT_GLASS);
+    meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+        {-width/2, 0, 0.01f}, {width/2, 0, 0.01f},
+        {width/2, height, 0.01f}, {-width/2, height, 0.01f}
+    });
+}
+
+// Triangle fan around (cx, cy) from startAngle to endAngle in 10 degree steps
+void buildFan(Mesh* mesh, float cx, float cy, float radius, float startAngle, float endAngle) {
+    GLuint center = meshVertex(mesh, cx, cy, 0.01f, 0, 0, 1);
+    GLuint previous = 0;
+    for (float angle = startAngle; angle <= endAngle; angle += 10) {
+        float x = cx + radius * cos(angle * M_PI / 180.0f);
+        float y = cy + radius * sin(angle * M_PI / 180.0f);
+        GLuint current = meshVertex(mesh, x, y, 0.01f, 0, 0, 1);
+        if (angle > startAngle) meshTriangle(mesh, center, previous, current);
+        previous = current;
+    }
 }
 
 // Function to load a texture
@@ -306,68 +550,53 @@ void drawFloorDivider(float y) {
     glPopMatrix();
 }
 
-void drawWindowStyle(WindowStyle style) {
+void buildWindowStyle(Mesh* mesh, WindowStyle style) {
+    meshSetSlot(mesh, SLOT_GLASS);
     switch(style) {
         case WINDOW_ARCHED:
-            // Draw arched window
-            glBegin(GL_TRIANGLE_FAN);
-            // Center of arch
-            glVertex3f(0, windowHeight - windowWidth/2, 0);
-            // Draw arch
-            for(float angle = 0; angle <= 180; angle += 10) {
-                float x = windowWidth/2 * cos(angle * M_PI / 180.0f);
-                float y = windowHeight - windowWidth/2 + 
-                         windowWidth/2 * sin(angle * M_PI / 180.0f);
-                glVertex3f(x, y, 0);
-            }
-            glEnd();
+            // Rectangular pane below a semicircular arch
+            meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+                {-windowWidth/2, 0, 0.01f}, {windowWidth/2, 0, 0.01f},
+                {windowWidth/2, windowHeight - windowWidth/2, 0.01f},
+                {-windowWidth/2, windowHeight - windowWidth/2, 0.01f}
+            });
+            buildFan(mesh, 0, windowHeight - windowWidth/2, windowWidth/2, 0, 180);
             break;
             
         case WINDOW_DIVIDED:
-            // Draw divided pane window
-            glBegin(GL_QUADS);
+            // Divided panes, inset to leave mullions between them
             for(int i = 0; i < 2; i++) {
                 for(int j = 0; j < 3; j++) {
-                    float x1 = -windowWidth/2 + i * windowWidth/2;
-                    float x2 = -windowWidth/2 + (i+1) * windowWidth/2;
-                    float y1 = j * windowHeight/3;
-                    float y2 = (j+1) * windowHeight/3;
+                    float x1 = -windowWidth/2 + i * windowWidth/2 + 0.03f;
+                    float x2 = -windowWidth/2 + (i+1) * windowWidth/2 - 0.03f;
+                    float y1 = j * windowHeight/3 + 0.03f;
+                    float y2 = (j+1) * windowHeight/3 - 0.03f;
                     
-                    glVertex3f(x1, y1, 0);
-                    glVertex3f(x2, y1, 0);
-                    glVertex3f(x2, y2, 0);
-                    glVertex3f(x1, y2, 0);
+                    meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+                        {x1, y1, 0.01f}, {x2, y1, 0.01f}, {x2, y2, 0.01f}, {x1, y2, 0.01f}
+                    });
                 }
             }
-            glEnd();
             break;
             
         case WINDOW_CIRCULAR:
-            // Draw circular window
-            glBegin(GL_TRIANGLE_FAN);
-            glVertex3f(0, windowHeight/2, 0);
-            for(float angle = 0; angle <= 360; angle += 10) {
-                float x = windowWidth/2 * cos(angle * M_PI / 180.0f);
-                float y = windowHeight/2 + windowWidth/2 * sin(angle * M_PI / 180.0f);
-                glVertex3f(x, y, 0);
-            }
-            glEnd();
+            buildFan(mesh, 0, windowHeight/2, windowWidth/2, 0, 360);
             break;
             
         default:
             // Standard rectangular window
-            drawWindow();
+            buildWindow(mesh, windowWidth, windowHeight);
             break;
     }
 }
 
-void drawSteps() {
-    applyMaterial(&materials[0]); // Use concrete material for stairs
+void buildSteps(Mesh* mesh) {
+    meshSetSlot(mesh, SLOT_CONCRETE); // Use concrete material for stairs
     
     float stepDepth = stairs.totalRun / stairs.numSteps;
     
-    glBegin(GL_QUADS);
     for(int i = 0; i < stairs.numSteps; i++) {
+        meshSetElement(mesh, ELEMENT_STAIR, i);
         float x1 = -stairs.width/2;
         float x2 = stairs.width/2;
         float y1 = i * stairs.height;
@@ -376,532 +605,6531 @@ void drawSteps() {
         float z2 = (i + 1) * stepDepth;
         
         // Top of step
-        glNormal3f(0, 1, 0);
-        glVertex3f(x1, y2, z1);
-        glVertex3f(x2, y2, z1);
-        glVertex3f(x2, y2, z2);
-        glVertex3f(x1, y2, z2);
+        meshQuad(mesh, 0, 1, 0, (const float[4][3]){
+            {x1, y2, z1}, {x2, y2, z1}, {x2, y2, z2}, {x1, y2, z2}
+        });
         
         // Front of step
-        glNormal3f(0, 0, 1);
-        glVertex3f(x1, y1, z2);
-        glVertex3f(x2, y1, z2);
-        glVertex3f(x2, y2, z2);
-        glVertex3f(x1, y2, z2);
+        meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+            {x1, y1, z2}, {x2, y1, z2}, {x2, y2, z2}, {x1, y2, z2}
+        });
         
         // Sides of step
-        glNormal3f(1, 0, 0);
-        glVertex3f(x2, y1, z1);
-        glVertex3f(x2, y1, z2);
-        glVertex3f(x2, y2, z2);
-        glVertex3f(x2, y2, z1);
-        
-        glNormal3f(-1, 0, 0);
-        glVertex3f(x1, y1, z1);
-        glVertex3f(x1, y1, z2);
-        glVertex3f(x1, y2, z2);
-        glVertex3f(x1, y2, z1);
+        meshQuad(mesh, 1, 0, 0, (const float[4][3]){
+            {x2, y1, z1}, {x2, y1, z2}, {x2, y2, z2}, {x2, y2, z1}
+        });
+        meshQuad(mesh, -1, 0, 0, (const float[4][3]){
+            {x1, y1, z1}, {x1, y1, z2}, {x1, y2, z2}, {x1, y2, z1}
+        });
     }
-    glEnd();
 }
 
 
-void drawStaircase(float y) {
-    glPushMatrix();
-    
+// Staircase geometry in floor space: steps rise from the floor at y = 0
+void buildStaircase(Mesh* mesh, float width) {
     // Position stairs in the building
-    glTranslatef(buildingWidth/4, y, 0); // Place stairs on the right side
-    drawSteps();
+    Mesh steps = {0};
+    buildSteps(&steps);
+    meshAppend(mesh, &steps, 0, width/4, 0, 0); // Place stairs on the right side
+    meshFree(&steps);
     
-    // Draw landing platform
-    glBegin(GL_QUADS);
-    glNormal3f(0, 1, 0);
-    glVertex3f(-stairs.width/2, floorHeight, stairs.totalRun);
-    glVertex3f(stairs.width/2, floorHeight, stairs.totalRun);
-    glVertex3f(stairs.width/2, floorHeight, stairs.totalRun + stairs.width);
-    glVertex3f(-stairs.width/2, floorHeight, stairs.totalRun + stairs.width);
-    glEnd();
-    
-    glPopMatrix();
+    // Landing platform
+    float x = width/4;
+    meshSetElement(mesh, ELEMENT_STAIR, stairs.numSteps);
+    meshQuad(mesh, 0, 1, 0, (const float[4][3]){
+        {x - stairs.width/2, floorHeight, stairs.totalRun},
+        {x + stairs.width/2, floorHeight, stairs.totalRun},
+        {x + stairs.width/2, floorHeight, stairs.totalRun + stairs.width},
+        {x - stairs.width/2, floorHeight, stairs.totalRun + stairs.width}
+    });
 }
 
 
 
-void drawRoof() {
-    if (!showRoof) return;
+void buildRoof(Mesh* mesh, float width, float length, float y) {
+    meshSetSlot(mesh, SLOT_ROOF); // Use roof-specific material
     
-    applyMaterial(&materials[3]); // Use roof-specific material
+    // Base edge (x, z) of each face, which all meet at the apex
+    const float corners[4][2][2] = {
+        // Front face
+        {{-width/2, length/2}, {width/2, length/2}},
+        // Back face
+        {{-width/2, -length/2}, {width/2, -length/2}},
+        // Left face
+        {{-width/2, -length/2}, {-width/2, length/2}},
+        // Right face
+        {{width/2, -length/2}, {width/2, length/2}}
+    };
+    const float normals[4][3] = {
+        {0.0f, 0.5f, 1.0f}, {0.0f, 0.5f, -1.0f}, {-1.0f, 0.5f, 0.0f}, {1.0f, 0.5f, 0.0f}
+    };
     
-    glBegin(GL_TRIANGLES);
-    // Front face
-    glNormal3f(0.0f, 0.5f, 1.0f);
-    glVertex3f(-buildingWidth/2, 0, buildingLength/2);
-    glVertex3f(buildingWidth/2, 0, buildingLength/2);
-    glVertex3f(0, roofHeight, 0);
-    
-    // Back face
-    glNormal3f(0.0f, 0.5f, -1.0f);
-    glVertex3f(-buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(0, roofHeight, 0);
-    
-    // Left face
-    glNormal3f(-1.0f, 0.5f, 0.0f);
-    glVertex3f(-buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(-buildingWidth/2, 0, buildingLength/2);
-    glVertex3f(0, roofHeight, 0);
-    
-    // Right face
-    glNormal3f(1.0f, 0.5f, 0.0f);
-    glVertex3f(buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(buildingWidth/2, 0, buildingLength/2);
-    glVertex3f(0, roofHeight, 0);
-    glEnd();
+    for (int face = 0; face < 4; face++) {
+        const float* n = normals[face];
+        meshSetElement(mesh, ELEMENT_ROOF, face);
+        GLuint a = meshVertex(mesh, corners[face][0][0], y, corners[face][0][1], n[0], n[1], n[2]);
+        GLuint b = meshVertex(mesh, corners[face][1][0], y, corners[face][1][1], n[0], n[1], n[2]);
+        GLuint c = meshVertex(mesh, 0, y + roofHeight, 0, n[0], n[1], n[2]);
+        meshTriangle(mesh, a, b, c);
+    }
 }
 
-void drawFloor(float y) {
-    if (advancedLighting) {
-        // Use materials when advanced lighting is on
-        applyMaterial(&materials[currentMaterial]);
-    } else {
-        // Use basic color when advanced lighting is off
-        glColor3f(0.8f, 0.8f, 0.8f);  // Light gray color
+// Facade grammar
+// Each wall of a floor is described by a rule: split off a solid margin at
+// both ends, then repeat a pattern of bays across the rest. A grammar picks
+// the rule for every wall of the ground floor, ordinary upper floors and
+// accent floors. Evaluated walls are memoized by rule and dimensions, so
+// identical walls across a tower are generated once.
+typedef enum {
+    FACADE_WINDOW,      // a window of the bay's style
+    FACADE_STOREFRONT,  // glazing from a low bulkhead up to the ceiling
+    FACADE_BALCONY,     // a window behind a projecting slab with a balustrade
+    FACADE_BLANK        // solid wall, no opening
+} FacadeTerminal;
+
+typedef struct {
+    FacadeTerminal terminal;
+    WindowStyle style;
+    bool currentStyle;  // use currentWindowStyle (T key) instead of style
+} FacadeBay;
+
+typedef struct {
+    const char* name;
+    float margin;       // solid margin at each end, 0 uses windowSpacing
+    float gap;          // solid gap between bays, 0 uses windowSpacing
+    float bayWidth;     // 0 uses windowWidth
+    int numBays;        // bays cycle through the pattern, 0 leaves the wall blank
+    FacadeBay pattern[4];
+} FacadeRule;
+
+enum {
+    RULE_CLASSIC,
+    RULE_STOREFRONT,
+    RULE_BALCONIES,
+    RULE_MIXED,
+    RULE_PORTHOLES,
+    RULE_BLANK,
+    NUM_FACADE_RULES
+};
+
+FacadeRule facadeRules[NUM_FACADE_RULES] = {
+    // One row of identically spaced windows, the original wall layout
+    [RULE_CLASSIC] = {"classic", 0, 0, 0, 1, {
+        {FACADE_WINDOW, WINDOW_STANDARD, true}}},
+    [RULE_STOREFRONT] = {"storefront", 1.0f, 0.6f, 4.0f, 1, {
+        {FACADE_STOREFRONT, WINDOW_STANDARD, false}}},
+    [RULE_BALCONIES] = {"balconies", 0, 0, 0, 2, {
+        {FACADE_BALCONY, WINDOW_STANDARD, true},
+        {FACADE_WINDOW, WINDOW_STANDARD, true}}},
+    [RULE_MIXED] = {"mixed", 0, 0, 0, 3, {
+        {FACADE_WINDOW, WINDOW_DIVIDED, false},
+        {FACADE_WINDOW, WINDOW_ARCHED, false},
+        {FACADE_WINDOW, WINDOW_DIVIDED, false}}},
+    [RULE_PORTHOLES] = {"portholes", 0, 0, 0, 1, {
+        {FACADE_WINDOW, WINDOW_CIRCULAR, false}}},
+    [RULE_BLANK] = {"blank", 0, 0, 0, 0}
+};
+
+typedef enum {
+    WALL_FRONT,
+    WALL_BACK,
+    WALL_LEFT,
+    WALL_RIGHT,
+    NUM_WALLS
+} WallSide;
+
+typedef struct {
+    const char* name;
+    int ground[NUM_WALLS];  // rules for front, back, left, right on the ground floor
+    int upper[NUM_WALLS];   // ordinary floors above the ground
+    int accent[NUM_WALLS];  // every accentEvery-th floor above the ground
+    int accentEvery;        // 0 for no accent floors
+} FacadeGrammar;
+
+FacadeGrammar facadeGrammars[] = {
+    {"classic",
+     {RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC},
+     {RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC},
+     {RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC}, 0},
+    {"main-street",
+     {RULE_STOREFRONT, RULE_STOREFRONT, RULE_BLANK, RULE_BLANK},
+     {RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC, RULE_CLASSIC},
+     {RULE_MIXED, RULE_MIXED, RULE_CLASSIC, RULE_CLASSIC}, 4},
+    {"residential",
+     {RULE_STOREFRONT, RULE_CLASSIC, RULE_PORTHOLES, RULE_PORTHOLES},
+     {RULE_MIXED, RULE_MIXED, RULE_CLASSIC, RULE_CLASSIC},
+     {RULE_BALCONIES, RULE_BALCONIES, RULE_CLASSIC, RULE_CLASSIC}, 2}
+};
+
+#define NUM_FACADE_GRAMMARS (int)(sizeof(facadeGrammars) / sizeof(facadeGrammars[0]))
+int currentGrammar = 0;
+
+int facadeRuleFor(const FacadeGrammar* grammar, int floor, WallSide wall) {
+    if (floor == 0) return grammar->ground[wall];
+    if (grammar->accentEvery && floor % grammar->accentEvery == 0) return grammar->accent[wall];
+    return grammar->upper[wall];
+}
+
+// Everything an evaluated wall depends on
+typedef struct {
+    int rule;
+    int style;    // currentWindowStyle if the rule uses it, otherwise -1
+    int windows;  // showWindows
+    float length;
+    float floorHeight;
+    float windowWidth;
+    float windowHeight;
+    float windowSpacing;
+} FacadeKey;
+
+typedef struct {
+    bool used;
+    FacadeKey key;
+    Mesh mesh;
+} FacadeCacheEntry;
+
+#define FACADE_CACHE_SIZE 1024
+
+typedef struct {
+    FacadeCacheEntry entries[FACADE_CACHE_SIZE];
+    Mesh scratch;  // bay geometry before it is placed, reused by every evaluation
+    int count;
+    long lookups;
+    long hits;
+} FacadeCache;
+
+FacadeCache facadeCache;
+
+// FNV-1a over the raw bytes of a key
+unsigned int hashBytes(const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
     }
-    
-    glPushMatrix();
-    glTranslatef(0, y, 0);
-    
-    glBegin(GL_QUADS);
-    // Draw walls based on toggles
-    if (showFrontWall && showAllWalls) {
-        // Front wall
-        glNormal3f(0, 0, 1);
-        glVertex3f(-buildingWidth/2, 0, buildingLength/2);
-        glVertex3f(buildingWidth/2, 0, buildingLength/2);
-        glVertex3f(buildingWidth/2, floorHeight, buildingLength/2);
-        glVertex3f(-buildingWidth/2, floorHeight, buildingLength/2);
-    }
-    
-    if (showBackWall && showAllWalls) {
-        // Back wall
-        glNormal3f(0, 0, -1);
-        glVertex3f(-buildingWidth/2, 0, -buildingLength/2);
-        glVertex3f(buildingWidth/2, 0, -buildingLength/2);
-        glVertex3f(buildingWidth/2, floorHeight, -buildingLength/2);
-        glVertex3f(-buildingWidth/2, floorHeight, -buildingLength/2);
-    }
-    
-    if (showLeftWall && showAllWalls) {
-        // Left wall
-        glNormal3f(-1, 0, 0);
-        glVertex3f(-buildingWidth/2, 0, -buildingLength/2);
-        glVertex3f(-buildingWidth/2, 0, buildingLength/2);
-        glVertex3f(-buildingWidth/2, floorHeight, buildingLength/2);
-        glVertex3f(-buildingWidth/2, floorHeight, -buildingLength/2);
-    }
-    
-    if (showRightWall && showAllWalls) {
-        // Right wall
-        glNormal3f(1, 0, 0);
-        glVertex3f(buildingWidth/2, 0, -buildingLength/2);
-        glVertex3f(buildingWidth/2, 0, buildingLength/2);
-        glVertex3f(buildingWidth/2, floorHeight, buildingLength/2);
-        glVertex3f(buildingWidth/2, floorHeight, -buildingLength/2);
+    return hash;
+}
+
+void clearFacadeCache() {
+    for (int i = 0; i < FACADE_CACHE_SIZE; i++) {
+        if (facadeCache.entries[i].used) meshFree(&facadeCache.entries[i].mesh);
+        facadeCache.entries[i].used = false;
     }
+    facadeCache.count = 0;
+}
+
+// Balcony slab and balustrade in wall space, centered on x = 0 at floor level
+void buildBalcony(Mesh* mesh) {
+    float x1 = -windowWidth/2 - 0.5f;
+    float x2 = windowWidth/2 + 0.5f;
+    float depth = 1.2f;
+    float slab = 0.15f;
+    float railHeight = 1.0f;
     
-    // Floor and ceiling are always shown
-    glNormal3f(0, -1, 0);
-    glVertex3f(-buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(buildingWidth/2, 0, -buildingLength/2);
-    glVertex3f(buildingWidth/2, 0, buildingLength/2);
-    glVertex3f(-buildingWidth/2, 0, buildingLength/2);
+    meshSetSlot(mesh, SLOT_CONCRETE);
+    meshQuad(mesh, 0, 1, 0, (const float[4][3]){
+        {x1, slab, depth}, {x2, slab, depth}, {x2, slab, 0}, {x1, slab, 0}
+    });
+    meshQuad(mesh, 0, -1, 0, (const float[4][3]){
+        {x1, 0, 0}, {x2, 0, 0}, {x2, 0, depth}, {x1, 0, depth}
+    });
+    meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+        {x1, 0, depth}, {x2, 0, depth}, {x2, slab, depth}, {x1, slab, depth}
+    });
+    meshQuad(mesh, -1, 0, 0, (const float[4][3]){
+        {x1, 0, 0}, {x1, 0, depth}, {x1, slab, depth}, {x1, slab, 0}
+    });
+    meshQuad(mesh, 1, 0, 0, (const float[4][3]){
+        {x2, 0, depth}, {x2, 0, 0}, {x2, slab, 0}, {x2, slab, depth}
+    });
+    // Handrail
+    meshQuad(mesh, 0, 1, 0, (const float[4][3]){
+        {x1, railHeight, depth}, {x2, railHeight, depth},
+        {x2, railHeight, depth - 0.05f}, {x1, railHeight, depth - 0.05f}
+    });
     
-    glNormal3f(0, 1, 0);
-    glVertex3f(-buildingWidth/2, floorHeight, -buildingLength/2);
-    glVertex3f(buildingWidth/2, floorHeight, -buildingLength/2);
-    glVertex3f(buildingWidth/2, floorHeight, buildingLength/2);
-    glVertex3f(-buildingWidth/2, floorHeight, buildingLength/2);
-    glEnd();
+    // Glass balustrade below the handrail
+    meshSetSlot(mesh, SLOT_GLASS);
+    meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+        {x1, slab, depth}, {x2, slab, depth}, {x2, railHeight, depth}, {x1, railHeight, depth}
+    });
+}
+
+// Add a bay centered at x to a wall, building its pieces in a scratch mesh
+// the caller owns
+void buildBay(Mesh* mesh, Mesh* scratch, const FacadeBay* bay, int index, float x, float bayWidth) {
+    WindowStyle style = bay->currentStyle ? currentWindowStyle : bay->style;
+    float windowY = (floorHeight - windowHeight)/2;
+    int first = mesh->numIndices / 3;
     
-    // Draw windows if walls are visible
-    if (showWindows) {
-        float xStart = -buildingWidth/2 + windowSpacing;
-        float xEnd = buildingWidth/2 - windowSpacing;
-        float windowY = (floorHeight - windowHeight)/2;
-        
-        if (showFrontWall && showAllWalls) {
-            // Front windows
-            for (float x = xStart; x <= xEnd; x += windowSpacing + windowWidth) {
-                glPushMatrix();
-                glTranslatef(x, windowY, buildingLength/2);
-                drawWindow();
-                glPopMatrix();
-            }
-        }
-        
-        if (showBackWall && showAllWalls) {
-            // Back windows
-            for (float x = xStart; x <= xEnd; x += windowSpacing + windowWidth) {
-                glPushMatrix();
-                glTranslatef(x, windowY, -buildingLength/2);
-                glRotatef(180, 0, 1, 0);
-                drawWindow();
-                glPopMatrix();
-            }
-        }
-        
-        float zStart = -buildingLength/2 + windowSpacing;
-        float zEnd = buildingLength/2 - windowSpacing;
-        
-        if (showLeftWall && showAllWalls) {
-            // Left side windows
-            for (float z = zStart; z <= zEnd; z += windowSpacing + windowWidth) {
-                glPushMatrix();
-                glTranslatef(-buildingWidth/2, windowY, z);
-                glRotatef(90, 0, 1, 0);
-                drawWindow();
-                glPopMatrix();
-            }
-        }
-        
-        if (showRightWall && showAllWalls) {
-            // Right side windows
-            for (float z = zStart; z <= zEnd; z += windowSpacing + windowWidth) {
-                glPushMatrix();
-                glTranslatef(buildingWidth/2, windowY, z);
-                glRotatef(-90, 0, 1, 0);
-                drawWindow();
-                glPopMatrix();
-            }
-        }
+    meshClear(scratch);
+    switch (bay->terminal) {
+        case FACADE_WINDOW:
+            buildWindowStyle(scratch, style);
+            meshAppend(mesh, scratch, 0, x, windowY, 0);
+            meshRetag(mesh, first, ELEMENT_WINDOW, -1, index);
+            break;
+        case FACADE_STOREFRONT:
+            buildWindow(scratch, bayWidth, floorHeight - 0.8f);
+            meshAppend(mesh, scratch, 0, x, 0.5f, 0);
+            meshRetag(mesh, first, ELEMENT_WINDOW, -1, index);
+            break;
+        case FACADE_BALCONY:
+            buildWindowStyle(scratch, style);
+            meshAppend(mesh, scratch, 0, x, windowY, 0);
+            meshRetag(mesh, first, ELEMENT_WINDOW, -1, index);
+            first = mesh->numIndices / 3;
+            meshClear(scratch);
+            buildBalcony(scratch);
+            meshAppend(mesh, scratch, 0, x, 0, 0);
+            meshRetag(mesh, first, ELEMENT_BALCONY, -1, index);
+            break;
+        default:
+            break;
     }
+}
+
+// Bay layout of a rule along a wall, shared by evaluateFacade() and the
+// massing kernel so their window counts agree. Works on floats or on v4sf
+// lanes, with lift turning the rule's own sizes into the lane type. Bay
+// centers step from start by step while FACADE_BAY_FITS(x, end).
+#define FACADE_BAY_LAYOUT(rule, length, spacing, windowW, lift, start, end, step, bayWidth) do { \
+    (bayWidth) = (rule)->bayWidth > 0 ? lift((rule)->bayWidth) : (windowW); \
+    (step) = ((rule)->gap > 0 ? lift((rule)->gap) : (spacing)) + (bayWidth); \
+    (start) = -(length)/2 + ((rule)->margin > 0 ? lift((rule)->margin) : (spacing)); \
+    (end) = (length)/2 - ((rule)->margin > 0 ? lift((rule)->margin) : (spacing)); \
+} while (0)
+#define FACADE_BAY_FITS(x, end) ((x) <= (end))
+
+// Evaluate a rule into wall space: the wall runs along x centered on 0,
+// from y = 0 to floorHeight, facing +z. scratch is working space for the bays.
+void evaluateFacade(Mesh* mesh, Mesh* scratch, const FacadeRule* rule, float length) {
+    meshSetSlot(mesh, SLOT_WALL);
+    meshSetElement(mesh, ELEMENT_WALL, 0);
+    meshQuad(mesh, 0, 0, 1, (const float[4][3]){
+        {-length/2, 0, 0}, {length/2, 0, 0},
+        {length/2, floorHeight, 0}, {-length/2, floorHeight, 0}
+    });
+    if (!showWindows || rule->numBays == 0) return;
     
-    glPopMatrix();
-    // Draw staircase for all floors except the top floor
-    if (y < (numFloors - 1) * floorHeight) {
-        drawStaircase(y);
-    }
+    float xStart, xEnd, step, bayWidth;
+    FACADE_BAY_LAYOUT(rule, length, windowSpacing, windowWidth, (float), xStart, xEnd, step, bayWidth);
     
-    // Add stair opening in floor above
-    if (y > 0) {  // Don't cut hole in ground floor
-        glPushMatrix();
-        glTranslatef(buildingWidth/4, y, 0);
-        
-        // Cut opening in floor for stairwell
-        // This is done by drawing a slightly darker section
-        glColor3f(0.3f, 0.3f, 0.3f);
-        glBegin(GL_QUADS);
-        glNormal3f(0, -1, 0);
-        glVertex3f(-stairs.width/2 - 0.3f, 0, 0);
-        glVertex3f(stairs.width/2 + 0.3f, 0, 0);
-        glVertex3f(stairs.width/2 + 0.3f, 0, stairs.totalRun + stairs.width);
-        glVertex3f(-stairs.width/2 - 0.3f, 0, stairs.totalRun + stairs.width);
-        glEnd();
-        
-        glPopMatrix();
+    // Repeat: bay centers step by gap + bayWidth, as the original window loops
+    int bay = 0;
+    for (float x = xStart; FACADE_BAY_FITS(x, xEnd); x += step) {
+        buildBay(mesh, scratch, &rule->pattern[bay % rule->numBays], bay, x, bayWidth);
+        bay++;
     }
-    
-    glPopMatrix();
 }
 
-// Add function to draw railings
-void drawRailing(float length) {
-    float railHeight = 0.9f;  // Standard railing height
-    float postSpacing = 1.0f; // Space between posts
-    
-    glPushMatrix();
-    
-    // Draw main handrail
-    glColor3f(0.4f, 0.4f, 0.4f);
-    glBegin(GL_LINES);
-    glVertex3f(0, railHeight, 0);
-    glVertex3f(0, railHeight, length);
-    glEnd();
-    
-    // Draw posts
-    for(float z = 0; z <= length; z += postSpacing) {
-        glBegin(GL_LINES);
-        glVertex3f(0, 0, z);
-        glVertex3f(0, railHeight, z);
-        glEnd();
+bool ruleUsesCurrentStyle(const FacadeRule* rule) {
+    for (int i = 0; i < rule->numBays; i++) {
+        if (rule->pattern[i].currentStyle) return true;
     }
-    
-    glPopMatrix();
+    return false;
 }
 
-void drawBuilding() {
-    float y = 0;
+// Look up an evaluated wall, evaluating and caching it on a miss
+const Mesh* facadeWall(int rule, float length) {
+    FacadeKey key;
+    memset(&key, 0, sizeof(key));
+    key.rule = rule;
+    key.style = ruleUsesCurrentStyle(&facadeRules[rule]) ? (int)currentWindowStyle : -1;
+    key.windows = showWindows;
+    key.length = length;
+    key.floorHeight = floorHeight;
+    key.windowWidth = windowWidth;
+    key.windowHeight = windowHeight;
+    key.windowSpacing = windowSpacing;
     
-    // Draw floors
-    for(int floor = 0; floor < numFloors; floor++) {
-        drawFloor(y);
-        y += floorHeight;
+    facadeCache.lookups++;
+    unsigned int slot = hashBytes(&key, sizeof(key)) % FACADE_CACHE_SIZE;
+    while (facadeCache.entries[slot].used) {
+        if (memcmp(&facadeCache.entries[slot].key, &key, sizeof(key)) == 0) {
+            facadeCache.hits++;
+            return &facadeCache.entries[slot].mesh;
+        }
+        slot = (slot + 1) % FACADE_CACHE_SIZE;
     }
     
-    // Draw roof
-    glPushMatrix();
-    glTranslatef(0, y, 0);
-    drawRoof();
-    glPopMatrix();
-}
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadIdentity();
-    // First handle shadow pass if enabled
-    if (shadowsEnabled) {
-        // First pass: Render from light's perspective (shadow map)
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
-        
-        // Set up light's perspective matrix
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        gluPerspective(45.0f, 1.0f, 1.0f, 200.0f);
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-        gluLookAt(mainLight.position[0], mainLight.position[1], mainLight.position[2],
-                  0.0f, 0.0f, 0.0f,
-                  0.0f, 1.0f, 0.0f);
-        
-        // Render scene for shadow map
-        drawBuilding();
-        
-        // Second pass: Regular rendering with shadows
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // Keep probe chains short; a full flush is rare and cheap to recover from
+    if (facadeCache.count >= FACADE_CACHE_SIZE * 3 / 4) {
+        clearFacadeCache();
+        slot = hashBytes(&key, sizeof(key)) % FACADE_CACHE_SIZE;
     }
+    FacadeCacheEntry* entry = &facadeCache.entries[slot];
+    entry->used = true;
+    entry->key = key;
+    memset(&entry->mesh, 0, sizeof(Mesh));
+    evaluateFacade(&entry->mesh, &facadeCache.scratch, &facadeRules[rule], length);
+    facadeCache.count++;
+    return &entry->mesh;
+}
+
+// Floor geometry in floor space, with the floor slab at y = 0. rules gives
+// the facade rule of each wall, or -1 for a hidden wall.
+void buildFloor(Mesh* mesh, float width, float length, const int rules[NUM_WALLS],
+                bool stairwell, bool opening) {
+    // Where each wall's facade is placed: quarter turns about +y and offset
+    const int turns[NUM_WALLS] = {0, 2, 3, 1};
+    const float offsets[NUM_WALLS][2] = {
+        {0, length/2}, {0, -length/2},
+        {-width/2, 0}, {width/2, 0}
+    };
+    const float lengths[NUM_WALLS] = {width, width, length, length};
     
-    // Normal rendering pass
-    glViewport(0, 0, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    // Set up camera view
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(30.0f, (float)glutGet(GLUT_WINDOW_WIDTH)/glutGet(GLUT_WINDOW_HEIGHT), 0.1f, 500.0f);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    
-    // Calculate camera position
-    float camX = cameraDistance * sin(cameraAngleY) * cos(cameraAngleX);
-    float camY = cameraDistance * sin(cameraAngleX) + (buildingHeight / 2.0f);
-    float camZ = cameraDistance * cos(cameraAngleY) * cos(cameraAngleX);
-    
-    // Set camera
-    gluLookAt(camX, camY, camZ,
-              0, buildingHeight / 2.0f, 0,
-              0, 1, 0);
+    for (int wall = 0; wall < NUM_WALLS; wall++) {
+        if (rules[wall] < 0) continue;
+        const Mesh* facade = facadeWall(rules[wall], lengths[wall]);
+        int first = mesh->numIndices / 3;
+        meshAppend(mesh, facade, turns[wall], offsets[wall][0], 0, offsets[wall][1]);
+        meshRetag(mesh, first, -1, wall, -1);
+    }
     
-    // Draw coordinate axes
-    glDisable(GL_LIGHTING);
-    glBegin(GL_LINES);
-    glColor3f(1,0,0); glVertex3f(0,0,0); glVertex3f(10,0,0);
-    glColor3f(0,1,0); glVertex3f(0,0,0); glVertex3f(0,10,0);
-    glColor3f(0,0,1); glVertex3f(0,0,0); glVertex3f(0,0,10);
-    glEnd();
+    // Floor and ceiling are always shown
+    meshSetSlot(mesh, SLOT_WALL);
+    meshSetElement(mesh, ELEMENT_FLOOR, 0);
+    meshQuad(mesh, 0, -1, 0, (const float[4][3]){
+        {-width/2, 0, -length/2}, {width/2, 0, -length/2},
+        {width/2, 0, length/2}, {-width/2, 0, length/2}
+    });
+    meshQuad(mesh, 0, 1, 0, (const float[4][3]){
+        {-width/2, floorHeight, -length/2}, {width/2, floorHeight, -length/2},
+        {width/2, floorHeight, length/2}, {-width/2, floorHeight, length/2}
+    });
     
-    // Enable lighting for the building
-    if (advancedLighting) {
-        glEnable(GL_LIGHTING);
+    // Staircase for all floors except the top floor
+    if (stairwell) {
+        buildStaircase(mesh, width);
     }
     
-    // Draw the building
-    drawBuilding();
-    
-    // Single buffer swap at the end
-    glutSwapBuffers();
+    // Stair opening in floors above the ground, drawn as a darker section
+    if (opening) {
+        float x = width/4;
+        meshSetSlot(mesh, SLOT_OPENING);
+        meshSetElement(mesh, ELEMENT_FLOOR, 0);
+        meshQuad(mesh, 0, -1, 0, (const float[4][3]){
+            {x - stairs.width/2 - 0.3f, 0.01f, 0},
+            {x + stairs.width/2 + 0.3f, 0.01f, 0},
+            {x + stairs.width/2 + 0.3f, 0.01f, stairs.totalRun + stairs.width},
+            {x - stairs.width/2 - 0.3f, 0.01f, stairs.totalRun + stairs.width}
+        });
+    }
 }
 
-void reshape(int w, int h) {
-    glViewport(0, 0, w, h);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(30.0f, (float)w/h, 0.1f, 500.0f);
-    glMatrixMode(GL_MODELVIEW);
-}
+// Shared meshes
+// Every floor of a building is a translated copy of one of a handful of floor
+// types (ground, plain upper, accent, top), and buildings with matching
+// parameters repeat the same types again. Each unique floor configuration is
+// generated and uploaded once, keyed by everything that affects its geometry,
+// and drawn once per instance with a translation.
+#define MAX_FLOORS 20
 
-void mouseFunc(int button, int state, int x, int y) {
-    if(button == GLUT_LEFT_BUTTON) {
-        mouseLeftDown = (state == GLUT_DOWN);
-        mouseX = x;
-        mouseY = y;
-    }
-    else if(button == GLUT_RIGHT_BUTTON) {
-        mouseRightDown = (state == GLUT_DOWN);
-        mouseX = x;
-        mouseY = y;
-    }
-}
+typedef enum {
+    SHARED_FLOOR,
+    SHARED_ROOF
+} SharedMeshKind;
 
-void motionFunc(int x, int y) {
-    if(mouseLeftDown) {
-        cameraAngleY += (x - mouseX) * 0.01f;
-        cameraAngleX += (y - mouseY) * 0.01f;
+typedef struct {
+    int kind;
+    int rules[NUM_WALLS];  // facade rule per wall, -1 where the wall is hidden
+    int stairwell;
+    int opening;
+    int style;
+    int windows;
+    float width;
+    float length;
+    float floorHeight;
+    float windowWidth;
+    float windowHeight;
+    float windowSpacing;
+    float roofHeight;
+} SharedMeshKey;
+
+typedef struct {
+    SharedMeshKey key;
+    Mesh mesh;
+    float boundsMin[3];     // in mesh space
+    float boundsMax[3];
+    float (*instances)[3];  // translation of every copy in the scene
+    int numInstances;
+    int capInstances;
+} SharedMesh;
+
+#define MESH_STORE_LIMIT 4096  // flush beyond this many meshes between generations
+
+typedef struct {
+    SharedMesh* meshes;
+    int count;
+    int capacity;
+    int* table;                    // open addressing into meshes, -1 when empty
+    int tableSize;
+    int generation;                // bumped whenever the store is flushed
+    long lookups;
+    long hits;
+} MeshStore;
+
+MeshStore meshStore;
+
+typedef struct {
+    float width;
+    float length;
+    int numFloors;
+    int grammar;
+} BuildingParams;
+
+typedef struct {
+    BuildingParams params;
+    float x, z;                   // center of the footprint
+    float boundsMin[3];           // world space bounds of all floors and the roof
+    float boundsMax[3];
+    int floorMeshes[MAX_FLOORS];  // shared mesh of every floor
+    int roofMesh;                 // -1 when the roof is hidden
+} SceneBuilding;
+
+typedef struct {
+    SceneBuilding* buildings;
+    int numBuildings;
+    int selected;                 // building edited by the keyboard
+    int revision;                 // bumped whenever buildings are resolved or loaded
+    float radius;                 // bounding radius of all footprints
+} Scene;
+
+Scene scene;
+
+void clearMeshStore() {
+    for (int i = 0; i < meshStore.count; i++) {
+        meshFree(&meshStore.meshes[i].mesh);
+        free(meshStore.meshes[i].instances);
+    }
+    meshStore.count = 0;
+    meshStore.generation++;
+    for (int i = 0; i < meshStore.tableSize; i++) {
+        meshStore.table[i] = -1;
+    }
+}
+
+// Flush the store once it has grown past its limit. Only called between
+// generations, so indices held by buildings stay valid while they are resolved.
+void trimMeshStore() {
+    if (meshStore.count > MESH_STORE_LIMIT) {
+        clearMeshStore();
+    }
+}
+
+// Rebuild the hash table at twice the size
+void growMeshTable() {
+    free(meshStore.table);
+    meshStore.tableSize = meshStore.tableSize ? meshStore.tableSize * 2 : 1024;
+    meshStore.table = malloc(meshStore.tableSize * sizeof(int));
+    for (int i = 0; i < meshStore.tableSize; i++) {
+        meshStore.table[i] = -1;
+    }
+    for (int index = 0; index < meshStore.count; index++) {
+        unsigned int slot = hashBytes(&meshStore.meshes[index].key, sizeof(SharedMeshKey)) %
+                            meshStore.tableSize;
+        while (meshStore.table[slot] >= 0) {
+            slot = (slot + 1) % meshStore.tableSize;
+        }
+        meshStore.table[slot] = index;
+    }
+}
+
+void initSharedKey(SharedMeshKey* key, SharedMeshKind kind, const BuildingParams* params) {
+    memset(key, 0, sizeof(SharedMeshKey));
+    key->kind = kind;
+    key->width = params->width;
+    key->length = params->length;
+    key->floorHeight = floorHeight;
+    if (kind == SHARED_ROOF) {
+        key->roofHeight = roofHeight;
+        return;
+    }
+    key->style = currentWindowStyle;
+    key->windows = showWindows;
+    key->windowWidth = windowWidth;
+    key->windowHeight = windowHeight;
+    key->windowSpacing = windowSpacing;
+}
+
+void buildSharedMesh(Mesh* mesh, const SharedMeshKey* key) {
+    if (key->kind == SHARED_ROOF) {
+        buildRoof(mesh, key->width, key->length, 0);
+    } else {
+        buildFloor(mesh, key->width, key->length, key->rules, key->stairwell, key->opening);
+    }
+}
+
+// Find a key in the store. Returns its index, or -1 with *emptySlot set to
+// the table slot where it would be inserted.
+int findSharedMesh(const SharedMeshKey* key, unsigned int* emptySlot) {
+    if (meshStore.count >= meshStore.tableSize / 2) {
+        growMeshTable();
+    }
+    unsigned int slot = hashBytes(key, sizeof(SharedMeshKey)) % meshStore.tableSize;
+    while (meshStore.table[slot] >= 0) {
+        int index = meshStore.table[slot];
+        if (memcmp(&meshStore.meshes[index].key, key, sizeof(SharedMeshKey)) == 0) {
+            return index;
+        }
+        slot = (slot + 1) % meshStore.tableSize;
+    }
+    *emptySlot = slot;
+    return -1;
+}
+
+// Append an empty entry for a key at the slot findSharedMesh() returned
+int addSharedMesh(const SharedMeshKey* key, unsigned int slot) {
+    if (meshStore.count == meshStore.capacity) {
+        meshStore.capacity = meshStore.capacity ? meshStore.capacity * 2 : 64;
+        meshStore.meshes = realloc(meshStore.meshes, meshStore.capacity * sizeof(SharedMesh));
+    }
+    int index = meshStore.count++;
+    SharedMesh* shared = &meshStore.meshes[index];
+    memset(shared, 0, sizeof(SharedMesh));
+    shared->key = *key;
+    meshStore.table[slot] = index;
+    return index;
+}
+
+void computeMeshBounds(const Mesh* mesh, float boundsMin[3], float boundsMax[3]) {
+    boundsMin[0] = boundsMin[1] = boundsMin[2] = mesh->numVerts ? INFINITY : 0;
+    boundsMax[0] = boundsMax[1] = boundsMax[2] = mesh->numVerts ? -INFINITY : 0;
+    for (int i = 0; i < mesh->numVerts; i++) {
+        const float* p = &mesh->verts[i].x;
+        for (int axis = 0; axis < 3; axis++) {
+            if (p[axis] < boundsMin[axis]) boundsMin[axis] = p[axis];
+            if (p[axis] > boundsMax[axis]) boundsMax[axis] = p[axis];
+        }
+    }
+}
+
+// Find the shared mesh for a key, generating it on first use
+int sharedMesh(const SharedMeshKey* key) {
+    unsigned int slot;
+    meshStore.lookups++;
+    int index = findSharedMesh(key, &slot);
+    if (index >= 0) {
+        meshStore.hits++;
+        return index;
+    }
+    
+    index = addSharedMesh(key, slot);
+    SharedMesh* shared = &meshStore.meshes[index];
+    buildSharedMesh(&shared->mesh, key);
+    computeMeshBounds(&shared->mesh, shared->boundsMin, shared->boundsMax);
+    return index;
+}
+
+void addInstance(int index, float x, float y, float z) {
+    SharedMesh* shared = &meshStore.meshes[index];
+    if (shared->numInstances == shared->capInstances) {
+        shared->capInstances = shared->capInstances ? shared->capInstances * 2 : 16;
+        shared->instances = realloc(shared->instances, shared->capInstances * sizeof(float[3]));
+    }
+    shared->instances[shared->numInstances][0] = x;
+    shared->instances[shared->numInstances][1] = y;
+    shared->instances[shared->numInstances][2] = z;
+    shared->numInstances++;
+}
+
+// Union of the bounds of a building's floor and roof instances
+void computeBuildingBounds(SceneBuilding* building) {
+    int numParts = building->params.numFloors + (building->roofMesh >= 0);
+    for (int axis = 0; axis < 3; axis++) {
+        building->boundsMin[axis] = INFINITY;
+        building->boundsMax[axis] = -INFINITY;
+    }
+    for (int i = 0; i < numParts; i++) {
+        bool roof = i == building->params.numFloors;
+        const SharedMesh* shared = &meshStore.meshes[roof ? building->roofMesh : building->floorMeshes[i]];
+        float offset[3] = {building->x, i * floorHeight, building->z};
+        for (int axis = 0; axis < 3; axis++) {
+            building->boundsMin[axis] = fminf(building->boundsMin[axis], shared->boundsMin[axis] + offset[axis]);
+            building->boundsMax[axis] = fmaxf(building->boundsMax[axis], shared->boundsMax[axis] + offset[axis]);
+        }
+    }
+}
+
+// Resolve every floor of a building to its shared floor type
+void resolveBuilding(SceneBuilding* building) {
+    const BuildingParams* params = &building->params;
+    const FacadeGrammar* grammar = &facadeGrammars[params->grammar];
+    bool visible[NUM_WALLS] = {
+        showFrontWall && showAllWalls, showBackWall && showAllWalls,
+        showLeftWall && showAllWalls, showRightWall && showAllWalls
+    };
+    SharedMeshKey key;
+    
+    for (int floor = 0; floor < params->numFloors; floor++) {
+        initSharedKey(&key, SHARED_FLOOR, params);
+        for (int wall = 0; wall < NUM_WALLS; wall++) {
+            key.rules[wall] = visible[wall] ? facadeRuleFor(grammar, floor, wall) : -1;
+        }
+        key.stairwell = floor < params->numFloors - 1;
+        key.opening = floor > 0;
+        building->floorMeshes[floor] = sharedMesh(&key);
+    }
+    
+    building->roofMesh = -1;
+    if (showRoof) {
+        initSharedKey(&key, SHARED_ROOF, params);
+        building->roofMesh = sharedMesh(&key);
+    }
+    computeBuildingBounds(building);
+}
+
+// Add a resolved building's floors and roof to the instance lists
+void instanceBuilding(const SceneBuilding* building) {
+    for (int floor = 0; floor < building->params.numFloors; floor++) {
+        addInstance(building->floorMeshes[floor], building->x, floor * floorHeight, building->z);
+    }
+    if (building->roofMesh >= 0) {
+        addInstance(building->roofMesh, building->x,
+                    building->params.numFloors * floorHeight, building->z);
+    }
+}
+
+void clearInstances() {
+    for (int i = 0; i < meshStore.count; i++) {
+        meshStore.meshes[i].numInstances = 0;
+    }
+}
+
+size_t meshBytes(const Mesh* mesh) {
+    return mesh->numVerts * sizeof(Vertex) + mesh->numIndices * sizeof(GLuint) +
+           mesh->numIndices / 3 * sizeof(MeshTag);
+}
+
+bool geometryDirty = true;  // set by edits that change the generated geometry
+
+void generateScene() {
+    double t0 = nowSeconds();
+    long wallLookups = facadeCache.lookups;
+    long wallHits = facadeCache.hits;
+    
+    // Keyboard edits apply to the selected building
+    SceneBuilding* selected = &scene.buildings[scene.selected];
+    selected->params = (BuildingParams){buildingWidth, buildingLength, numFloors, currentGrammar};
+    
+    trimMeshStore();
+    clearInstances();
+    for (int b = 0; b < scene.numBuildings; b++) {
+        resolveBuilding(&scene.buildings[b]);
+    }
+    for (int b = 0; b < scene.numBuildings; b++) {
+        instanceBuilding(&scene.buildings[b]);
+    }
+    scene.revision++;
+    geometryDirty = false;
+    double seconds = nowSeconds() - t0;
+    
+    // Memory actually held versus one mesh per floor instance
+    int uniqueFloors = 0, totalFloors = 0, roofs = 0;
+    size_t sharedBytes = 0, instancedBytes = 0;
+    for (int i = 0; i < meshStore.count; i++) {
+        const SharedMesh* shared = &meshStore.meshes[i];
+        if (!shared->numInstances) continue;
+        if (shared->key.kind == SHARED_FLOOR) {
+            uniqueFloors++;
+            totalFloors += shared->numInstances;
+        } else {
+            roofs++;
+        }
+        sharedBytes += meshBytes(&shared->mesh);
+        instancedBytes += meshBytes(&shared->mesh) * shared->numInstances;
+    }
+    wallLookups = facadeCache.lookups - wallLookups;
+    wallHits = facadeCache.hits - wallHits;
+    
+    printf("Scene: %d buildings generated in %.2f ms (%.3f ms per building), wall cache %ld/%ld hits\n",
+           scene.numBuildings, seconds * 1000.0, seconds * 1000.0 / scene.numBuildings,
+           wallHits, wallLookups);
+    printf("Scene: %d floors from %d unique floor types, %d unique roofs; %.1f KB of meshes instead of %.1f KB (%.0f%% saved)\n",
+           totalFloors, uniqueFloors, roofs, sharedBytes / 1024.0, instancedBytes / 1024.0,
+           instancedBytes ? 100.0 * (1.0 - (double)sharedBytes / instancedBytes) : 0.0);
+}
+
+// Copy a mesh into vertex and index buffers, once
+void uploadMesh(Mesh* mesh) {
+    if (mesh->vbo) return;
+    glGenBuffers(1, &mesh->vbo);
+    glGenBuffers(1, &mesh->ibo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBufferData(GL_ARRAY_BUFFER, mesh->numVerts * sizeof(Vertex), mesh->verts, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->numIndices * sizeof(GLuint), mesh->indices,
+                 GL_STATIC_DRAW);
+}
+
+void bindMesh(Mesh* mesh) {
+    uploadMesh(mesh);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, x));
+    glNormalPointer(GL_FLOAT, sizeof(Vertex), (void*)offsetof(Vertex, nx));
+}
+
+// Lightmaps
+// With lightmaps on, the advanced lighting is not evaluated per vertex but
+// read from a texture baked once per shared mesh: direct light from both
+// directional lights with shadows, and ambient light with occlusion from
+// ledges, balconies and recesses. Texels hold the light reaching the surface
+// at half scale, and are modulated with the material's diffuse color at twice
+// scale. Meshes are baked in the background and lit by GL until
+// their bake is done.
+typedef struct {
+    bool baked;
+    int width, height;
+    float (*uvs)[2];          // per vertex
+    unsigned char* texels;    // RGB
+    GLuint texture, uvBuffer;
+} Lightmap;
+
+typedef struct {
+    Lightmap* maps;           // parallel to meshStore.meshes
+    int count;
+    int generation;           // mesh store generation the maps belong to
+    int bakes;                // finished bakes, which change how meshes are lit
+    size_t bytes;
+} LightmapStore;
+
+LightmapStore lightmaps;
+bool lightmapsEnabled = false;
+
+void freeLightmap(Lightmap* map) {
+    if (map->texture) {
+        glDeleteTextures(1, &map->texture);
+        glDeleteBuffers(1, &map->uvBuffer);
+    }
+    free(map->uvs);
+    free(map->texels);
+    memset(map, 0, sizeof(Lightmap));
+}
+
+void uploadLightmap(Lightmap* map, int numVerts) {
+    if (map->texture) return;
+    glGenTextures(1, &map->texture);
+    glBindTexture(GL_TEXTURE_2D, map->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, map->width, map->height, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, map->texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenBuffers(1, &map->uvBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, map->uvBuffer);
+    glBufferData(GL_ARRAY_BUFFER, numVerts * sizeof(float[2]), map->uvs, GL_STATIC_DRAW);
+}
+
+// Bind a shared mesh's buffers, and its lightmap when lightmaps are on and
+// it has been baked. Returns whether the lightmap replaces GL lighting.
+bool bindSharedMesh(int id) {
+    Mesh* mesh = &meshStore.meshes[id].mesh;
+    bool baked = lightmapsEnabled && advancedLighting && lightmaps.generation == meshStore.generation &&
+                 id < lightmaps.count && lightmaps.maps[id].baked;
+    if (baked) {
+        Lightmap* map = &lightmaps.maps[id];
+        uploadLightmap(map, mesh->numVerts);
+        glDisable(GL_LIGHTING);
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, map->texture);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_MODULATE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_TEXTURE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_PRIMARY_COLOR);
+        glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_ALPHA, GL_REPLACE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_ALPHA, GL_PRIMARY_COLOR);
+        glTexEnvf(GL_TEXTURE_ENV, GL_RGB_SCALE, 2.0f);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, map->uvBuffer);
+        glTexCoordPointer(2, GL_FLOAT, 0, NULL);
+    }
+    bindMesh(mesh);
+    return baked;
+}
+
+// Set up a part's material, as a plain color when a lightmap provides the light
+void applyMeshSlot(MaterialSlot slot, bool baked) {
+    if (baked) {
+        glColor4fv(slotMaterial(slot)->diffuse);
+    } else {
+        applySlot(slot);
+    }
+}
+
+void unbindLightmap(bool baked) {
+    if (!baked) return;
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexEnvf(GL_TEXTURE_ENV, GL_RGB_SCALE, 1.0f);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glEnable(GL_LIGHTING);
+}
+
+// Draw every instance of a shared mesh, switching materials once per part
+void drawInstances(SharedMesh* shared) {
+    Mesh* mesh = &shared->mesh;
+    if (!shared->numInstances || !mesh->numIndices) return;
+    
+    bool baked = bindSharedMesh(shared - meshStore.meshes);
+    for (int p = 0; p < mesh->numParts; p++) {
+        const MeshPart* part = &mesh->parts[p];
+        applyMeshSlot(part->slot, baked);
+        for (int i = 0; i < shared->numInstances; i++) {
+            glPushMatrix();
+            glTranslatef(shared->instances[i][0], shared->instances[i][1], shared->instances[i][2]);
+            glDrawElements(GL_TRIANGLES, part->numIndices, GL_UNSIGNED_INT,
+                           (void*)(part->firstIndex * sizeof(GLuint)));
+            glPopMatrix();
+        }
+    }
+    unbindLightmap(baked);
+}
+
+void drawScene() {
+    if (geometryDirty) {
+        generateScene();
+    }
+    
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    for (int i = 0; i < meshStore.count; i++) {
+        drawInstances(&meshStore.meshes[i]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// Make a building the one edited by the keyboard
+void selectBuilding(int index) {
+    const BuildingParams* params = &scene.buildings[index].params;
+    scene.selected = index;
+    buildingWidth = params->width;
+    buildingLength = params->length;
+    numFloors = params->numFloors;
+    currentGrammar = params->grammar;
+    buildingHeight = numFloors * floorHeight;
+}
+
+// A scene holding just the building entered at the prompt
+void initSingleBuildingScene() {
+    scene.numBuildings = 1;
+    scene.buildings = calloc(1, sizeof(SceneBuilding));
+    scene.buildings[0].params = (BuildingParams){buildingWidth, buildingLength, numFloors, currentGrammar};
+    scene.radius = sqrtf(buildingWidth * buildingWidth + buildingLength * buildingLength) / 2;
+}
+
+// A grid of buildings drawn from a few archetypes, so that many share
+// footprints and facades while their heights vary
+void initCityScene(int count, unsigned int seed) {
+    static const BuildingParams archetypes[] = {
+        {20.0f, 30.0f, 0, 0},
+        {16.0f, 16.0f, 0, 1},
+        {24.0f, 18.0f, 0, 2},
+        {12.0f, 20.0f, 0, 1}
+    };
+    const int numArchetypes = sizeof(archetypes) / sizeof(archetypes[0]);
+    const float blockSize = 40.0f;
+    int columns = (int)ceil(sqrt(count));
+    
+    srand(seed);
+    scene.numBuildings = count;
+    scene.buildings = calloc(count, sizeof(SceneBuilding));
+    for (int i = 0; i < count; i++) {
+        SceneBuilding* building = &scene.buildings[i];
+        building->params = archetypes[rand() % numArchetypes];
+        building->params.numFloors = 3 + rand() % (MAX_FLOORS - 2);
+        building->x = (i % columns - (columns - 1) / 2.0f) * blockSize;
+        building->z = (i / columns - (columns - 1) / 2.0f) * blockSize;
+    }
+    scene.radius = columns * blockSize * 0.75f;
+    selectBuilding(0);
+}
+
+// Camera limits grow with the scene so a whole city stays reachable
+float maxCameraDistance() {
+    return fmaxf(200.0f, 3.0f * scene.radius);
+}
+
+// Impostors
+// Buildings far enough away to cover only a few dozen pixels are drawn as a
+// single textured quad. The images live in one atlas texture, one cell per
+// building configuration and view direction, with the direction quantized
+// into yaw and pitch buckets. A cell is only rendered when a bucket or
+// configuration is first needed, so nothing is refreshed while the view
+// stays inside the same buckets; cells that go unused are recycled.
+#define IMPOSTOR_ATLAS_SIZE 2048
+#define IMPOSTOR_CELL_SIZE 64
+#define IMPOSTOR_CELLS_PER_ROW (IMPOSTOR_ATLAS_SIZE / IMPOSTOR_CELL_SIZE)
+#define IMPOSTOR_CELLS (IMPOSTOR_CELLS_PER_ROW * IMPOSTOR_CELLS_PER_ROW)
+#define IMPOSTOR_TABLE_SIZE 2048
+#define IMPOSTOR_YAW_BUCKETS 16     // 22.5 degrees
+#define IMPOSTOR_PITCH_BUCKETS 4    // 0 to 67.5 degrees in 22.5 degree steps
+#define IMPOSTOR_PIXELS 32.0f       // buildings with a smaller screen radius use impostors
+#define IMPOSTOR_REFRESH_BUDGET 32  // cells rendered per frame at most
+
+typedef struct {
+    int meshes[MAX_FLOORS + 1];  // floor meshes, then the roof
+    int numFloors;
+    int generation;              // of the mesh store the ids belong to
+    int yaw, pitch;              // direction buckets
+    // No position: the lights are directional, so copies light alike anywhere
+    int lighting;                // advancedLighting, lightmapsEnabled in bit 1
+    int bakes;                   // lightmap bakes finished, with lightmaps on
+    int material;                // currentMaterial, which shades the walls
+} ImpostorKey;
+
+typedef struct {
+    ImpostorKey key;
+    bool used;
+    int next;                    // hash chain, -1 at the end
+    unsigned int lastFrame;      // last frame the cell was drawn
+} ImpostorCell;
+
+// A building a packet wants drawn as an impostor
+typedef struct {
+    int building;
+    int yaw, pitch;
+    int cell;                    // resolved on the GLUT thread, -1 falls back to a box
+} ImpostorInstance;
+
+typedef struct {
+    GLuint texture;
+    GLuint fbo, colorBuffer, depthBuffer;  // one cell's worth of render target
+    ImpostorCell cells[IMPOSTOR_CELLS];
+    int table[IMPOSTOR_TABLE_SIZE];
+    int numUsed;
+    unsigned int frame;
+    
+    // Counters since startup
+    int frames;
+    long drawn, refreshes, fallbacks;
+    double trianglesReplaced;    // full geometry triangles the quads stood in for
+    double refreshSeconds;
+} ImpostorAtlas;
+
+ImpostorAtlas impostors;
+bool impostorsEnabled = true;
+
+void impostorDirection(int yaw, int pitch, float direction[3]) {
+    float angleY = yaw * 2.0f * M_PI / IMPOSTOR_YAW_BUCKETS;
+    float angleX = pitch * 0.5f * M_PI / IMPOSTOR_PITCH_BUCKETS;
+    direction[0] = sinf(angleY) * cosf(angleX);
+    direction[1] = sinf(angleX);
+    direction[2] = cosf(angleY) * cosf(angleX);
+}
+
+// Direction buckets for viewing a point from the eye
+void impostorBuckets(const float eye[3], const float center[3], int* yaw, int* pitch) {
+    float dx = eye[0] - center[0], dy = eye[1] - center[1], dz = eye[2] - center[2];
+    float angleY = atan2f(dx, dz);
+    float angleX = atan2f(dy, sqrtf(dx * dx + dz * dz));
+    *yaw = ((int)lroundf(angleY * IMPOSTOR_YAW_BUCKETS / (2.0f * M_PI)) + IMPOSTOR_YAW_BUCKETS) %
+           IMPOSTOR_YAW_BUCKETS;
+    *pitch = (int)lroundf(angleX * IMPOSTOR_PITCH_BUCKETS / (0.5f * M_PI));
+    if (*pitch < 0) *pitch = 0;
+    if (*pitch >= IMPOSTOR_PITCH_BUCKETS) *pitch = IMPOSTOR_PITCH_BUCKETS - 1;
+}
+
+void initImpostorAtlas() {
+    glGenTextures(1, &impostors.texture);
+    glBindTexture(GL_TEXTURE_2D, impostors.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    glGenFramebuffers(1, &impostors.fbo);
+    glGenRenderbuffers(1, &impostors.colorBuffer);
+    glGenRenderbuffers(1, &impostors.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, impostors.colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+    glBindRenderbuffer(GL_RENDERBUFFER, impostors.depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+    glBindFramebuffer(GL_FRAMEBUFFER, impostors.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, impostors.colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, impostors.depthBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    for (int i = 0; i < IMPOSTOR_TABLE_SIZE; i++) {
+        impostors.table[i] = -1;
+    }
+}
+
+size_t impostorAtlasBytes() {
+    return (size_t)IMPOSTOR_ATLAS_SIZE * IMPOSTOR_ATLAS_SIZE * 4 +
+           (size_t)IMPOSTOR_CELL_SIZE * IMPOSTOR_CELL_SIZE * 8;
+}
+
+void initImpostorKey(ImpostorKey* key, const SceneBuilding* building, int yaw, int pitch) {
+    memset(key, 0, sizeof(ImpostorKey));
+    memcpy(key->meshes, building->floorMeshes, building->params.numFloors * sizeof(int));
+    key->meshes[building->params.numFloors] = building->roofMesh;
+    key->numFloors = building->params.numFloors;
+    key->generation = meshStore.generation;
+    key->yaw = yaw;
+    key->pitch = pitch;
+    key->lighting = advancedLighting | lightmapsEnabled << 1;
+    key->bakes = lightmapsEnabled ? lightmaps.bakes : 0;
+    key->material = currentMaterial;
+}
+
+// Render a building into an atlas cell, looking at it along a bucket's direction
+void renderImpostor(const SceneBuilding* building, int yaw, int pitch, int cell) {
+    double t0 = nowSeconds();
+    float center[3], radius2 = 0.0f, direction[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float size = building->boundsMax[axis] - building->boundsMin[axis];
+        center[axis] = (building->boundsMin[axis] + building->boundsMax[axis]) / 2;
+        radius2 += size * size / 4;
+    }
+    float radius = sqrtf(radius2);
+    center[0] -= building->x;
+    center[2] -= building->z;
+    impostorDirection(yaw, pitch, direction);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, impostors.fbo);
+    glViewport(0, 0, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+    
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(-radius, radius, -radius, radius, 0.1f, 4.0f * radius);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    gluLookAt(center[0] + 2.0f * radius * direction[0],
+              center[1] + 2.0f * radius * direction[1],
+              center[2] + 2.0f * radius * direction[2],
+              center[0], center[1], center[2],
+              0, 1, 0);
+    positionLights();
+    
+    if (advancedLighting) glEnable(GL_LIGHTING); else glDisable(GL_LIGHTING);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    int numParts = building->params.numFloors + 1;
+    for (int i = 0; i < numParts; i++) {
+        int id = i < building->params.numFloors ? building->floorMeshes[i] : building->roofMesh;
+        if (id < 0) continue;
+        Mesh* mesh = &meshStore.meshes[id].mesh;
+        if (!mesh->numIndices) continue;
+        bool baked = bindSharedMesh(id);
+        glPushMatrix();
+        glTranslatef(0.0f, i * floorHeight, 0.0f);
+        for (int p = 0; p < mesh->numParts; p++) {
+            applyMeshSlot(mesh->parts[p].slot, baked);
+            glDrawElements(GL_TRIANGLES, mesh->parts[p].numIndices, GL_UNSIGNED_INT,
+                           (void*)(mesh->parts[p].firstIndex * sizeof(GLuint)));
+        }
+        glPopMatrix();
+        unbindLightmap(baked);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    
+    // Copy into the cell
+    glBindTexture(GL_TEXTURE_2D, impostors.texture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0,
+                        cell % IMPOSTOR_CELLS_PER_ROW * IMPOSTOR_CELL_SIZE,
+                        cell / IMPOSTOR_CELLS_PER_ROW * IMPOSTOR_CELL_SIZE,
+                        0, 0, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    impostors.refreshes++;
+    impostors.refreshSeconds += nowSeconds() - t0;
+}
+
+void unlinkImpostorCell(int cell) {
+    unsigned int bucket = hashBytes(&impostors.cells[cell].key, sizeof(ImpostorKey)) % IMPOSTOR_TABLE_SIZE;
+    int* link = &impostors.table[bucket];
+    while (*link != cell) {
+        link = &impostors.cells[*link].next;
+    }
+    *link = impostors.cells[cell].next;
+}
+
+// Find the atlas cell for a building seen from a direction bucket, rendering
+// it if needed and the frame's refresh budget allows. Returns -1 otherwise.
+int findImpostor(const SceneBuilding* building, int yaw, int pitch, int* refreshBudget) {
+    ImpostorKey key;
+    initImpostorKey(&key, building, yaw, pitch);
+    unsigned int bucket = hashBytes(&key, sizeof(ImpostorKey)) % IMPOSTOR_TABLE_SIZE;
+    for (int cell = impostors.table[bucket]; cell >= 0; cell = impostors.cells[cell].next) {
+        if (memcmp(&impostors.cells[cell].key, &key, sizeof(ImpostorKey)) == 0) {
+            impostors.cells[cell].lastFrame = impostors.frame;
+            return cell;
+        }
+    }
+    if (*refreshBudget <= 0) return -1;
+    
+    // Take a free cell, or the least recently drawn one not needed this frame
+    int cell = -1;
+    if (impostors.numUsed < IMPOSTOR_CELLS) {
+        cell = impostors.numUsed++;
+    } else {
+        unsigned int oldest = impostors.frame;
+        for (int i = 0; i < IMPOSTOR_CELLS; i++) {
+            if (impostors.cells[i].lastFrame < oldest) {
+                oldest = impostors.cells[i].lastFrame;
+                cell = i;
+            }
+        }
+        if (cell < 0) return -1;
+        unlinkImpostorCell(cell);
+    }
+    
+    ImpostorCell* entry = &impostors.cells[cell];
+    entry->key = key;
+    entry->used = true;
+    entry->lastFrame = impostors.frame;
+    entry->next = impostors.table[bucket];
+    impostors.table[bucket] = cell;
+    (*refreshBudget)--;
+    renderImpostor(building, yaw, pitch, cell);
+    return cell;
+}
+
+// Draw impostor quads facing along their cell's direction, with the cell's
+// image alpha-tested onto the scene
+void drawImpostors(const ImpostorInstance* instances, int count) {
+    const float cellUV = (float)IMPOSTOR_CELL_SIZE / IMPOSTOR_ATLAS_SIZE;
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, impostors.texture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.1f);
+    glBegin(GL_QUADS);
+    for (int i = 0; i < count; i++) {
+        const ImpostorInstance* instance = &instances[i];
+        if (instance->cell < 0) continue;
+        const SceneBuilding* building = &scene.buildings[instance->building];
+        float center[3], radius2 = 0.0f, f[3], s[3], u[3];
+        for (int axis = 0; axis < 3; axis++) {
+            float size = building->boundsMax[axis] - building->boundsMin[axis];
+            center[axis] = (building->boundsMin[axis] + building->boundsMax[axis]) / 2;
+            radius2 += size * size / 4;
+        }
+        float radius = sqrtf(radius2);
+        
+        // Same basis as gluLookAt used when the cell was rendered
+        impostorDirection(instance->yaw, instance->pitch, f);
+        s[0] = f[2]; s[1] = 0.0f; s[2] = -f[0];
+        float length = sqrtf(s[0] * s[0] + s[2] * s[2]);
+        s[0] /= length; s[2] /= length;
+        u[0] = s[2] * f[1];
+        u[1] = s[0] * f[2] - s[2] * f[0];
+        u[2] = -s[0] * f[1];
+        
+        float u0 = instance->cell % IMPOSTOR_CELLS_PER_ROW * cellUV;
+        float v0 = instance->cell / IMPOSTOR_CELLS_PER_ROW * cellUV;
+        static const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+        for (int c = 0; c < 4; c++) {
+            glTexCoord2f(u0 + (corners[c][0] + 1) / 2 * cellUV, v0 + (corners[c][1] + 1) / 2 * cellUV);
+            glVertex3f(center[0] + radius * (corners[c][0] * s[0] + corners[c][1] * u[0]),
+                       center[1] + radius * (corners[c][0] * s[1] + corners[c][1] * u[1]),
+                       center[2] + radius * (corners[c][0] * s[2] + corners[c][1] * u[2]));
+        }
+    }
+    glEnd();
+    glDisable(GL_ALPHA_TEST);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    if (advancedLighting) glEnable(GL_LIGHTING);
+}
+
+void printImpostorReport() {
+    if (!impostors.frames) return;
+    double frames = impostors.frames;
+    fprintf(stderr, "Impostors: atlas %dx%d, %d/%d cells used, %.1f MB\n",
+            IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE, impostors.numUsed, IMPOSTOR_CELLS,
+            impostorAtlasBytes() / (1024.0 * 1024.0));
+    fprintf(stderr, "  %.0f drawn per frame, %.2f refreshes per frame (%.2f ms each), %.0f boxes for lack of cells\n",
+            impostors.drawn / frames, impostors.refreshes / frames,
+            impostors.refreshes ? impostors.refreshSeconds * 1000.0 / impostors.refreshes : 0.0,
+            impostors.fallbacks / frames);
+    fprintf(stderr, "  %.0f triangles per frame replaced by %.0f (%.1f%% saved)\n",
+            impostors.trianglesReplaced / frames, 2.0 * impostors.drawn / frames,
+            impostors.trianglesReplaced ?
+                100.0 * (1.0 - 2.0 * impostors.drawn / impostors.trianglesReplaced) : 0.0);
+}
+
+// Frame pipeline
+// Culling, LOD selection and instance filling run on worker threads one
+// frame ahead of the GLUT thread. After taking the packet for frame N, the
+// GLUT thread kicks frame N+1 for the camera predicted from the last two
+// frames and submits frame N while workers prepare it. A packet whose
+// predicted camera turns out too far from the actual one is dropped and
+// prepared again for the actual camera. Workers claim chunks of buildings
+// with a compare-and-swap on one word and the last one to finish marks the
+// packet ready, so frames are handed over without locks. Idle workers and a
+// GLUT thread with nothing left to claim sleep on condition variables. Every
+// thread fills its own lane of instance bins, and the GLUT thread draws the
+// lanes one after another instead of merging them.
+#define PIPELINE_PACKETS 3         // one drawn, one being prepared, one spare
+#define PIPELINE_SLOP 0.05f        // radians, or fraction of the distance, a prediction may miss by
+#define PIPELINE_CHUNK 32          // buildings per claimed chunk
+#define PIPELINE_MAX_WORKERS 64
+#define LOD_BOX_PIXELS 24.0f       // buildings smaller than this on screen are drawn as boxes
+
+typedef struct {
+    float angleX, angleY;
+    float distance;
+    float targetY;
+    int width, height;
+} FrameView;
+
+typedef struct {
+    float (*instances)[3];
+    int count, capacity;
+} InstanceBin;
+
+typedef struct {
+    float center[3];
+    float size[3];
+} BoxInstance;
+
+// What one thread prepared for a packet
+typedef struct {
+    InstanceBin* bins;      // one per shared mesh
+    int numBins;
+    BoxInstance* boxes;
+    int numBoxes, capBoxes;
+    ImpostorInstance* impostors;
+    int numImpostors, capImpostors;
+    int full, culled;       // buildings drawn in full, buildings skipped
+    double seconds;         // time spent preparing chunks
+} PacketLane;
+
+enum {PACKET_FREE, PACKET_PREPARING, PACKET_READY};
+
+typedef struct {
+    FrameView view;
+    float planes[6][4];      // frustum planes, inside where ax + by + cz + d >= 0
+    float eye[3];
+    float lodScale;          // screen pixels covered by a unit radius at unit distance
+    bool impostors;          // distant buildings become impostors rather than boxes
+    PacketLane* lanes;       // one per worker, then the GLUT thread
+    atomic_int state;
+    atomic_int chunksLeft;
+    double kickTime;
+    double readySeconds;     // from kick until the last chunk was done
+} FramePacket;
+
+typedef struct {
+    FramePacket packets[PIPELINE_PACKETS];
+    pthread_t threads[PIPELINE_MAX_WORKERS];
+    int numWorkers;
+    int numLanes;
+    atomic_uint_fast64_t claim;  // packet << 40 | chunks << 20 | next chunk
+    atomic_bool stop;
+    pthread_mutex_t lock;        // guards kicks and readiness for sleeping threads
+    pthread_cond_t kicked;
+    pthread_cond_t readied;      // a packet became ready
+    unsigned int kicks;
+    unsigned int frame;          // packets kicked so far
+    FramePacket* inFlight;       // kicked and not yet submitted
+    FrameView lastView;          // camera of the last frame, for prediction
+    bool hasLastView;
+    Mesh lodBox;                 // unit box standing in for distant buildings
+    
+    // Stage timings since the pipeline was started
+    int frames;
+    double prepareSeconds, laneSeconds, waitSeconds, submitSeconds;
+    double latencySeconds;       // from kicking a packet, for a predicted camera, to submitting it
+    long full, impostors, boxes, culled;
+    int mispredicted;            // packets prepared again for the actual camera
+} Pipeline;
+
+Pipeline pipeline = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .kicked = PTHREAD_COND_INITIALIZER,
+    .readied = PTHREAD_COND_INITIALIZER
+};
+int pipelineWorkers = -1;  // -workers: -1 picks one per spare core
+
+FrameView currentFrameView(int width, int height) {
+    FrameView view = {cameraAngleX, cameraAngleY, cameraDistance, buildingHeight / 2.0f, width, height};
+    return view;
+}
+
+float farPlane(float distance) {
+    return fmaxf(500.0f, distance + 2.0f * scene.radius);
+}
+
+void frameEye(const FrameView* view, float eye[3]) {
+    eye[0] = view->distance * sinf(view->angleY) * cosf(view->angleX);
+    eye[1] = view->distance * sinf(view->angleX) + view->targetY;
+    eye[2] = view->distance * cosf(view->angleY) * cosf(view->angleX);
+}
+
+// Frustum planes of the camera renderView() sets up for a view, taken from
+// the rows of projection * modelview (column-major, like OpenGL)
+void frustumPlanes(const FrameView* view, float planes[6][4]) {
+    float eye[3], f[3], s[3], u[3];
+    frameEye(view, eye);
+    f[0] = -eye[0]; f[1] = view->targetY - eye[1]; f[2] = -eye[2];
+    float length = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (int i = 0; i < 3; i++) f[i] /= length;
+    // s = f x up, u = s x f
+    s[0] = -f[2]; s[1] = 0.0f; s[2] = f[0];
+    length = sqrtf(s[0] * s[0] + s[2] * s[2]);
+    s[0] /= length; s[2] /= length;
+    u[0] = s[1] * f[2] - s[2] * f[1];
+    u[1] = s[2] * f[0] - s[0] * f[2];
+    u[2] = s[0] * f[1] - s[1] * f[0];
+    
+    float modelview[16] = {
+        s[0], u[0], -f[0], 0.0f,
+        s[1], u[1], -f[1], 0.0f,
+        s[2], u[2], -f[2], 0.0f,
+        -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]),
+        -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]),
+        f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2], 1.0f
+    };
+    float zNear = 0.1f, zFar = farPlane(view->distance);
+    float cot = 1.0f / tanf(15.0f * M_PI / 180.0f);
+    float projection[16] = {
+        cot * view->height / view->width, 0, 0, 0,
+        0, cot, 0, 0,
+        0, 0, (zFar + zNear) / (zNear - zFar), -1.0f,
+        0, 0, 2.0f * zFar * zNear / (zNear - zFar), 0
+    };
+    float m[16];
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            m[col * 4 + row] = 0.0f;
+            for (int k = 0; k < 4; k++) {
+                m[col * 4 + row] += projection[k * 4 + row] * modelview[col * 4 + k];
+            }
+        }
+    }
+    for (int p = 0; p < 6; p++) {
+        int row = p / 2;
+        float sign = p % 2 ? -1.0f : 1.0f;
+        for (int i = 0; i < 4; i++) {
+            planes[p][i] = m[i * 4 + 3] + sign * m[i * 4 + row];
+        }
+    }
+}
+
+bool boxInFrustum(const float planes[6][4], const float boundsMin[3], const float boundsMax[3]) {
+    for (int p = 0; p < 6; p++) {
+        // The corner furthest along the plane normal
+        float x = planes[p][0] > 0 ? boundsMax[0] : boundsMin[0];
+        float y = planes[p][1] > 0 ? boundsMax[1] : boundsMin[1];
+        float z = planes[p][2] > 0 ? boundsMax[2] : boundsMin[2];
+        if (planes[p][0] * x + planes[p][1] * y + planes[p][2] * z + planes[p][3] < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void binInstance(InstanceBin* bin, float x, float y, float z) {
+    if (bin->count == bin->capacity) {
+        bin->capacity = bin->capacity ? bin->capacity * 2 : 16;
+        bin->instances = realloc(bin->instances, bin->capacity * sizeof(float[3]));
+    }
+    bin->instances[bin->count][0] = x;
+    bin->instances[bin->count][1] = y;
+    bin->instances[bin->count][2] = z;
+    bin->count++;
+}
+
+void laneBox(PacketLane* lane, const BoxInstance* box) {
+    if (lane->numBoxes == lane->capBoxes) {
+        lane->capBoxes = lane->capBoxes ? lane->capBoxes * 2 : 64;
+        lane->boxes = realloc(lane->boxes, lane->capBoxes * sizeof(BoxInstance));
+    }
+    lane->boxes[lane->numBoxes++] = *box;
+}
+
+// Cull one chunk of buildings into a lane
+void prepareChunk(const FramePacket* packet, PacketLane* lane, int chunk) {
+    double t0 = nowSeconds();
+    int first = chunk * PIPELINE_CHUNK;
+    int last = first + PIPELINE_CHUNK < scene.numBuildings ? first + PIPELINE_CHUNK : scene.numBuildings;
+    
+    for (int b = first; b < last; b++) {
+        const SceneBuilding* building = &scene.buildings[b];
+        if (!boxInFrustum(packet->planes, building->boundsMin, building->boundsMax)) {
+            lane->culled++;
+            continue;
+        }
+        
+        BoxInstance box;
+        float distance2 = 0.0f, radius2 = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            box.center[axis] = (building->boundsMin[axis] + building->boundsMax[axis]) / 2;
+            box.size[axis] = building->boundsMax[axis] - building->boundsMin[axis];
+            float d = box.center[axis] - packet->eye[axis];
+            distance2 += d * d;
+            radius2 += box.size[axis] * box.size[axis] / 4;
+        }
+        
+        // Too small on screen for its floors to matter
+        float pixels2 = radius2 * packet->lodScale * packet->lodScale / distance2;
+        if (packet->impostors && pixels2 < IMPOSTOR_PIXELS * IMPOSTOR_PIXELS) {
+            if (lane->numImpostors == lane->capImpostors) {
+                lane->capImpostors = lane->capImpostors ? lane->capImpostors * 2 : 64;
+                lane->impostors = realloc(lane->impostors, lane->capImpostors * sizeof(ImpostorInstance));
+            }
+            ImpostorInstance* instance = &lane->impostors[lane->numImpostors++];
+            instance->building = b;
+            instance->cell = -1;
+            impostorBuckets(packet->eye, box.center, &instance->yaw, &instance->pitch);
+            continue;
+        }
+        if (!packet->impostors && pixels2 < LOD_BOX_PIXELS * LOD_BOX_PIXELS) {
+            laneBox(lane, &box);
+            continue;
+        }
+        
+        lane->full++;
+        for (int floor = 0; floor < building->params.numFloors; floor++) {
+            binInstance(&lane->bins[building->floorMeshes[floor]],
+                        building->x, floor * floorHeight, building->z);
+        }
+        if (building->roofMesh >= 0) {
+            binInstance(&lane->bins[building->roofMesh],
+                        building->x, building->params.numFloors * floorHeight, building->z);
+        }
+    }
+    lane->seconds += nowSeconds() - t0;
+}
+
+// Claim and prepare chunks of the packet being prepared until none are
+// left. Returns whether any chunk was claimed.
+bool pipelineHelp(int lane) {
+    uint_fast64_t claim = atomic_load_explicit(&pipeline.claim, memory_order_acquire);
+    bool worked = false;
+    for (;;) {
+        int next = claim & 0xfffff;
+        int chunks = (claim >> 20) & 0xfffff;
+        if (next >= chunks) {
+            return worked;
+        }
+        if (!atomic_compare_exchange_weak_explicit(&pipeline.claim, &claim, claim + 1,
+                                                   memory_order_acq_rel, memory_order_acquire)) {
+            continue;
+        }
+        FramePacket* packet = &pipeline.packets[claim >> 40];
+        prepareChunk(packet, &packet->lanes[lane], next);
+        if (atomic_fetch_sub_explicit(&packet->chunksLeft, 1, memory_order_acq_rel) == 1) {
+            packet->readySeconds = nowSeconds() - packet->kickTime;
+            pthread_mutex_lock(&pipeline.lock);
+            atomic_store_explicit(&packet->state, PACKET_READY, memory_order_release);
+            pthread_cond_broadcast(&pipeline.readied);
+            pthread_mutex_unlock(&pipeline.lock);
+        }
+        worked = true;
+        claim = atomic_load_explicit(&pipeline.claim, memory_order_acquire);
+    }
+}
+
+void* pipelineWorker(void* arg) {
+    int lane = (int)(intptr_t)arg;
+    pthread_mutex_lock(&pipeline.lock);
+    unsigned int seen = pipeline.kicks;
+    pthread_mutex_unlock(&pipeline.lock);
+    while (!atomic_load_explicit(&pipeline.stop, memory_order_relaxed)) {
+        pipelineHelp(lane);
+        
+        // Nothing left to claim: sleep until the next kick
+        pthread_mutex_lock(&pipeline.lock);
+        while (pipeline.kicks == seen && !atomic_load_explicit(&pipeline.stop, memory_order_relaxed)) {
+            pthread_cond_wait(&pipeline.kicked, &pipeline.lock);
+        }
+        seen = pipeline.kicks;
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+    return NULL;
+}
+
+// Start preparing a packet for a view. Called on the GLUT thread.
+void pipelineKick(const FrameView* view) {
+    int index = pipeline.frame % PIPELINE_PACKETS;
+    FramePacket* packet = &pipeline.packets[index];
+    packet->view = *view;
+    frameEye(view, packet->eye);
+    frustumPlanes(view, packet->planes);
+    packet->lodScale = view->height / (2.0f * tanf(15.0f * M_PI / 180.0f));
+    packet->impostors = impostorsEnabled;
+    
+    for (int l = 0; l < pipeline.numLanes; l++) {
+        PacketLane* lane = &packet->lanes[l];
+        if (lane->numBins < meshStore.count) {
+            lane->bins = realloc(lane->bins, meshStore.count * sizeof(InstanceBin));
+            memset(lane->bins + lane->numBins, 0, (meshStore.count - lane->numBins) * sizeof(InstanceBin));
+            lane->numBins = meshStore.count;
+        }
+        for (int m = 0; m < meshStore.count; m++) {
+            lane->bins[m].count = 0;
+        }
+        lane->numBoxes = lane->numImpostors = lane->full = lane->culled = 0;
+        lane->seconds = 0.0;
+    }
+    
+    uint_fast64_t chunks = (scene.numBuildings + PIPELINE_CHUNK - 1) / PIPELINE_CHUNK;
+    atomic_store_explicit(&packet->chunksLeft, (int)chunks, memory_order_relaxed);
+    atomic_store_explicit(&packet->state, PACKET_PREPARING, memory_order_relaxed);
+    packet->kickTime = nowSeconds();
+    atomic_store_explicit(&pipeline.claim, (uint_fast64_t)index << 40 | chunks << 20,
+                          memory_order_release);
+    pipeline.inFlight = packet;
+    pipeline.frame++;
+    
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.kicks++;
+    pthread_cond_broadcast(&pipeline.kicked);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Wait for the packet in flight, helping to prepare it while chunks are
+// left to claim and sleeping until the workers finish the rest
+FramePacket* pipelineWait() {
+    FramePacket* packet = pipeline.inFlight;
+    double t0 = nowSeconds();
+    while (atomic_load_explicit(&packet->state, memory_order_acquire) != PACKET_READY) {
+        if (pipelineHelp(pipeline.numWorkers)) continue;
+        pthread_mutex_lock(&pipeline.lock);
+        while (atomic_load_explicit(&packet->state, memory_order_acquire) != PACKET_READY) {
+            pthread_cond_wait(&pipeline.readied, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+    pipeline.waitSeconds += nowSeconds() - t0;
+    pipeline.inFlight = NULL;
+    return packet;
+}
+
+// Finish the packet in flight without drawing it, before the scene changes
+void pipelineDrain() {
+    if (pipeline.inFlight) {
+        FramePacket* packet = pipelineWait();
+        atomic_store_explicit(&packet->state, PACKET_FREE, memory_order_relaxed);
+    }
+}
+
+void buildLodBox(Mesh* mesh) {
+    static const float sides[4][4][3] = {
+        {{-0.5f, -0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0.5f, 0.5f, 0.5f}, {-0.5f, 0.5f, 0.5f}},
+        {{0.5f, -0.5f, -0.5f}, {-0.5f, -0.5f, -0.5f}, {-0.5f, 0.5f, -0.5f}, {0.5f, 0.5f, -0.5f}},
+        {{-0.5f, -0.5f, -0.5f}, {-0.5f, -0.5f, 0.5f}, {-0.5f, 0.5f, 0.5f}, {-0.5f, 0.5f, -0.5f}},
+        {{0.5f, -0.5f, 0.5f}, {0.5f, -0.5f, -0.5f}, {0.5f, 0.5f, -0.5f}, {0.5f, 0.5f, 0.5f}}
+    };
+    static const float normals[4][3] = {{0, 0, 1}, {0, 0, -1}, {-1, 0, 0}, {1, 0, 0}};
+    static const float top[4][3] = {
+        {-0.5f, 0.5f, 0.5f}, {0.5f, 0.5f, 0.5f}, {0.5f, 0.5f, -0.5f}, {-0.5f, 0.5f, -0.5f}
+    };
+    meshSetSlot(mesh, SLOT_WALL);
+    for (int i = 0; i < 4; i++) {
+        meshQuad(mesh, normals[i][0], normals[i][1], normals[i][2], sides[i]);
+    }
+    meshSetSlot(mesh, SLOT_ROOF);
+    meshQuad(mesh, 0, 1, 0, top);
+}
+
+int buildingTriangles(const SceneBuilding* building) {
+    int triangles = building->roofMesh >= 0 ? meshStore.meshes[building->roofMesh].mesh.numIndices / 3 : 0;
+    for (int floor = 0; floor < building->params.numFloors; floor++) {
+        triangles += meshStore.meshes[building->floorMeshes[floor]].mesh.numIndices / 3;
+    }
+    return triangles;
+}
+
+// Find or render the atlas cells a packet's impostors need. Buildings left
+// without a cell are drawn as boxes instead.
+void resolveImpostors(FramePacket* packet) {
+    int budget = IMPOSTOR_REFRESH_BUDGET;
+    impostors.frame++;
+    impostors.frames++;
+    for (int l = 0; l < pipeline.numLanes; l++) {
+        PacketLane* lane = &packet->lanes[l];
+        for (int i = 0; i < lane->numImpostors; i++) {
+            ImpostorInstance* instance = &lane->impostors[i];
+            const SceneBuilding* building = &scene.buildings[instance->building];
+            instance->cell = findImpostor(building, instance->yaw, instance->pitch, &budget);
+            if (instance->cell < 0) {
+                BoxInstance box;
+                for (int axis = 0; axis < 3; axis++) {
+                    box.center[axis] = (building->boundsMin[axis] + building->boundsMax[axis]) / 2;
+                    box.size[axis] = building->boundsMax[axis] - building->boundsMin[axis];
+                }
+                laneBox(lane, &box);
+                impostors.fallbacks++;
+                continue;
+            }
+            impostors.drawn++;
+            impostors.trianglesReplaced += buildingTriangles(building);
+        }
+    }
+}
+
+// Draw what a packet found visible: full buildings from the lanes' bins,
+// distant ones as impostors or scaled boxes
+void drawPacket(const FramePacket* packet) {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    for (int m = 0; m < meshStore.count; m++) {
+        Mesh* mesh = &meshStore.meshes[m].mesh;
+        int copies = 0;
+        for (int l = 0; l < pipeline.numLanes; l++) {
+            copies += packet->lanes[l].bins[m].count;
+        }
+        if (!copies || !mesh->numIndices) continue;
+        
+        bool baked = bindSharedMesh(m);
+        for (int p = 0; p < mesh->numParts; p++) {
+            const MeshPart* part = &mesh->parts[p];
+            applyMeshSlot(part->slot, baked);
+            for (int l = 0; l < pipeline.numLanes; l++) {
+                const InstanceBin* bin = &packet->lanes[l].bins[m];
+                for (int i = 0; i < bin->count; i++) {
+                    glPushMatrix();
+                    glTranslatef(bin->instances[i][0], bin->instances[i][1], bin->instances[i][2]);
+                    glDrawElements(GL_TRIANGLES, part->numIndices, GL_UNSIGNED_INT,
+                                   (void*)(part->firstIndex * sizeof(GLuint)));
+                    glPopMatrix();
+                }
+            }
+        }
+        unbindLightmap(baked);
+    }
+    
+    Mesh* box = &pipeline.lodBox;
+    bindMesh(box);
+    glEnable(GL_NORMALIZE);
+    for (int p = 0; p < box->numParts; p++) {
+        const MeshPart* part = &box->parts[p];
+        applySlot(part->slot);
+        for (int l = 0; l < pipeline.numLanes; l++) {
+            const PacketLane* lane = &packet->lanes[l];
+            for (int i = 0; i < lane->numBoxes; i++) {
+                const BoxInstance* instance = &lane->boxes[i];
+                glPushMatrix();
+                glTranslatef(instance->center[0], instance->center[1], instance->center[2]);
+                glScalef(instance->size[0], instance->size[1], instance->size[2]);
+                glDrawElements(GL_TRIANGLES, part->numIndices, GL_UNSIGNED_INT,
+                               (void*)(part->firstIndex * sizeof(GLuint)));
+                glPopMatrix();
+            }
+        }
+    }
+    glDisable(GL_NORMALIZE);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    
+    for (int l = 0; l < pipeline.numLanes; l++) {
+        if (packet->lanes[l].numImpostors) {
+            drawImpostors(packet->lanes[l].impostors, packet->lanes[l].numImpostors);
+        }
+    }
+}
+
+void pipelineStart(int workers) {
+    if (workers < 0) {
+        workers = coreCount() - 1;
+    }
+    if (workers > PIPELINE_MAX_WORKERS) workers = PIPELINE_MAX_WORKERS;
+    if (workers < 0) workers = 0;
+    
+    pipeline.numWorkers = workers;
+    pipeline.numLanes = workers + 1;
+    pipeline.frames = 0;
+    pipeline.prepareSeconds = pipeline.laneSeconds = pipeline.waitSeconds = pipeline.submitSeconds = 0.0;
+    pipeline.latencySeconds = 0.0;
+    pipeline.full = pipeline.impostors = pipeline.boxes = pipeline.culled = 0;
+    pipeline.mispredicted = 0;
+    pipeline.hasLastView = false;
+    if (!pipeline.lodBox.numVerts) {
+        buildLodBox(&pipeline.lodBox);
+    }
+    if (!impostors.texture) {
+        initImpostorAtlas();
+    }
+    for (int i = 0; i < PIPELINE_PACKETS; i++) {
+        pipeline.packets[i].lanes = calloc(pipeline.numLanes, sizeof(PacketLane));
+        atomic_init(&pipeline.packets[i].state, PACKET_FREE);
+        atomic_init(&pipeline.packets[i].chunksLeft, 0);
+    }
+    atomic_init(&pipeline.claim, 0);
+    atomic_init(&pipeline.stop, false);
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&pipeline.threads[i], NULL, pipelineWorker, (void*)(intptr_t)i);
+    }
+}
+
+void pipelineStop() {
+    pipelineDrain();
+    atomic_store(&pipeline.stop, true);
+    pthread_mutex_lock(&pipeline.lock);
+    pthread_cond_broadcast(&pipeline.kicked);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (int i = 0; i < pipeline.numWorkers; i++) {
+        pthread_join(pipeline.threads[i], NULL);
+    }
+    for (int i = 0; i < PIPELINE_PACKETS; i++) {
+        for (int l = 0; l < pipeline.numLanes; l++) {
+            PacketLane* lane = &pipeline.packets[i].lanes[l];
+            for (int m = 0; m < lane->numBins; m++) {
+                free(lane->bins[m].instances);
+            }
+            free(lane->bins);
+            free(lane->boxes);
+            free(lane->impostors);
+        }
+        free(pipeline.packets[i].lanes);
+        pipeline.packets[i].lanes = NULL;
+    }
+    pipeline.numWorkers = 0;
+    pipeline.numLanes = 0;
+}
+
+void printPipelineReport() {
+    if (!pipeline.frames) return;
+    double frames = pipeline.frames;
+    fprintf(stderr, "Pipeline: %d workers, %d frames\n", pipeline.numWorkers, pipeline.frames);
+    fprintf(stderr, "  cull/LOD/fill %.2f ms of thread time per frame, ready %.2f ms after the kick\n",
+            pipeline.laneSeconds * 1000.0 / frames, pipeline.prepareSeconds * 1000.0 / frames);
+    fprintf(stderr, "  GLUT thread: waited %.2f ms, submitted %.2f ms per frame, %.2f ms from kick to submit\n",
+            pipeline.waitSeconds * 1000.0 / frames, pipeline.submitSeconds * 1000.0 / frames,
+            pipeline.latencySeconds * 1000.0 / frames);
+    fprintf(stderr, "  per frame: %.0f buildings full, %.0f impostors, %.0f boxes, %.0f culled\n",
+            pipeline.full / frames, pipeline.impostors / frames, pipeline.boxes / frames,
+            pipeline.culled / frames);
+    fprintf(stderr, "  %d of %d frames prepared again after the camera prediction missed\n",
+            pipeline.mispredicted, pipeline.frames);
+}
+
+// Picking
+// Mouse picks are answered by casting a ray on the CPU, so the GL pipeline
+// never stalls on a selection buffer or readback. There are three levels of
+// 4-wide bounding volume hierarchies: one over the buildings of the scene,
+// one per building over its floors and roof, and one per shared mesh over
+// its triangles. A node stores its four children's boxes as SIMD lanes, so
+// one ray is tested against all four at once. Each triangle carries the tag
+// of the element it was generated for.
+#define BVH_LEAF_SIZE 4
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+
+typedef struct {
+    v4sf minX, minY, minZ;   // child boxes, one per lane
+    v4sf maxX, maxY, maxZ;
+    int child[4];            // inner node index, or first leaf item
+    int count[4];            // 0 for an inner node, items in a leaf, -1 for no child
+} BVHNode;
+
+typedef struct {
+    BVHNode* nodes;
+    int numNodes, capNodes;
+    int* items;              // item ids in leaf order
+    int numItems;
+    int depth;               // levels of inner nodes; traversal stacks hold 3 per level
+} BVH;
+
+typedef struct {
+    float min[3], max[3];
+    int id;
+} BVHItem;
+
+typedef struct {
+    float origin[3];
+    float dir[3];
+    float invDir[3];
+    float tMax;              // distance to the nearest hit so far
+} Ray;
+
+typedef struct {
+    bool hit;
+    int building;
+    int floor;               // numFloors for the roof
+    int mesh;                // shared mesh the triangle belongs to
+    int triangle;
+    MeshTag tag;
+    float distance;
+    float point[3];
+} PickHit;
+
+// Everything a building's BVH depends on, compared field by field
+typedef struct {
+    int meshes[MAX_FLOORS + 1];  // floor meshes, then the roof
+    int numFloors;               // 0 until built
+    float x, z;
+} PickSource;
+
+typedef struct {
+    BVH scene;               // over building bounds
+    BVH* buildings;          // per building, over its floors and roof
+    PickSource* sources;     // what each building's BVH was built from
+    int numBuildings;
+    BVH* meshes;             // per shared mesh, over its triangles
+    int numMeshes;
+    int generation;          // mesh store generation the mesh BVHs belong to
+    int revision;            // scene revision the index was last updated to
+    
+    // Last update
+    double updateSeconds;
+    int buildingsRebuilt;
+    int meshesBuilt;
+    bool sceneRebuilt;
+} PickIndex;
+
+PickIndex pickIndex = {.revision = -1};
+PickHit picked;              // highlighted element
+
+static inline v4sf v4min(v4sf a, v4sf b) {
+    v4si less = a < b;
+    return (v4sf)(((v4si)a & less) | ((v4si)b & ~less));
+}
+
+static inline v4sf v4max(v4sf a, v4sf b) {
+    v4si greater = a > b;
+    return (v4sf)(((v4si)a & greater) | ((v4si)b & ~greater));
+}
+
+void bvhFree(BVH* bvh) {
+    free(bvh->nodes);
+    free(bvh->items);
+    memset(bvh, 0, sizeof(BVH));
+}
+
+void bvhItemsBounds(const BVHItem* items, int count, float boundsMin[3], float boundsMax[3]) {
+    for (int axis = 0; axis < 3; axis++) {
+        boundsMin[axis] = INFINITY;
+        boundsMax[axis] = -INFINITY;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            boundsMin[axis] = fminf(boundsMin[axis], items[i].min[axis]);
+            boundsMax[axis] = fmaxf(boundsMax[axis], items[i].max[axis]);
+        }
+    }
+}
+
+static int bvhSortAxis;
+
+int compareBVHItems(const void* a, const void* b) {
+    const BVHItem* itemA = a;
+    const BVHItem* itemB = b;
+    float centerA = itemA->min[bvhSortAxis] + itemA->max[bvhSortAxis];
+    float centerB = itemB->min[bvhSortAxis] + itemB->max[bvhSortAxis];
+    return (centerA > centerB) - (centerA < centerB);
+}
+
+// Sort items along the longest extent of their centers; the caller splits
+// them in half
+void bvhSortItems(BVHItem* items, int count) {
+    float low[3] = {INFINITY, INFINITY, INFINITY};
+    float high[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < count; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            float center = items[i].min[axis] + items[i].max[axis];
+            low[axis] = fminf(low[axis], center);
+            high[axis] = fmaxf(high[axis], center);
+        }
+    }
+    bvhSortAxis = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (high[axis] - low[axis] > high[bvhSortAxis] - low[bvhSortAxis]) bvhSortAxis = axis;
+    }
+    qsort(items, count, sizeof(BVHItem), compareBVHItems);
+}
+
+// Build a node over items[first, first + count), splitting them in halves
+// and then quarters. Returns the node's index.
+int bvhBuildNode(BVH* bvh, BVHItem* items, int first, int count, int level) {
+    if (level > bvh->depth) bvh->depth = level;
+    if (bvh->numNodes == bvh->capNodes) {
+        bvh->capNodes = bvh->capNodes ? bvh->capNodes * 2 : 16;
+        bvh->nodes = realloc(bvh->nodes, bvh->capNodes * sizeof(BVHNode));
+    }
+    int node = bvh->numNodes++;
+    
+    int groupFirst[4], groupCount[4], numGroups = 0;
+    if (count <= BVH_LEAF_SIZE) {
+        groupFirst[0] = first;
+        groupCount[0] = count;
+        numGroups = 1;
+    } else {
+        bvhSortItems(items + first, count);
+        int halves[2][2] = {{first, count / 2}, {first + count / 2, count - count / 2}};
+        for (int h = 0; h < 2; h++) {
+            if (halves[h][1] <= BVH_LEAF_SIZE) {
+                groupFirst[numGroups] = halves[h][0];
+                groupCount[numGroups++] = halves[h][1];
+                continue;
+            }
+            bvhSortItems(items + halves[h][0], halves[h][1]);
+            groupFirst[numGroups] = halves[h][0];
+            groupCount[numGroups++] = halves[h][1] / 2;
+            groupFirst[numGroups] = halves[h][0] + halves[h][1] / 2;
+            groupCount[numGroups++] = halves[h][1] - halves[h][1] / 2;
+        }
+    }
+    
+    BVHNode result;
+    for (int i = 0; i < 4; i++) {
+        float boundsMin[3] = {INFINITY, INFINITY, INFINITY};
+        float boundsMax[3] = {INFINITY, INFINITY, INFINITY};  // misses every ray
+        result.child[i] = 0;
+        result.count[i] = -1;
+        if (i < numGroups) {
+            bvhItemsBounds(items + groupFirst[i], groupCount[i], boundsMin, boundsMax);
+            if (groupCount[i] <= BVH_LEAF_SIZE) {
+                result.child[i] = groupFirst[i];
+                result.count[i] = groupCount[i];
+            } else {
+                result.child[i] = bvhBuildNode(bvh, items, groupFirst[i], groupCount[i], level + 1);
+                result.count[i] = 0;
+            }
+        }
+        result.minX[i] = boundsMin[0]; result.minY[i] = boundsMin[1]; result.minZ[i] = boundsMin[2];
+        result.maxX[i] = boundsMax[0]; result.maxY[i] = boundsMax[1]; result.maxZ[i] = boundsMax[2];
+    }
+    // Children were built after this node, so the array may have moved
+    bvh->nodes[node] = result;
+    return node;
+}
+
+void bvhBuild(BVH* bvh, BVHItem* items, int count) {
+    bvh->numNodes = 0;
+    bvh->numItems = count;
+    bvh->depth = 0;
+    if (count <= 0) return;
+    bvhBuildNode(bvh, items, 0, count, 1);
+    bvh->items = realloc(bvh->items, count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        bvh->items[i] = items[i].id;
+    }
+}
+
+// Recompute node boxes after items moved without rebuilding the tree.
+// Children always come after their parent, so a reverse sweep sees every
+// child before the node that contains it.
+void bvhRefit(BVH* bvh, const BVHItem* itemsById) {
+    for (int n = bvh->numNodes - 1; n >= 0; n--) {
+        BVHNode* node = &bvh->nodes[n];
+        for (int i = 0; i < 4; i++) {
+            if (node->count[i] < 0) continue;
+            float boundsMin[3] = {INFINITY, INFINITY, INFINITY};
+            float boundsMax[3] = {-INFINITY, -INFINITY, -INFINITY};
+            if (node->count[i] > 0) {
+                for (int k = 0; k < node->count[i]; k++) {
+                    const BVHItem* item = &itemsById[bvh->items[node->child[i] + k]];
+                    for (int axis = 0; axis < 3; axis++) {
+                        boundsMin[axis] = fminf(boundsMin[axis], item->min[axis]);
+                        boundsMax[axis] = fmaxf(boundsMax[axis], item->max[axis]);
+                    }
+                }
+            } else {
+                const BVHNode* child = &bvh->nodes[node->child[i]];
+                for (int k = 0; k < 4; k++) {
+                    if (child->count[k] < 0) continue;
+                    boundsMin[0] = fminf(boundsMin[0], child->minX[k]);
+                    boundsMin[1] = fminf(boundsMin[1], child->minY[k]);
+                    boundsMin[2] = fminf(boundsMin[2], child->minZ[k]);
+                    boundsMax[0] = fmaxf(boundsMax[0], child->maxX[k]);
+                    boundsMax[1] = fmaxf(boundsMax[1], child->maxY[k]);
+                    boundsMax[2] = fmaxf(boundsMax[2], child->maxZ[k]);
+                }
+            }
+            node->minX[i] = boundsMin[0]; node->minY[i] = boundsMin[1]; node->minZ[i] = boundsMin[2];
+            node->maxX[i] = boundsMax[0]; node->maxY[i] = boundsMax[1]; node->maxZ[i] = boundsMax[2];
+        }
+    }
+}
+
+void initRay(Ray* ray, const float origin[3], const float dir[3]) {
+    for (int axis = 0; axis < 3; axis++) {
+        ray->origin[axis] = origin[axis];
+        ray->dir[axis] = dir[axis];
+        // Keep the slab test finite for axis-parallel rays
+        float d = fabsf(dir[axis]) > 1e-20f ? dir[axis] : copysignf(1e-20f, dir[axis]);
+        ray->invDir[axis] = 1.0f / d;
+    }
+    ray->tMax = INFINITY;
+}
+
+typedef void (*BVHLeafFunc)(void* context, Ray* ray, int item);
+
+// Walk the nodes a ray passes through, nearest child first, handing the
+// items of every leaf it reaches to leaf(), which shortens ray->tMax on a hit
+void bvhTraverse(const BVH* bvh, Ray* ray, BVHLeafFunc leaf, void* context) {
+    if (!bvh->numNodes) return;
+    v4sf zero = {0, 0, 0, 0};
+    v4sf ox = zero + ray->origin[0], oy = zero + ray->origin[1], oz = zero + ray->origin[2];
+    v4sf ix = zero + ray->invDir[0], iy = zero + ray->invDir[1], iz = zero + ray->invDir[2];
+    // Every level below the current node leaves at most three siblings behind
+    int stack[3 * bvh->depth + 1];
+    int sp = 0;
+    stack[sp++] = 0;
+    
+    while (sp) {
+        const BVHNode* node = &bvh->nodes[stack[--sp]];
+        v4sf x1 = (node->minX - ox) * ix, x2 = (node->maxX - ox) * ix;
+        v4sf y1 = (node->minY - oy) * iy, y2 = (node->maxY - oy) * iy;
+        v4sf z1 = (node->minZ - oz) * iz, z2 = (node->maxZ - oz) * iz;
+        v4sf tNear = v4max(v4max(v4min(x1, x2), v4min(y1, y2)), v4max(v4min(z1, z2), zero));
+        v4sf tFar = v4min(v4min(v4max(x1, x2), v4max(y1, y2)), v4min(v4max(z1, z2), zero + ray->tMax));
+        v4si hit = tNear <= tFar;
+        
+        // Hit children sorted near to far
+        int order[4], numHits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!hit[i] || node->count[i] < 0) continue;
+            int j = numHits++;
+            while (j > 0 && tNear[order[j - 1]] > tNear[i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+        for (int h = 0; h < numHits; h++) {
+            int i = order[h];
+            if (node->count[i] == 0 || tNear[i] > ray->tMax) continue;
+            for (int k = 0; k < node->count[i]; k++) {
+                leaf(context, ray, bvh->items[node->child[i] + k]);
+            }
+        }
+        // Inner children go on the stack far first, so the nearest pops next
+        for (int h = numHits - 1; h >= 0; h--) {
+            int i = order[h];
+            if (node->count[i] == 0) {
+                stack[sp++] = node->child[i];
+            }
+        }
+    }
+}
+
+// Traversal state while a pick descends the three levels
+typedef struct {
+    PickHit* hit;
+    int building;
+    int floor;
+    int mesh;
+    float offset[3];         // of the floor being tested, in world space
+} PickContext;
+
+void pickTriangle(void* context, Ray* ray, int triangle) {
+    PickContext* pick = context;
+    const Mesh* mesh = &meshStore.meshes[pick->mesh].mesh;
+    const float* a = &mesh->verts[mesh->indices[triangle * 3]].x;
+    const float* b = &mesh->verts[mesh->indices[triangle * 3 + 1]].x;
+    const float* c = &mesh->verts[mesh->indices[triangle * 3 + 2]].x;
+    
+    // Moller-Trumbore, with the ray moved into floor space
+    float o[3], e1[3], e2[3], p[3], q[3], s[3];
+    for (int axis = 0; axis < 3; axis++) {
+        o[axis] = ray->origin[axis] - pick->offset[axis];
+        e1[axis] = b[axis] - a[axis];
+        e2[axis] = c[axis] - a[axis];
+        s[axis] = o[axis] - a[axis];
+    }
+    p[0] = ray->dir[1] * e2[2] - ray->dir[2] * e2[1];
+    p[1] = ray->dir[2] * e2[0] - ray->dir[0] * e2[2];
+    p[2] = ray->dir[0] * e2[1] - ray->dir[1] * e2[0];
+    float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (fabsf(det) < 1e-12f) return;
+    float invDet = 1.0f / det;
+    float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+    if (u < 0.0f || u > 1.0f) return;
+    q[0] = s[1] * e1[2] - s[2] * e1[1];
+    q[1] = s[2] * e1[0] - s[0] * e1[2];
+    q[2] = s[0] * e1[1] - s[1] * e1[0];
+    float v = (ray->dir[0] * q[0] + ray->dir[1] * q[1] + ray->dir[2] * q[2]) * invDet;
+    if (v < 0.0f || u + v > 1.0f) return;
+    float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+    if (t <= 0.0f || t >= ray->tMax) return;
+    
+    ray->tMax = t;
+    PickHit* hit = pick->hit;
+    hit->hit = true;
+    hit->building = pick->building;
+    hit->floor = pick->floor;
+    hit->mesh = pick->mesh;
+    hit->triangle = triangle;
+    hit->tag = mesh->tags[triangle];
+    hit->distance = t;
+}
+
+void pickFloor(void* context, Ray* ray, int floor) {
+    PickContext* pick = context;
+    const SceneBuilding* building = &scene.buildings[pick->building];
+    pick->floor = floor;
+    pick->mesh = floor < building->params.numFloors ? building->floorMeshes[floor] : building->roofMesh;
+    pick->offset[0] = building->x;
+    pick->offset[1] = floor * floorHeight;
+    pick->offset[2] = building->z;
+    
+    // The mesh BVH is in floor space: move the ray rather than the mesh
+    Ray local = *ray;
+    for (int axis = 0; axis < 3; axis++) {
+        local.origin[axis] -= pick->offset[axis];
+    }
+    PickContext meshContext = *pick;
+    meshContext.offset[0] = meshContext.offset[1] = meshContext.offset[2] = 0.0f;
+    bvhTraverse(&pickIndex.meshes[pick->mesh], &local, pickTriangle, &meshContext);
+    ray->tMax = local.tMax;
+}
+
+void pickBuilding(void* context, Ray* ray, int building) {
+    PickContext* pick = context;
+    pick->building = building;
+    bvhTraverse(&pickIndex.buildings[building], ray, pickFloor, pick);
+}
+
+void buildMeshBVH(BVH* bvh, const Mesh* mesh) {
+    int count = mesh->numIndices / 3;
+    BVHItem* items = malloc((count ? count : 1) * sizeof(BVHItem));
+    for (int t = 0; t < count; t++) {
+        BVHItem* item = &items[t];
+        item->id = t;
+        for (int axis = 0; axis < 3; axis++) {
+            item->min[axis] = INFINITY;
+            item->max[axis] = -INFINITY;
+        }
+        for (int k = 0; k < 3; k++) {
+            const float* p = &mesh->verts[mesh->indices[t * 3 + k]].x;
+            for (int axis = 0; axis < 3; axis++) {
+                item->min[axis] = fminf(item->min[axis], p[axis]);
+                item->max[axis] = fmaxf(item->max[axis], p[axis]);
+            }
+        }
+    }
+    bvhBuild(bvh, items, count);
+    free(items);
+}
+
+void buildBuildingBVH(BVH* bvh, const SceneBuilding* building) {
+    BVHItem items[MAX_FLOORS + 1];
+    int count = 0;
+    for (int floor = 0; floor <= building->params.numFloors; floor++) {
+        int id = floor < building->params.numFloors ? building->floorMeshes[floor] : building->roofMesh;
+        if (id < 0) continue;
+        const SharedMesh* shared = &meshStore.meshes[id];
+        float offset[3] = {building->x, floor * floorHeight, building->z};
+        items[count].id = floor;
+        for (int axis = 0; axis < 3; axis++) {
+            items[count].min[axis] = shared->boundsMin[axis] + offset[axis];
+            items[count].max[axis] = shared->boundsMax[axis] + offset[axis];
+        }
+        count++;
+    }
+    bvhBuild(bvh, items, count);
+}
+
+void initPickSource(PickSource* source, const SceneBuilding* building) {
+    memset(source, 0, sizeof(PickSource));
+    int floors = building->params.numFloors;
+    memcpy(source->meshes, building->floorMeshes, floors * sizeof(int));
+    source->meshes[floors] = building->roofMesh;
+    source->numFloors = floors;
+    source->x = building->x;
+    source->z = building->z;
+}
+
+// Bring the index up to date with the scene. Only what changed is rebuilt:
+// mesh BVHs survive until the mesh store is flushed, building BVHs are
+// rebuilt when the building's meshes or position change, and the scene BVH
+// is refit rather than rebuilt while the number of buildings stays the same.
+void updatePickIndex() {
+    if (pickIndex.revision == scene.revision) return;
+    double t0 = nowSeconds();
+    pickIndex.buildingsRebuilt = pickIndex.meshesBuilt = 0;
+    pickIndex.sceneRebuilt = false;
+    
+    if (pickIndex.generation != meshStore.generation) {
+        for (int m = 0; m < pickIndex.numMeshes; m++) {
+            bvhFree(&pickIndex.meshes[m]);
+        }
+        pickIndex.numMeshes = 0;
+        pickIndex.generation = meshStore.generation;
+        // Building BVHs refer to mesh ids that are gone
+        memset(pickIndex.sources, 0, pickIndex.numBuildings * sizeof(PickSource));
+    }
+    if (pickIndex.numMeshes < meshStore.count) {
+        pickIndex.meshes = realloc(pickIndex.meshes, meshStore.count * sizeof(BVH));
+        for (int m = pickIndex.numMeshes; m < meshStore.count; m++) {
+            memset(&pickIndex.meshes[m], 0, sizeof(BVH));
+            buildMeshBVH(&pickIndex.meshes[m], &meshStore.meshes[m].mesh);
+            pickIndex.meshesBuilt++;
+        }
+        pickIndex.numMeshes = meshStore.count;
+    }
+    
+    bool resized = pickIndex.numBuildings != scene.numBuildings;
+    if (resized) {
+        for (int b = scene.numBuildings; b < pickIndex.numBuildings; b++) {
+            bvhFree(&pickIndex.buildings[b]);
+        }
+        pickIndex.buildings = realloc(pickIndex.buildings, scene.numBuildings * sizeof(BVH));
+        pickIndex.sources = realloc(pickIndex.sources, scene.numBuildings * sizeof(PickSource));
+        for (int b = pickIndex.numBuildings; b < scene.numBuildings; b++) {
+            memset(&pickIndex.buildings[b], 0, sizeof(BVH));
+            memset(&pickIndex.sources[b], 0, sizeof(PickSource));
+        }
+        pickIndex.numBuildings = scene.numBuildings;
+    }
+    bool moved = resized;
+    for (int b = 0; b < scene.numBuildings; b++) {
+        PickSource source;
+        initPickSource(&source, &scene.buildings[b]);
+        if (memcmp(&source, &pickIndex.sources[b], sizeof(PickSource)) == 0) continue;
+        buildBuildingBVH(&pickIndex.buildings[b], &scene.buildings[b]);
+        pickIndex.sources[b] = source;
+        pickIndex.buildingsRebuilt++;
+        moved = true;
+    }
+    
+    if (moved) {
+        BVHItem* items = malloc(scene.numBuildings * sizeof(BVHItem));
+        for (int b = 0; b < scene.numBuildings; b++) {
+            items[b].id = b;
+            memcpy(items[b].min, scene.buildings[b].boundsMin, sizeof(items[b].min));
+            memcpy(items[b].max, scene.buildings[b].boundsMax, sizeof(items[b].max));
+        }
+        if (resized || !pickIndex.scene.numNodes) {
+            bvhBuild(&pickIndex.scene, items, scene.numBuildings);
+            pickIndex.sceneRebuilt = true;
+        } else {
+            bvhRefit(&pickIndex.scene, items);
+        }
+        free(items);
+    }
+    pickIndex.revision = scene.revision;
+    pickIndex.updateSeconds = nowSeconds() - t0;
+}
+
+bool pickRay(const float origin[3], const float dir[3], PickHit* hit) {
+    updatePickIndex();
+    Ray ray;
+    initRay(&ray, origin, dir);
+    memset(hit, 0, sizeof(PickHit));
+    PickContext context = {hit};
+    bvhTraverse(&pickIndex.scene, &ray, pickBuilding, &context);
+    if (hit->hit) {
+        for (int axis = 0; axis < 3; axis++) {
+            hit->point[axis] = origin[axis] + dir[axis] * hit->distance;
+        }
+    }
+    return hit->hit;
+}
+
+// The camera ray through a window pixel, for the camera renderView() sets up
+void viewRay(const FrameView* view, int x, int y, float origin[3], float dir[3]) {
+    float f[3], s[3], u[3];
+    frameEye(view, origin);
+    f[0] = -origin[0]; f[1] = view->targetY - origin[1]; f[2] = -origin[2];
+    float length = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (int i = 0; i < 3; i++) f[i] /= length;
+    s[0] = -f[2]; s[1] = 0.0f; s[2] = f[0];
+    length = sqrtf(s[0] * s[0] + s[2] * s[2]);
+    s[0] /= length; s[2] /= length;
+    u[0] = s[1] * f[2] - s[2] * f[1];
+    u[1] = s[2] * f[0] - s[0] * f[2];
+    u[2] = s[0] * f[1] - s[1] * f[0];
+    
+    float tanHalf = tanf(15.0f * M_PI / 180.0f);
+    float px = (2.0f * (x + 0.5f) / view->width - 1.0f) * tanHalf * view->width / view->height;
+    float py = (1.0f - 2.0f * (y + 0.5f) / view->height) * tanHalf;
+    for (int i = 0; i < 3; i++) {
+        dir[i] = f[i] + px * s[i] + py * u[i];
+    }
+}
+
+const char* elementName(const MeshTag* tag) {
+    static const char* names[NUM_ELEMENTS] = {"wall", "window", "balcony", "floor", "stair", "roof"};
+    return tag->kind < NUM_ELEMENTS ? names[tag->kind] : "element";
+}
+
+void printPick(const PickHit* hit, double seconds) {
+    static const char* walls[NUM_WALLS] = {"front", "back", "left", "right"};
+    if (!hit->hit) {
+        printf("Picked nothing (%.3f ms)\n", seconds * 1000.0);
+        return;
+    }
+    const SceneBuilding* building = &scene.buildings[hit->building];
+    printf("Picked building %d, ", hit->building);
+    if (hit->floor < building->params.numFloors) {
+        printf("floor %d, ", hit->floor + 1);
+    }
+    if (hit->tag.wall >= 0) {
+        printf("%s wall", walls[hit->tag.wall]);
+        if (hit->tag.kind != ELEMENT_WALL) printf(", ");
+    }
+    switch (hit->tag.kind) {
+        case ELEMENT_WALL:
+            if (hit->tag.wall < 0) printf("wall");
+            break;
+        case ELEMENT_WINDOW:
+        case ELEMENT_BALCONY:
+        case ELEMENT_STAIR:
+            printf("%s %d", elementName(&hit->tag), hit->tag.index + 1);
+            break;
+        case ELEMENT_ROOF:
+            printf("roof, %s face", walls[hit->tag.index & 3]);
+            break;
+        default:
+            printf("%s", elementName(&hit->tag));
+            break;
+    }
+    printf(" at %.1f m (%.3f ms)\n", hit->distance, seconds * 1000.0);
+}
+
+// Pick under a window pixel; the building hit becomes the one the keyboard edits
+void pickScreen(int x, int y) {
+    FrameView view = currentFrameView(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+    float origin[3], dir[3];
+    viewRay(&view, x, y, origin, dir);
+    double t0 = nowSeconds();
+    pickRay(origin, dir, &picked);
+    printPick(&picked, nowSeconds() - t0);
+    if (picked.hit) {
+        selectBuilding(picked.building);
+    }
+    glutPostRedisplay();
+}
+
+// Highlight the picked element by redrawing its triangles on top
+void drawPickHighlight() {
+    // Hidden once the scene changes under it
+    if (!picked.hit || pickIndex.revision != scene.revision) return;
+    const SceneBuilding* building = &scene.buildings[picked.building];
+    const Mesh* mesh = &meshStore.meshes[picked.mesh].mesh;
+    
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_POLYGON_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(-1.0f, -1.0f);
+    glColor3f(1.0f, 0.85f, 0.1f);
+    glPushMatrix();
+    glTranslatef(building->x, picked.floor * floorHeight, building->z);
+    glBegin(GL_TRIANGLES);
+    for (int t = 0; t < mesh->numIndices / 3; t++) {
+        const MeshTag* tag = &mesh->tags[t];
+        if (tag->kind != picked.tag.kind || tag->wall != picked.tag.wall ||
+            tag->index != picked.tag.index) continue;
+        for (int k = 0; k < 3; k++) {
+            glVertex3fv(&mesh->verts[mesh->indices[t * 3 + k]].x);
+        }
+    }
+    glEnd();
+    glPopMatrix();
+    glPopAttrib();
+}
+
+// Lightmap baking
+// Each shared mesh is unwrapped into planar charts, one per group of
+// triangles that share vertices (a quad, a window fan, a roof face), which
+// are packed into rows of the mesh's lightmap. Every texel is then lit by
+// tracing rays against the mesh's picking BVH on a pool of threads: a shadow
+// ray towards each light and hemisphere rays for ambient occlusion. The
+// lights are directional, as GL evaluates them, so the light on a mesh does
+// not depend on where it stands and one bake serves every copy. Shadows only
+// come from the mesh itself. Bakes are cached on disk keyed by the mesh key
+// and the bake settings.
+#define LIGHTMAP_TEXELS_PER_METER 8.0f
+#define LIGHTMAP_PADDING 1           // texels around each chart for filtering
+#define LIGHTMAP_AO_RAYS 32
+#define LIGHTMAP_AO_RADIUS 2.0f      // occluders further away than this do not darken
+#define LIGHTMAP_MAX_THREADS 64
+#define LIGHTMAP_CACHE_DIR "lightmaps"
+#define LIGHTMAP_MAGIC "HW5LMAP3"
+
+typedef struct {
+    float tangent[3], bitangent[3], normal[3];  // chart plane basis
+    float offset;            // of the plane along its normal
+    float uMin, vMin;        // plane coordinates of the chart's corner
+    float density;           // texels per meter
+    float shading[3];        // normal lighting is computed with
+    int x, y, width, height; // rectangle in the lightmap, padding included
+    int root;                // vertex the chart was found from
+} LightmapChart;
+
+// One mesh being baked
+typedef struct {
+    int mesh;
+    Lightmap* map;
+    LightmapChart* charts;
+    int* chartOf;            // chart covering each texel, -1 for none
+    bool* opaque;            // per triangle; glass lets light and occlusion rays through
+    int firstRow;            // of this job among the rows of all jobs
+} BakeJob;
+
+typedef struct {
+    BakeJob* jobs;
+    int numJobs;
+    int totalRows;
+    atomic_int nextRow;
+    atomic_long rays;
+    atomic_bool cancel;      // set to stop the workers early
+} BakeQueue;
+
+// Everything a cached bake depends on
+typedef struct {
+    SharedMeshKey mesh;
+    int numVerts, numIndices;
+    float density;
+    int aoRays;
+    float aoRadius;
+    float lights[2][3][4];   // position, ambient, diffuse of each light
+    float globalAmbient[4];
+} LightmapCacheKey;
+
+int bakeThreads = -1;        // -bake-threads, -1 for one per core
+
+void orthonormalBasis(const float n[3], float t[3], float b[3]) {
+    // Any axis not parallel to n
+    if (fabsf(n[1]) < 0.9f) {
+        t[0] = n[2]; t[1] = 0.0f; t[2] = -n[0];
+    } else {
+        t[0] = 0.0f; t[1] = -n[2]; t[2] = n[1];
+    }
+    float length = sqrtf(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+    for (int i = 0; i < 3; i++) t[i] /= length;
+    b[0] = n[1] * t[2] - n[2] * t[1];
+    b[1] = n[2] * t[0] - n[0] * t[2];
+    b[2] = n[0] * t[1] - n[1] * t[0];
+}
+
+int findRoot(int* parent, int v) {
+    while (parent[v] != v) {
+        parent[v] = parent[parent[v]];
+        v = parent[v];
+    }
+    return v;
+}
+
+static const LightmapChart* sortCharts;
+
+int compareChartHeights(const void* a, const void* b) {
+    const LightmapChart* chartA = &sortCharts[*(const int*)a];
+    const LightmapChart* chartB = &sortCharts[*(const int*)b];
+    return chartB->height - chartA->height;
+}
+
+// Find a mesh's charts, pack them into a lightmap and give every vertex its
+// lightmap coordinates. Returns the number of charts.
+int unwrapMesh(const Mesh* mesh, Lightmap* map, LightmapChart** chartsOut, int** chartOfOut) {
+    int* parent = malloc((mesh->numVerts ? mesh->numVerts : 1) * sizeof(int));
+    for (int v = 0; v < mesh->numVerts; v++) parent[v] = v;
+    for (int i = 0; i < mesh->numIndices; i += 3) {
+        int root = findRoot(parent, mesh->indices[i]);
+        parent[findRoot(parent, mesh->indices[i + 1])] = root;
+        parent[findRoot(parent, mesh->indices[i + 2])] = root;
+    }
+    
+    // One chart per group, planar along its first triangle
+    int* chartOfRoot = malloc((mesh->numVerts ? mesh->numVerts : 1) * sizeof(int));
+    for (int v = 0; v < mesh->numVerts; v++) chartOfRoot[v] = -1;
+    LightmapChart* charts = malloc((mesh->numIndices / 3 + 1) * sizeof(LightmapChart));
+    int numCharts = 0;
+    for (int i = 0; i < mesh->numIndices; i += 3) {
+        int root = findRoot(parent, mesh->indices[i]);
+        if (chartOfRoot[root] >= 0) continue;
+        const Vertex* a = &mesh->verts[mesh->indices[i]];
+        const Vertex* b = &mesh->verts[mesh->indices[i + 1]];
+        const Vertex* c = &mesh->verts[mesh->indices[i + 2]];
+        float e1[3] = {b->x - a->x, b->y - a->y, b->z - a->z};
+        float e2[3] = {c->x - a->x, c->y - a->y, c->z - a->z};
+        float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2],
+                      e1[0] * e2[1] - e1[1] * e2[0]};
+        float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length < 1e-12f) continue;  // degenerate, try the group's next triangle
+        
+        LightmapChart* chart = &charts[numCharts];
+        chartOfRoot[root] = numCharts++;
+        chart->root = root;
+        for (int k = 0; k < 3; k++) chart->normal[k] = n[k] / length;
+        orthonormalBasis(chart->normal, chart->tangent, chart->bitangent);
+        chart->offset = chart->normal[0] * a->x + chart->normal[1] * a->y + chart->normal[2] * a->z;
+        float s = sqrtf(a->nx * a->nx + a->ny * a->ny + a->nz * a->nz);
+        chart->shading[0] = a->nx / s;
+        chart->shading[1] = a->ny / s;
+        chart->shading[2] = a->nz / s;
+        // Slabs and stairs are inside the building, so get half the texels
+        int kind = mesh->tags[i / 3].kind;
+        chart->density = LIGHTMAP_TEXELS_PER_METER *
+                         (kind == ELEMENT_FLOOR || kind == ELEMENT_STAIR ? 0.5f : 1.0f);
+        chart->uMin = chart->vMin = INFINITY;
+        chart->width = chart->height = 0;  // extents until sized below
+    }
+    
+    // Plane extents of each chart
+    float* uMax = malloc((numCharts + 1) * sizeof(float));
+    float* vMax = malloc((numCharts + 1) * sizeof(float));
+    for (int c = 0; c < numCharts; c++) uMax[c] = vMax[c] = -INFINITY;
+    for (int v = 0; v < mesh->numVerts; v++) {
+        int c = chartOfRoot[findRoot(parent, v)];
+        if (c < 0) continue;
+        const float* p = &mesh->verts[v].x;
+        LightmapChart* chart = &charts[c];
+        float u = chart->tangent[0] * p[0] + chart->tangent[1] * p[1] + chart->tangent[2] * p[2];
+        float w = chart->bitangent[0] * p[0] + chart->bitangent[1] * p[1] + chart->bitangent[2] * p[2];
+        chart->uMin = fminf(chart->uMin, u);
+        chart->vMin = fminf(chart->vMin, w);
+        uMax[c] = fmaxf(uMax[c], u);
+        vMax[c] = fmaxf(vMax[c], w);
+    }
+    float area = 0.0f;
+    int widest = 4;
+    for (int c = 0; c < numCharts; c++) {
+        LightmapChart* chart = &charts[c];
+        chart->width = (int)fmaxf(1.0f, ceilf((uMax[c] - chart->uMin) * chart->density)) + 2 * LIGHTMAP_PADDING;
+        chart->height = (int)fmaxf(1.0f, ceilf((vMax[c] - chart->vMin) * chart->density)) + 2 * LIGHTMAP_PADDING;
+        area += chart->width * chart->height;
+        if (chart->width > widest) widest = chart->width;
+    }
+    free(uMax);
+    free(vMax);
+    
+    // Shelf packing, tallest charts first
+    int* order = malloc((numCharts + 1) * sizeof(int));
+    for (int c = 0; c < numCharts; c++) order[c] = c;
+    sortCharts = charts;
+    qsort(order, numCharts, sizeof(int), compareChartHeights);
+    int width = 4;
+    while (width < widest || width * width < area * 1.1f) width *= 2;
+    int x = 0, y = 0, shelfHeight = 0;
+    for (int k = 0; k < numCharts; k++) {
+        LightmapChart* chart = &charts[order[k]];
+        if (x + chart->width > width) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+        chart->x = x;
+        chart->y = y;
+        x += chart->width;
+        if (chart->height > shelfHeight) shelfHeight = chart->height;
+    }
+    free(order);
+    map->width = width;
+    map->height = y + shelfHeight > 0 ? y + shelfHeight : 1;
+    
+    map->uvs = malloc((mesh->numVerts ? mesh->numVerts : 1) * sizeof(float[2]));
+    for (int v = 0; v < mesh->numVerts; v++) {
+        int c = chartOfRoot[findRoot(parent, v)];
+        map->uvs[v][0] = map->uvs[v][1] = 0.0f;
+        if (c < 0) continue;
+        const float* p = &mesh->verts[v].x;
+        const LightmapChart* chart = &charts[c];
+        float u = chart->tangent[0] * p[0] + chart->tangent[1] * p[1] + chart->tangent[2] * p[2];
+        float w = chart->bitangent[0] * p[0] + chart->bitangent[1] * p[1] + chart->bitangent[2] * p[2];
+        map->uvs[v][0] = (chart->x + LIGHTMAP_PADDING + (u - chart->uMin) * chart->density) / map->width;
+        map->uvs[v][1] = (chart->y + LIGHTMAP_PADDING + (w - chart->vMin) * chart->density) / map->height;
+    }
+    
+    int* chartOf = malloc(map->width * map->height * sizeof(int));
+    for (int i = 0; i < map->width * map->height; i++) chartOf[i] = -1;
+    for (int c = 0; c < numCharts; c++) {
+        const LightmapChart* chart = &charts[c];
+        for (int ty = chart->y; ty < chart->y + chart->height; ty++) {
+            for (int tx = chart->x; tx < chart->x + chart->width; tx++) {
+                chartOf[ty * map->width + tx] = c;
+            }
+        }
+    }
+    free(parent);
+    free(chartOfRoot);
+    *chartsOut = charts;
+    *chartOfOut = chartOf;
+    return numCharts;
+}
+
+// Which triangles of a mesh block light: everything but glass
+bool* opaqueTriangles(const Mesh* mesh) {
+    bool* opaque = malloc((mesh->numIndices / 3 + 1) * sizeof(bool));
+    for (int p = 0; p < mesh->numParts; p++) {
+        const MeshPart* part = &mesh->parts[p];
+        for (int i = part->firstIndex; i < part->firstIndex + part->numIndices; i += 3) {
+            opaque[i / 3] = part->slot != SLOT_GLASS;
+        }
+    }
+    return opaque;
+}
+
+typedef struct {
+    PickContext pick;
+    const bool* opaque;
+} BakeRayContext;
+
+void bakeTriangle(void* context, Ray* ray, int triangle) {
+    BakeRayContext* bake = context;
+    if (bake->opaque[triangle]) pickTriangle(&bake->pick, ray, triangle);
+}
+
+// Whether anything opaque in the mesh lies within distance along a ray
+bool bakeOccluded(const BakeJob* job, const float origin[3], const float dir[3], float distance) {
+    Ray ray;
+    PickHit hit;
+    initRay(&ray, origin, dir);
+    ray.tMax = distance;
+    hit.hit = false;
+    BakeRayContext context = {{&hit, 0, 0, job->mesh}, job->opaque};
+    bvhTraverse(&pickIndex.meshes[job->mesh], &ray, bakeTriangle, &context);
+    return hit.hit;
+}
+
+void bakeTexel(const BakeJob* job, int x, int y, unsigned char* out, long* rays) {
+    const LightmapChart* chart = &job->charts[job->chartOf[y * job->map->width + x]];
+    float u = chart->uMin + (x - chart->x - LIGHTMAP_PADDING + 0.5f) / chart->density;
+    float v = chart->vMin + (y - chart->y - LIGHTMAP_PADDING + 0.5f) / chart->density;
+    const float* n = chart->shading;
+    float origin[3];
+    for (int k = 0; k < 3; k++) {
+        // Lifted off the surface so the ray does not hit where it starts
+        origin[k] = chart->tangent[k] * u + chart->bitangent[k] * v + chart->normal[k] * chart->offset +
+                    n[k] * 0.002f;
+    }
+    
+    // Ambient occlusion from cosine distributed rays over the hemisphere
+    float t[3], b[3];
+    orthonormalBasis(n, t, b);
+    unsigned int seed = hashBytes((int[3]){job->mesh, x, y}, sizeof(int[3])) | 1;
+    int open = 0;
+    for (int i = 0; i < LIGHTMAP_AO_RAYS; i++) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        float r1 = (i + (seed & 0xffff) / 65536.0f) / LIGHTMAP_AO_RAYS;  // stratified
+        float r2 = (seed >> 16) / 65536.0f;
+        float phi = 2.0f * M_PI * r2;
+        float r = sqrtf(r1);
+        float lx = r * cosf(phi), ly = r * sinf(phi), lz = sqrtf(fmaxf(0.0f, 1.0f - r1));
+        float dir[3];
+        for (int k = 0; k < 3; k++) {
+            dir[k] = t[k] * lx + b[k] * ly + n[k] * lz;
+        }
+        open += !bakeOccluded(job, origin, dir, LIGHTMAP_AO_RADIUS);
+    }
+    float ao = (float)open / LIGHTMAP_AO_RAYS;
+    *rays += LIGHTMAP_AO_RAYS;
+    
+    float light[3];
+    for (int k = 0; k < 3; k++) {
+        light[k] = (globalAmbient[k] + advancedLights[0].ambient[k] + advancedLights[1].ambient[k]) * ao;
+    }
+    for (int l = 0; l < 2; l++) {
+        const float* p = advancedLights[l].position;
+        float length = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        float dir[3] = {p[0] / length, p[1] / length, p[2] / length};
+        float lambert = n[0] * dir[0] + n[1] * dir[1] + n[2] * dir[2];
+        if (lambert <= 0.0f) continue;
+        (*rays)++;
+        if (bakeOccluded(job, origin, dir, INFINITY)) continue;
+        for (int k = 0; k < 3; k++) {
+            light[k] += advancedLights[l].diffuse[k] * lambert;
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        float value = light[k] * 0.5f * 255.0f + 0.5f;
+        out[k] = value > 255.0f ? 255 : (unsigned char)value;
+    }
+}
+
+// Average each texel with its neighbors in the same chart, smoothing the
+// noise of the occlusion rays without bleeding light across charts
+void filterLightmap(const BakeJob* job) {
+    const Lightmap* map = job->map;
+    unsigned char* filtered = malloc(map->width * map->height * 3);
+    memcpy(filtered, map->texels, map->width * map->height * 3);
+    for (int y = 0; y < map->height; y++) {
+        for (int x = 0; x < map->width; x++) {
+            int chart = job->chartOf[y * map->width + x];
+            if (chart < 0) continue;
+            int sum[3] = {0, 0, 0}, count = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = x + dx, ny = y + dy;
+                    if (nx < 0 || ny < 0 || nx >= map->width || ny >= map->height ||
+                        job->chartOf[ny * map->width + nx] != chart) continue;
+                    for (int k = 0; k < 3; k++) sum[k] += map->texels[(ny * map->width + nx) * 3 + k];
+                    count++;
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                filtered[(y * map->width + x) * 3 + k] = (sum[k] + count / 2) / count;
+            }
+        }
+    }
+    free(map->texels);
+    job->map->texels = filtered;
+}
+
+void* bakeWorker(void* arg) {
+    BakeQueue* queue = arg;
+    long rays = 0;
+    int job = 0;
+    for (;;) {
+        if (atomic_load_explicit(&queue->cancel, memory_order_relaxed)) break;
+        int row = atomic_fetch_add(&queue->nextRow, 1);
+        if (row >= queue->totalRows) break;
+        while (row >= queue->jobs[job].firstRow + queue->jobs[job].map->height) job++;
+        const BakeJob* current = &queue->jobs[job];
+        int y = row - current->firstRow;
+        for (int x = 0; x < current->map->width; x++) {
+            if (current->chartOf[y * current->map->width + x] < 0) continue;
+            bakeTexel(current, x, y, &current->map->texels[(y * current->map->width + x) * 3], &rays);
+        }
+    }
+    atomic_fetch_add(&queue->rays, rays);
+    return NULL;
+}
+
+void initLightmapCacheKey(LightmapCacheKey* key, const SharedMesh* shared) {
+    memset(key, 0, sizeof(LightmapCacheKey));
+    key->mesh = shared->key;
+    key->numVerts = shared->mesh.numVerts;
+    key->numIndices = shared->mesh.numIndices;
+    key->density = LIGHTMAP_TEXELS_PER_METER;
+    key->aoRays = LIGHTMAP_AO_RAYS;
+    key->aoRadius = LIGHTMAP_AO_RADIUS;
+    for (int l = 0; l < 2; l++) {
+        memcpy(key->lights[l][0], advancedLights[l].position, sizeof(float[4]));
+        memcpy(key->lights[l][1], advancedLights[l].ambient, sizeof(float[4]));
+        memcpy(key->lights[l][2], advancedLights[l].diffuse, sizeof(float[4]));
+    }
+    memcpy(key->globalAmbient, globalAmbient, sizeof(float[4]));
+}
+
+void lightmapCachePath(const LightmapCacheKey* key, char* path, size_t size) {
+    snprintf(path, size, "%s/%08x.lmap", LIGHTMAP_CACHE_DIR, hashBytes(key, sizeof(LightmapCacheKey)));
+}
+
+bool loadCachedLightmap(const LightmapCacheKey* key, Lightmap* map) {
+    char path[256];
+    lightmapCachePath(key, path, sizeof(path));
+    FILE* in = fopen(path, "rb");
+    if (!in) return false;
+    char magic[8];
+    LightmapCacheKey stored;
+    int size[2];
+    bool ok = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, LIGHTMAP_MAGIC, 8) == 0 &&
+              fread(&stored, sizeof(stored), 1, in) == 1 &&
+              memcmp(&stored, key, sizeof(LightmapCacheKey)) == 0 &&
+              fread(size, sizeof(size), 1, in) == 1 &&
+              size[0] > 0 && size[1] > 0 && size[0] <= 16384 && size[1] <= 16384;
+    if (ok) {
+        map->width = size[0];
+        map->height = size[1];
+        map->uvs = malloc((key->numVerts ? key->numVerts : 1) * sizeof(float[2]));
+        map->texels = malloc(map->width * map->height * 3);
+        ok = fread(map->uvs, sizeof(float[2]), key->numVerts, in) == (size_t)key->numVerts &&
+             fread(map->texels, 3, map->width * map->height, in) == (size_t)(map->width * map->height);
+        if (!ok) freeLightmap(map);
+    }
+    fclose(in);
+    return ok;
+}
+
+void saveCachedLightmap(const LightmapCacheKey* key, const Lightmap* map) {
+    char path[256];
+#ifdef _WIN32
+    mkdir(LIGHTMAP_CACHE_DIR);
+#else
+    mkdir(LIGHTMAP_CACHE_DIR, 0755);
+#endif
+    lightmapCachePath(key, path, sizeof(path));
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Lightmaps: cannot write %s\n", path);
+        return;
+    }
+    int size[2] = {map->width, map->height};
+    fwrite(LIGHTMAP_MAGIC, 8, 1, out);
+    fwrite(key, sizeof(LightmapCacheKey), 1, out);
+    fwrite(size, sizeof(size), 1, out);
+    fwrite(map->uvs, sizeof(float[2]), key->numVerts, out);
+    fwrite(map->texels, 3, map->width * map->height, out);
+    fclose(out);
+}
+
+void clearLightmaps() {
+    for (int m = 0; m < lightmaps.count; m++) {
+        freeLightmap(&lightmaps.maps[m]);
+    }
+    lightmaps.count = 0;
+    lightmaps.bytes = 0;
+}
+
+// A bake of the shared meshes missing lightmaps
+typedef struct {
+    BakeQueue queue;
+    int threads;             // tracing threads, the caller's included
+    int started;             // extra threads actually started
+    int loaded;              // meshes loaded from the disk cache instead
+    long texels;
+    double startTime;
+    double traceSeconds;
+    bool running;            // traced in the background, owning the queued maps
+    pthread_t thread;
+    atomic_bool done;
+} LightmapBake;
+
+#define LIGHTMAP_POLL_MS 100         // how often the viewer checks on a background bake
+
+LightmapBake lightmapBake;
+bool viewerRunning = false;  // the GLUT main loop is up to take redisplay requests
+
+// Load what the disk cache has for every shared mesh in use that has no
+// lightmap yet, and queue the rest. threads < 0 uses one thread per core.
+void prepareLightmapBake(LightmapBake* bake, int threads, bool useCache) {
+    bake->startTime = nowSeconds();
+    updatePickIndex();
+    if (lightmaps.generation != meshStore.generation) {
+        clearLightmaps();
+        lightmaps.generation = meshStore.generation;
+    }
+    if (lightmaps.count < meshStore.count) {
+        lightmaps.maps = realloc(lightmaps.maps, meshStore.count * sizeof(Lightmap));
+        memset(&lightmaps.maps[lightmaps.count], 0, (meshStore.count - lightmaps.count) * sizeof(Lightmap));
+        lightmaps.count = meshStore.count;
+    }
+    if (threads < 0) {
+        threads = coreCount();
+    }
+    if (threads < 1) threads = 1;
+    if (threads > LIGHTMAP_MAX_THREADS) threads = LIGHTMAP_MAX_THREADS;
+    bake->threads = threads;
+    bake->started = 0;
+    bake->loaded = 0;
+    bake->texels = 0;
+    bake->traceSeconds = 0.0;
+    
+    BakeQueue* queue = &bake->queue;
+    queue->jobs = malloc((meshStore.count ? meshStore.count : 1) * sizeof(BakeJob));
+    queue->numJobs = 0;
+    queue->totalRows = 0;
+    atomic_init(&queue->nextRow, 0);
+    atomic_init(&queue->rays, 0);
+    atomic_init(&queue->cancel, false);
+    for (int m = 0; m < meshStore.count; m++) {
+        SharedMesh* shared = &meshStore.meshes[m];
+        Lightmap* map = &lightmaps.maps[m];
+        if (map->baked || !shared->numInstances || !shared->mesh.numIndices) continue;
+        LightmapCacheKey key;
+        initLightmapCacheKey(&key, shared);
+        if (useCache && loadCachedLightmap(&key, map)) {
+            map->baked = true;
+            bake->loaded++;
+            continue;
+        }
+        BakeJob* job = &queue->jobs[queue->numJobs++];
+        job->mesh = m;
+        job->map = map;
+        unwrapMesh(&shared->mesh, map, &job->charts, &job->chartOf);
+        job->opaque = opaqueTriangles(&shared->mesh);
+        map->texels = calloc(map->width * map->height, 3);
+        job->firstRow = queue->totalRows;
+        queue->totalRows += map->height;
+        bake->texels += map->width * map->height;
+    }
+}
+
+// Trace and filter the queued lightmaps, on the calling thread and as many
+// more as the bake has
+void traceLightmapBake(LightmapBake* bake) {
+    BakeQueue* queue = &bake->queue;
+    double t1 = nowSeconds();
+    pthread_t workers[LIGHTMAP_MAX_THREADS];
+    if (queue->numJobs) {
+        for (int i = 1; i < bake->threads; i++) {
+            if (pthread_create(&workers[bake->started], NULL, bakeWorker, queue) == 0) bake->started++;
+        }
+        bakeWorker(queue);
+        for (int i = 0; i < bake->started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    bake->traceSeconds = nowSeconds() - t1;
+    if (atomic_load(&queue->cancel)) return;
+    for (int j = 0; j < queue->numJobs; j++) {
+        filterLightmap(&queue->jobs[j]);
+    }
+}
+
+// Hand the traced lightmaps to their meshes, or drop them if the bake was
+// cancelled, and report
+void finishLightmapBake(LightmapBake* bake, bool useCache) {
+    BakeQueue* queue = &bake->queue;
+    bool cancelled = atomic_load(&queue->cancel);
+    for (int j = 0; j < queue->numJobs; j++) {
+        BakeJob* job = &queue->jobs[j];
+        if (cancelled) {
+            freeLightmap(job->map);
+        } else {
+            job->map->baked = true;
+            if (useCache) {
+                LightmapCacheKey key;
+                initLightmapCacheKey(&key, &meshStore.meshes[job->mesh]);
+                saveCachedLightmap(&key, job->map);
+            }
+        }
+        free(job->charts);
+        free(job->chartOf);
+        free(job->opaque);
+    }
+    free(queue->jobs);
+    queue->jobs = NULL;
+    lightmaps.bytes = 0;
+    for (int m = 0; m < lightmaps.count; m++) {
+        const Lightmap* map = &lightmaps.maps[m];
+        if (map->baked) lightmaps.bytes += map->width * map->height * 3;
+    }
+    
+    if (cancelled) {
+        printf("Lightmaps: bake of %d meshes cancelled by a scene change\n", queue->numJobs);
+    } else if (queue->numJobs || bake->loaded) {
+        lightmaps.bakes++;
+        long rays = atomic_load(&queue->rays);
+        printf("Lightmaps: %d meshes baked (%.2f M texels, %.1f M rays) in %.0f ms on %d threads, "
+               "%d loaded from cache, %.1f MB total\n",
+               queue->numJobs, bake->texels / 1e6, rays / 1e6, (nowSeconds() - bake->startTime) * 1000.0,
+               bake->started + 1, bake->loaded, lightmaps.bytes / (1024.0 * 1024.0));
+    }
+}
+
+void* lightmapBakeThread(void* arg) {
+    LightmapBake* bake = arg;
+    traceLightmapBake(bake);
+    atomic_store(&bake->done, true);
+    return NULL;
+}
+
+// Wait for the background bake, cancelling it first unless its maps are
+// wanted. Anything that changes the meshes or the pick index calls this first.
+void stopLightmapBake(bool cancel) {
+    if (!lightmapBake.running) return;
+    if (cancel) atomic_store(&lightmapBake.queue.cancel, true);
+    pthread_join(lightmapBake.thread, NULL);
+    lightmapBake.running = false;
+    finishLightmapBake(&lightmapBake, true);
+}
+
+// Take the background bake's maps once it is done
+void pollLightmapBake() {
+    if (lightmapBake.running && atomic_load(&lightmapBake.done)) {
+        stopLightmapBake(false);
+    }
+}
+
+// Keeps the viewer redrawing until the background bake is done
+void lightmapBakeTimer(int value) {
+    (void)value;
+    if (!lightmapBake.running) return;
+    if (atomic_load(&lightmapBake.done)) {
+        glutPostRedisplay();
+    } else {
+        glutTimerFunc(LIGHTMAP_POLL_MS, lightmapBakeTimer, 0);
+    }
+}
+
+// Start baking what is missing in the background, unless a bake is running
+void startLightmapBake(int threads) {
+    if (lightmapBake.running) return;
+    prepareLightmapBake(&lightmapBake, threads, true);
+    if (!lightmapBake.queue.numJobs) {
+        finishLightmapBake(&lightmapBake, true);
+        return;
+    }
+    atomic_init(&lightmapBake.done, false);
+    if (pthread_create(&lightmapBake.thread, NULL, lightmapBakeThread, &lightmapBake) != 0) {
+        fprintf(stderr, "Lightmaps: cannot start a bake thread, baking in the foreground\n");
+        traceLightmapBake(&lightmapBake);
+        finishLightmapBake(&lightmapBake, true);
+        return;
+    }
+    lightmapBake.running = true;
+    if (viewerRunning) {
+        glutTimerFunc(LIGHTMAP_POLL_MS, lightmapBakeTimer, 0);
+    }
+}
+
+// Bake every shared mesh in use that has no lightmap yet, loading what the
+// disk cache has, and wait for it. threads < 0 uses one thread per core.
+// Returns the seconds spent tracing rays.
+double bakeLightmaps(int threads, bool useCache) {
+    stopLightmapBake(false);
+    LightmapBake bake;
+    prepareLightmapBake(&bake, threads, useCache);
+    traceLightmapBake(&bake);
+    finishLightmapBake(&bake, useCache);
+    return bake.traceSeconds;
+}
+
+// Solar exposure
+// Counts the hours of direct sun every window of the scene receives over a
+// range of days. The sun follows its true path for a latitude, sampled at a
+// fixed step of local solar time; the scene's -z axis points north. A window
+// sees the sun at a sample if the sun is in front of its wall and a ray from
+// its center towards the sun reaches the sky past every building, glass
+// excepted. Rays are traced four at a time, for four neighboring windows,
+// through the picking BVHs. Work is split into blocks of windows and sun
+// samples over a pool of threads.
+#define SOLAR_CHUNK 256          // sun samples per work item
+#define SOLAR_MAX_THREADS 64
+
+typedef struct {
+    int building, floor;
+    int mesh;                    // shared mesh the window belongs to
+    int firstTriangle, numTriangles;
+    int wall, index;
+    float position[3];           // world space ray origin, just off the glass
+    float normal[3];
+} SolarWindow;
+
+typedef struct {
+    float dir[3];                // towards the sun
+    float hours;                 // of time the sample stands for
+} SunSample;
+
+typedef struct {
+    SolarWindow* windows;
+    int numWindows;
+    float* sunHours;             // per window
+    float* facingHours;          // sun up and in front of the window, shaded or not
+    float maxHours;
+    int revision;                // scene revision the study belongs to
+} SolarStudy;
+
+// A ray per lane; lanes drop out of active once something blocks them
+typedef struct {
+    v4sf origin[3];
+    v4sf dir[3];
+    v4sf invDir[3];
+    v4sf tMax;
+    v4si active;
+} RayPacket;
+
+typedef void (*PacketLeafFunc)(void* context, RayPacket* packet, int item);
+
+SolarStudy solar = {.revision = -1};
+bool** solarOpaque;              // opaqueTriangles() of every shared mesh during a study
+float solarLatitude = 45.0f;
+int solarFirstDay = 0;           // day of the year, 0 for January 1
+int solarLastDay = 364;
+int solarStepMinutes = 15;
+int solarThreads = -1;           // -1 for one per core
+bool solarOverlay = false;
+
+static inline bool v4any(v4si mask) {
+    return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+// Any-hit traversal: the leaf clears the lanes it blocks, and the walk ends
+// as soon as no lane is left
+void bvhOccludePacket(const BVH* bvh, RayPacket* packet, PacketLeafFunc leaf, void* context) {
+    if (!bvh->numNodes) return;
+    v4sf zero = {0, 0, 0, 0};
+    int stack[3 * bvh->depth + 1];
+    int sp = 0;
+    stack[sp++] = 0;
+    
+    while (sp) {
+        const BVHNode* node = &bvh->nodes[stack[--sp]];
+        for (int i = 0; i < 4; i++) {
+            if (node->count[i] < 0) continue;
+            v4sf x1 = (node->minX[i] - packet->origin[0]) * packet->invDir[0];
+            v4sf x2 = (node->maxX[i] - packet->origin[0]) * packet->invDir[0];
+            v4sf y1 = (node->minY[i] - packet->origin[1]) * packet->invDir[1];
+            v4sf y2 = (node->maxY[i] - packet->origin[1]) * packet->invDir[1];
+            v4sf z1 = (node->minZ[i] - packet->origin[2]) * packet->invDir[2];
+            v4sf z2 = (node->maxZ[i] - packet->origin[2]) * packet->invDir[2];
+            v4sf tNear = v4max(v4max(v4min(x1, x2), v4min(y1, y2)), v4max(v4min(z1, z2), zero));
+            v4sf tFar = v4min(v4min(v4max(x1, x2), v4max(y1, y2)), v4min(v4max(z1, z2), packet->tMax));
+            if (!v4any((tNear <= tFar) & packet->active)) continue;
+            
+            if (node->count[i] == 0) {
+                stack[sp++] = node->child[i];
+                continue;
+            }
+            for (int k = 0; k < node->count[i]; k++) {
+                leaf(context, packet, bvh->items[node->child[i] + k]);
+                if (!v4any(packet->active)) return;
+            }
+        }
+    }
+}
+
+typedef struct {
+    int building;
+    int mesh;
+} SolarContext;
+
+// Moller-Trumbore for four rays against one triangle
+void solarTriangle(void* context, RayPacket* packet, int triangle) {
+    SolarContext* solarContext = context;
+    if (!solarOpaque[solarContext->mesh][triangle]) return;
+    const Mesh* mesh = &meshStore.meshes[solarContext->mesh].mesh;
+    const float* a = &mesh->verts[mesh->indices[triangle * 3]].x;
+    const float* b = &mesh->verts[mesh->indices[triangle * 3 + 1]].x;
+    const float* c = &mesh->verts[mesh->indices[triangle * 3 + 2]].x;
+    float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    
+    const v4sf* d = packet->dir;
+    v4sf px = d[1] * e2[2] - d[2] * e2[1];
+    v4sf py = d[2] * e2[0] - d[0] * e2[2];
+    v4sf pz = d[0] * e2[1] - d[1] * e2[0];
+    v4sf invDet = 1.0f / (e1[0] * px + e1[1] * py + e1[2] * pz);
+    v4sf sx = packet->origin[0] - a[0];
+    v4sf sy = packet->origin[1] - a[1];
+    v4sf sz = packet->origin[2] - a[2];
+    v4sf u = (sx * px + sy * py + sz * pz) * invDet;
+    v4sf qx = sy * e1[2] - sz * e1[1];
+    v4sf qy = sz * e1[0] - sx * e1[2];
+    v4sf qz = sx * e1[1] - sy * e1[0];
+    v4sf v = (d[0] * qx + d[1] * qy + d[2] * qz) * invDet;
+    v4sf t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * invDet;
+    // Comparisons with the NaNs of parallel rays come out false
+    v4si hit = (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) & (t > 1e-4f) & (t < packet->tMax);
+    packet->active &= ~hit;
+}
+
+void solarFloor(void* context, RayPacket* packet, int floor) {
+    SolarContext* solarContext = context;
+    const SceneBuilding* building = &scene.buildings[solarContext->building];
+    SolarContext meshContext = *solarContext;
+    meshContext.mesh = floor < building->params.numFloors ? building->floorMeshes[floor] : building->roofMesh;
+    
+    // The mesh BVH is in floor space: move the rays rather than the mesh
+    RayPacket local = *packet;
+    local.origin[0] -= building->x;
+    local.origin[1] -= floor * floorHeight;
+    local.origin[2] -= building->z;
+    bvhOccludePacket(&pickIndex.meshes[meshContext.mesh], &local, solarTriangle, &meshContext);
+    packet->active = local.active;
+}
+
+void solarBuilding(void* context, RayPacket* packet, int building) {
+    SolarContext* solarContext = context;
+    solarContext->building = building;
+    bvhOccludePacket(&pickIndex.buildings[building], packet, solarFloor, solarContext);
+}
+
+// Direction of the sun at a day of the year and hour of local solar time,
+// with x east, y up and -z north. Declination from the NOAA series.
+void sunDirection(int day, float hour, float latitude, float dir[3]) {
+    float g = 2.0f * M_PI / 365.0f * (day + (hour - 12.0f) / 24.0f);
+    float declination = 0.006918f - 0.399912f * cosf(g) + 0.070257f * sinf(g) -
+                        0.006758f * cosf(2 * g) + 0.000907f * sinf(2 * g) -
+                        0.002697f * cosf(3 * g) + 0.00148f * sinf(3 * g);
+    float hourAngle = (hour - 12.0f) * 15.0f * M_PI / 180.0f;
+    float lat = latitude * M_PI / 180.0f;
+    float east = -cosf(declination) * sinf(hourAngle);
+    float north = cosf(lat) * sinf(declination) - sinf(lat) * cosf(declination) * cosf(hourAngle);
+    float up = sinf(lat) * sinf(declination) + cosf(lat) * cosf(declination) * cosf(hourAngle);
+    dir[0] = east;
+    dir[1] = up;
+    dir[2] = -north;
+}
+
+// Sun samples above the horizon, at the middle of each step of each day
+int sunSamples(SunSample** samples) {
+    int days = (solarLastDay - solarFirstDay + 365) % 365 + 1;
+    int perDay = (24 * 60 + solarStepMinutes - 1) / solarStepMinutes;
+    *samples = malloc(days * perDay * sizeof(SunSample));
+    int count = 0;
+    for (int d = 0; d < days; d++) {
+        int day = (solarFirstDay + d) % 365;
+        for (int s = 0; s < perDay; s++) {
+            float minute = (s + 0.5f) * solarStepMinutes;
+            if (minute >= 24 * 60) break;
+            SunSample* sample = &(*samples)[count];
+            sunDirection(day, minute / 60.0f, solarLatitude, sample->dir);
+            if (sample->dir[1] <= 0.0f) continue;
+            sample->hours = solarStepMinutes / 60.0f;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Every window of every floor in the scene, found from the window tags of
+// the floor meshes, into a study. A window's triangles are contiguous in its mesh.
+void findSolarWindows(SolarStudy* study) {
+    static const float wallNormals[NUM_WALLS][3] = {{0, 0, 1}, {0, 0, -1}, {-1, 0, 0}, {1, 0, 0}};
+    
+    // Windows of each mesh in floor space, found once per mesh
+    int* first = malloc((meshStore.count + 1) * sizeof(int));
+    int* count = calloc(meshStore.count + 1, sizeof(int));
+    SolarWindow* meshWindows = NULL;
+    int numMeshWindows = 0, capMeshWindows = 0;
+    for (int m = 0; m < meshStore.count; m++) {
+        const Mesh* mesh = &meshStore.meshes[m].mesh;
+        first[m] = numMeshWindows;
+        int numTriangles = mesh->numIndices / 3;
+        for (int t = 0; t < numTriangles; ) {
+            const MeshTag* tag = &mesh->tags[t];
+            if (tag->kind != ELEMENT_WINDOW || tag->wall < 0) {
+                t++;
+                continue;
+            }
+            int end = t + 1;
+            while (end < numTriangles && mesh->tags[end].kind == ELEMENT_WINDOW &&
+                   mesh->tags[end].wall == tag->wall && mesh->tags[end].index == tag->index) {
+                end++;
+            }
+            
+            // Area weighted center of the window's triangles
+            float center[3] = {0, 0, 0}, area = 0.0f;
+            for (int k = t; k < end; k++) {
+                const float* a = &mesh->verts[mesh->indices[k * 3]].x;
+                const float* b = &mesh->verts[mesh->indices[k * 3 + 1]].x;
+                const float* c = &mesh->verts[mesh->indices[k * 3 + 2]].x;
+                float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+                float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+                float cx = e1[1] * e2[2] - e1[2] * e2[1];
+                float cy = e1[2] * e2[0] - e1[0] * e2[2];
+                float cz = e1[0] * e2[1] - e1[1] * e2[0];
+                float triangleArea = 0.5f * sqrtf(cx * cx + cy * cy + cz * cz);
+                for (int axis = 0; axis < 3; axis++) {
+                    center[axis] += triangleArea * (a[axis] + b[axis] + c[axis]) / 3.0f;
+                }
+                area += triangleArea;
+            }
+            if (numMeshWindows == capMeshWindows) {
+                capMeshWindows = capMeshWindows ? capMeshWindows * 2 : 256;
+                meshWindows = realloc(meshWindows, capMeshWindows * sizeof(SolarWindow));
+            }
+            SolarWindow* window = &meshWindows[numMeshWindows++];
+            window->mesh = m;
+            window->firstTriangle = t;
+            window->numTriangles = end - t;
+            window->wall = tag->wall;
+            window->index = tag->index;
+            for (int axis = 0; axis < 3; axis++) {
+                window->normal[axis] = wallNormals[tag->wall][axis];
+                // Start past the glass, which is a centimeter off the wall
+                window->position[axis] = (area > 0.0f ? center[axis] / area : 0.0f) +
+                                         0.05f * window->normal[axis];
+            }
+            count[m]++;
+            t = end;
+        }
+    }
+    
+    free(study->windows);
+    study->numWindows = 0;
+    for (int b = 0; b < scene.numBuildings; b++) {
+        for (int f = 0; f < scene.buildings[b].params.numFloors; f++) {
+            study->numWindows += count[scene.buildings[b].floorMeshes[f]];
+        }
+    }
+    study->windows = malloc((study->numWindows + 1) * sizeof(SolarWindow));
+    int n = 0;
+    for (int b = 0; b < scene.numBuildings; b++) {
+        const SceneBuilding* building = &scene.buildings[b];
+        for (int f = 0; f < building->params.numFloors; f++) {
+            int m = building->floorMeshes[f];
+            for (int w = 0; w < count[m]; w++) {
+                SolarWindow* window = &study->windows[n++];
+                *window = meshWindows[first[m] + w];
+                window->building = b;
+                window->floor = f;
+                window->position[0] += building->x;
+                window->position[1] += f * floorHeight;
+                window->position[2] += building->z;
+            }
+        }
+    }
+    free(meshWindows);
+    free(first);
+    free(count);
+}
+
+typedef struct {
+    SolarStudy* study;
+    const SunSample* samples;
+    int numSamples;
+    int numPackets;              // of four windows
+    int numChunks;               // of samples
+    atomic_int nextItem;
+    atomic_long rays;
+    atomic_bool cancel;          // set to stop the workers early
+    float* partial;              // sun and facing hours per window, per thread
+} SolarQueue;
+
+typedef struct {
+    SolarQueue* queue;
+    int thread;
+} SolarWorkerArgs;
+
+void* solarWorker(void* arg) {
+    SolarWorkerArgs* args = arg;
+    SolarQueue* queue = args->queue;
+    const SolarStudy* study = queue->study;
+    float* sunHours = queue->partial + (size_t)args->thread * study->numWindows * 2;
+    float* facingHours = sunHours + study->numWindows;
+    int numItems = queue->numPackets * queue->numChunks;
+    long rays = 0;
+    
+    for (;;) {
+        if (atomic_load_explicit(&queue->cancel, memory_order_relaxed)) break;
+        int item = atomic_fetch_add(&queue->nextItem, 1);
+        if (item >= numItems) break;
+        if (args->thread == 0 && item % (numItems / 20 + 1) == 0) {
+            fprintf(stderr, "\rSolar: %d%%", 100 * item / numItems);
+        }
+        int packetIndex = item / queue->numChunks;
+        int firstSample = item % queue->numChunks * SOLAR_CHUNK;
+        int lastSample = firstSample + SOLAR_CHUNK;
+        if (lastSample > queue->numSamples) lastSample = queue->numSamples;
+        
+        int first = packetIndex * 4;
+        int lanes = study->numWindows - first < 4 ? study->numWindows - first : 4;
+        RayPacket base;
+        for (int lane = 0; lane < 4; lane++) {
+            const SolarWindow* window = &study->windows[first + (lane < lanes ? lane : 0)];
+            for (int axis = 0; axis < 3; axis++) {
+                base.origin[axis][lane] = window->position[axis];
+            }
+        }
+        for (int s = firstSample; s < lastSample; s++) {
+            const SunSample* sample = &queue->samples[s];
+            RayPacket packet = base;
+            packet.tMax = (v4sf){INFINITY, INFINITY, INFINITY, INFINITY};
+            for (int lane = 0; lane < 4; lane++) {
+                const SolarWindow* window = &study->windows[first + (lane < lanes ? lane : 0)];
+                float facing = window->normal[0] * sample->dir[0] + window->normal[1] * sample->dir[1] +
+                               window->normal[2] * sample->dir[2];
+                packet.active[lane] = lane < lanes && facing > 0.0f ? -1 : 0;
+                if (packet.active[lane]) facingHours[first + lane] += sample->hours;
+            }
+            if (!v4any(packet.active)) continue;
+            v4si facing = packet.active;
+            for (int axis = 0; axis < 3; axis++) {
+                float d = fabsf(sample->dir[axis]) > 1e-20f ? sample->dir[axis] : 1e-20f;
+                packet.dir[axis] = (v4sf){0, 0, 0, 0} + sample->dir[axis];
+                packet.invDir[axis] = (v4sf){0, 0, 0, 0} + 1.0f / d;
+            }
+            SolarContext context = {0, 0};
+            bvhOccludePacket(&pickIndex.scene, &packet, solarBuilding, &context);
+            for (int lane = 0; lane < lanes; lane++) {
+                rays += facing[lane] != 0;
+                if (packet.active[lane]) sunHours[first + lane] += sample->hours;
+            }
+        }
+    }
+    atomic_fetch_add(&queue->rays, rays);
+    return NULL;
+}
+
+// A study being run, the viewer's in the background
+typedef struct {
+    SolarStudy study;            // replaces solar once complete
+    SolarQueue queue;
+    SunSample* samples;
+    SolarWorkerArgs args[SOLAR_MAX_THREADS];
+    int threads;
+    int started;                 // extra threads actually started
+    double startTime;
+    double seconds;
+    bool running;                // traced in the background, owning the pick index
+    pthread_t thread;
+    atomic_bool done;
+} SolarRun;
+
+#define SOLAR_POLL_MS 100        // how often the viewer checks on a background study
+
+SolarRun solarRun;
+
+// Find the windows and sun samples of the current scene and queue them
+void prepareSolarStudy(SolarRun* run) {
+    if (geometryDirty) {
+        stopLightmapBake(true);
+        generateScene();
+    }
+    run->startTime = nowSeconds();
+    updatePickIndex();
+    memset(&run->study, 0, sizeof(SolarStudy));
+    findSolarWindows(&run->study);
+    run->study.revision = scene.revision;
+    int numSamples = sunSamples(&run->samples);
+    
+    int threads = solarThreads;
+    if (threads < 1) {
+        threads = coreCount();
+    }
+    if (threads > SOLAR_MAX_THREADS) threads = SOLAR_MAX_THREADS;
+    run->threads = threads;
+    run->started = 0;
+    
+    solarOpaque = malloc((meshStore.count + 1) * sizeof(bool*));
+    for (int m = 0; m < meshStore.count; m++) {
+        solarOpaque[m] = opaqueTriangles(&meshStore.meshes[m].mesh);
+    }
+    SolarQueue* queue = &run->queue;
+    queue->study = &run->study;
+    queue->samples = run->samples;
+    queue->numSamples = numSamples;
+    queue->numPackets = (run->study.numWindows + 3) / 4;
+    queue->numChunks = (numSamples + SOLAR_CHUNK - 1) / SOLAR_CHUNK;
+    atomic_init(&queue->nextItem, 0);
+    atomic_init(&queue->rays, 0);
+    atomic_init(&queue->cancel, false);
+    queue->partial = calloc((size_t)threads * run->study.numWindows * 2 + 1, sizeof(float));
+    for (int i = 0; i < threads; i++) {
+        run->args[i] = (SolarWorkerArgs){queue, i};
+    }
+}
+
+// Trace the queued windows on the calling thread and as many more as the run has
+void traceSolarStudy(SolarRun* run) {
+    pthread_t workers[SOLAR_MAX_THREADS];
+    for (int i = 1; i < run->threads; i++) {
+        if (pthread_create(&workers[run->started], NULL, solarWorker, &run->args[i]) == 0) run->started++;
+    }
+    solarWorker(&run->args[0]);
+    for (int i = 0; i < run->started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    run->seconds = nowSeconds() - run->startTime;
+    fprintf(stderr, "\r");
+}
+
+// Sum the threads' hours into the study and make it the current one, or drop
+// it if the run was cancelled
+void finishSolarStudy(SolarRun* run) {
+    SolarStudy* study = &run->study;
+    SolarQueue* queue = &run->queue;
+    bool cancelled = atomic_load(&queue->cancel);
+    if (!cancelled) {
+        study->sunHours = calloc(study->numWindows + 1, sizeof(float));
+        study->facingHours = calloc(study->numWindows + 1, sizeof(float));
+        for (int i = 0; i < run->threads; i++) {
+            const float* partial = queue->partial + (size_t)i * study->numWindows * 2;
+            for (int w = 0; w < study->numWindows; w++) {
+                study->sunHours[w] += partial[w];
+                study->facingHours[w] += partial[study->numWindows + w];
+            }
+        }
+        double totalHours = 0.0;
+        float minHours = study->numWindows ? INFINITY : 0.0f;
+        study->maxHours = 0.0f;
+        for (int w = 0; w < study->numWindows; w++) {
+            totalHours += study->sunHours[w];
+            minHours = fminf(minHours, study->sunHours[w]);
+            study->maxHours = fmaxf(study->maxHours, study->sunHours[w]);
+        }
+        
+        long rays = atomic_load(&queue->rays);
+        printf("Solar: %d windows, %d daytime samples (days %d-%d, every %d min, latitude %.1f)\n",
+               study->numWindows, queue->numSamples, solarFirstDay + 1, solarLastDay + 1,
+               solarStepMinutes, solarLatitude);
+        printf("Solar: %.1f M rays in %.2f s on %d threads (%.2f M rays/s)\n",
+               rays / 1e6, run->seconds, run->started + 1, rays / 1e6 / run->seconds);
+        printf("Solar: direct sun per window min %.0f h, mean %.0f h, max %.0f h\n",
+               minHours, study->numWindows ? totalHours / study->numWindows : 0.0, study->maxHours);
+        
+        free(solar.windows);
+        free(solar.sunHours);
+        free(solar.facingHours);
+        solar = *study;
+    } else {
+        printf("Solar: study cancelled by a scene change\n");
+        free(study->windows);
+    }
+    memset(study, 0, sizeof(SolarStudy));
+    
+    for (int m = 0; m < meshStore.count; m++) {
+        free(solarOpaque[m]);
+    }
+    free(solarOpaque);
+    solarOpaque = NULL;
+    free(queue->partial);
+    free(run->samples);
+}
+
+// Run the study for the current scene and wait for it
+void runSolarStudy() {
+    SolarRun run;
+    prepareSolarStudy(&run);
+    traceSolarStudy(&run);
+    finishSolarStudy(&run);
+}
+
+void* solarStudyThread(void* arg) {
+    SolarRun* run = arg;
+    traceSolarStudy(run);
+    atomic_store(&run->done, true);
+    return NULL;
+}
+
+// Wait for the background study, cancelling it first unless its hours are
+// wanted. Anything that changes the meshes or the pick index calls this first.
+void stopSolarStudy(bool cancel) {
+    if (!solarRun.running) return;
+    if (cancel) atomic_store(&solarRun.queue.cancel, true);
+    pthread_join(solarRun.thread, NULL);
+    solarRun.running = false;
+    finishSolarStudy(&solarRun);
+}
+
+// Take the background study's hours once it is done
+void pollSolarStudy() {
+    if (solarRun.running && atomic_load(&solarRun.done)) {
+        stopSolarStudy(false);
+    }
+}
+
+// Keeps the viewer redrawing until the background study is done
+void solarStudyTimer(int value) {
+    (void)value;
+    if (!solarRun.running) return;
+    if (atomic_load(&solarRun.done)) {
+        glutPostRedisplay();
+    } else {
+        glutTimerFunc(SOLAR_POLL_MS, solarStudyTimer, 0);
+    }
+}
+
+// Start the study for the current scene in the background, unless one is running
+void startSolarStudy() {
+    if (solarRun.running) return;
+    prepareSolarStudy(&solarRun);
+    atomic_init(&solarRun.done, false);
+    if (pthread_create(&solarRun.thread, NULL, solarStudyThread, &solarRun) != 0) {
+        fprintf(stderr, "Solar: cannot start a study thread, running it in the foreground\n");
+        traceSolarStudy(&solarRun);
+        finishSolarStudy(&solarRun);
+        return;
+    }
+    solarRun.running = true;
+    printf("Solar: running the study in the background\n");
+    if (viewerRunning) {
+        glutTimerFunc(SOLAR_POLL_MS, solarStudyTimer, 0);
+    }
+}
+
+bool writeSolarCSV(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Solar: cannot write %s\n", path);
+        return false;
+    }
+    static const char* walls[NUM_WALLS] = {"front", "back", "left", "right"};
+    fprintf(out, "building,floor,wall,window,x,y,z,sun_hours,facing_hours\n");
+    for (int w = 0; w < solar.numWindows; w++) {
+        const SolarWindow* window = &solar.windows[w];
+        fprintf(out, "%d,%d,%s,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                window->building, window->floor + 1, walls[window->wall], window->index + 1,
+                window->position[0], window->position[1], window->position[2],
+                solar.sunHours[w], solar.facingHours[w]);
+    }
+    fclose(out);
+    printf("Solar: wrote %d windows to %s\n", solar.numWindows, path);
+    return true;
+}
+
+// Parse a day of the year given as MM-DD
+int parseDay(const char* text) {
+    static const int monthStart[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    int month = 1, day = 1;
+    sscanf(text, "%d-%d", &month, &day);
+    if (month < 1) month = 1;
+    if (month > 12) month = 12;
+    int result = monthStart[month - 1] + day - 1;
+    return result < 0 ? 0 : result > 364 ? 364 : result;
+}
+
+// Color every window by its hours of sun, from blue for none through yellow
+// to red for the most in the scene
+void drawSolarOverlay() {
+    if (!solarOverlay || solar.revision != scene.revision || !solar.numWindows) return;
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_POLYGON_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(-1.0f, -1.0f);
+    glBegin(GL_TRIANGLES);
+    for (int w = 0; w < solar.numWindows; w++) {
+        const SolarWindow* window = &solar.windows[w];
+        const SceneBuilding* building = &scene.buildings[window->building];
+        const Mesh* mesh = &meshStore.meshes[window->mesh].mesh;
+        float value = solar.maxHours > 0.0f ? solar.sunHours[w] / solar.maxHours : 0.0f;
+        if (value < 0.5f) {
+            glColor3f(2.0f * value, 2.0f * value, 1.0f - 2.0f * value);
+        } else {
+            glColor3f(1.0f, 2.0f - 2.0f * value, 0.0f);
+        }
+        float offset[3] = {building->x, window->floor * floorHeight, building->z};
+        for (int t = window->firstTriangle; t < window->firstTriangle + window->numTriangles; t++) {
+            for (int k = 0; k < 3; k++) {
+                const float* p = &mesh->verts[mesh->indices[t * 3 + k]].x;
+                glVertex3f(p[0] + offset[0], p[1] + offset[1], p[2] + offset[2]);
+            }
+        }
+    }
+    glEnd();
+    glPopAttrib();
+}
+
+// Massing analytics
+// Metrics of building configurations without generating or drawing them:
+// floor, facade and roof areas, stair flights, and the windows and
+// window-to-wall ratio of every wall. Configurations are held as arrays of
+// each parameter and evaluated four at a time, one per vector lane. Window
+// counts step along each wall with the same float arithmetic as
+// evaluateFacade(), so they match the generated floors exactly. Batches are
+// read or generated, split into chunks over a pool of threads that each
+// evaluate and format their chunk, and written in order.
+#define MASSING_BATCH 65536      // configurations read, evaluated and written at a time
+#define MASSING_CHUNK 4096       // configurations per work item, a multiple of 4
+#define MASSING_MAX_THREADS 64
+#define MASSING_LINE 256         // longest CSV line
+#define MASSING_MIN_SIZE 0.01f   // meters, for read dimensions; windows and spacings
+#define MASSING_MAX_SIZE 1000.0f // too small next to a wall would step along it forever
+#define MASSING_MAX_VALUE 1e8    // larger numbers are left out, so 18 numbers and a
+                                 // grammar name always fit in MASSING_LINE
+
+typedef struct {
+    int count;                   // padded to a multiple of 4 with copies of the last
+    float* width;
+    float* length;
+    int* numFloors;
+    int* grammar;
+    float* windowWidth;
+    float* windowHeight;
+    float* windowSpacing;
+} MassingConfigs;
+
+typedef struct {
+    float* grossFloorArea;
+    float* facadeArea;           // all four walls, openings included
+    float* roofArea;             // the four sloped faces
+    int* stairs;                 // flights, from every floor but the top
+    int* windows[NUM_WALLS];
+    float* windowToWall[NUM_WALLS];  // glazed over wall area
+} MassingMetrics;
+
+// Grid of configurations for -massing without -massing-in; every grammar is
+// tried at every point
+typedef struct {
+    float widthMin, widthMax, widthStep;
+    float lengthMin, lengthMax, lengthStep;
+    int floorsMin, floorsMax;
+    float spacingMin, spacingMax, spacingStep;
+} MassingSweep;
+
+MassingSweep massingSweep = {10, 60, 0.5f, 10, 60, 0.5f, 1, MAX_FLOORS, 2, 4, 0.5f};
+int massingThreads = -1;         // -1 for one per core
+
+void allocMassing(MassingConfigs* configs, MassingMetrics* metrics, int capacity) {
+    configs->count = 0;
+    configs->width = malloc(capacity * sizeof(float));
+    configs->length = malloc(capacity * sizeof(float));
+    configs->numFloors = malloc(capacity * sizeof(int));
+    configs->grammar = malloc(capacity * sizeof(int));
+    configs->windowWidth = malloc(capacity * sizeof(float));
+    configs->windowHeight = malloc(capacity * sizeof(float));
+    configs->windowSpacing = malloc(capacity * sizeof(float));
+    metrics->grossFloorArea = malloc(capacity * sizeof(float));
+    metrics->facadeArea = malloc(capacity * sizeof(float));
+    metrics->roofArea = malloc(capacity * sizeof(float));
+    metrics->stairs = malloc(capacity * sizeof(int));
+    for (int wall = 0; wall < NUM_WALLS; wall++) {
+        metrics->windows[wall] = malloc(capacity * sizeof(int));
+        metrics->windowToWall[wall] = malloc(capacity * sizeof(float));
+    }
+}
+
+void freeMassing(MassingConfigs* configs, MassingMetrics* metrics) {
+    free(configs->width);
+    free(configs->length);
+    free(configs->numFloors);
+    free(configs->grammar);
+    free(configs->windowWidth);
+    free(configs->windowHeight);
+    free(configs->windowSpacing);
+    free(metrics->grossFloorArea);
+    free(metrics->facadeArea);
+    free(metrics->roofArea);
+    free(metrics->stairs);
+    for (int wall = 0; wall < NUM_WALLS; wall++) {
+        free(metrics->windows[wall]);
+        free(metrics->windowToWall[wall]);
+    }
+}
+
+// Add a configuration, clamped to what buildings can be
+void addMassingConfig(MassingConfigs* configs, float width, float length, int floors, int grammar,
+                      float spacing, float windowW, float windowH) {
+    int i = configs->count++;
+    configs->width[i] = width;
+    configs->length[i] = length;
+    configs->numFloors[i] = floors < 1 ? 1 : floors > MAX_FLOORS ? MAX_FLOORS : floors;
+    configs->grammar[i] = grammar < 0 || grammar >= NUM_FACADE_GRAMMARS ? 0 : grammar;
+    configs->windowSpacing[i] = spacing;
+    configs->windowWidth[i] = windowW;
+    configs->windowHeight[i] = windowH;
+}
+
+// Repeat the last configuration up to a whole number of lanes
+void padMassingConfigs(MassingConfigs* configs) {
+    int last = configs->count - 1;
+    while (configs->count % 4) {
+        addMassingConfig(configs, configs->width[last], configs->length[last],
+                         configs->numFloors[last], configs->grammar[last],
+                         configs->windowSpacing[last], configs->windowWidth[last],
+                         configs->windowHeight[last]);
+    }
+}
+
+static inline v4sf v4select(v4si mask, v4sf value) {
+    return (v4sf)(mask & (v4si)value);
+}
+
+static inline v4sf v4splat(float value) {
+    return (v4sf){value, value, value, value};
+}
+
+static inline v4sf v4abs(v4sf value) {
+    return (v4sf)((v4si)value & 0x7fffffff);
+}
+
+// Glazed area of a bay, as built by buildBay(). Arches and circles are the
+// 10 degree fans of buildFan(); panes too small for their arch or mullions
+// come out flipped but still count.
+v4sf bayGlass(const FacadeBay* bay, v4sf windowW, v4sf windowH, v4sf bayWidth) {
+    float fan = 0.5f * sinf(10.0f * M_PI / 180.0f);
+    v4sf radius = windowW / 2;
+    switch (bay->terminal) {
+        case FACADE_STOREFRONT:
+            return bayWidth * (floorHeight - 0.8f);
+        case FACADE_WINDOW:
+        case FACADE_BALCONY:
+            switch (bay->currentStyle ? currentWindowStyle : bay->style) {
+                case WINDOW_ARCHED:
+                    return windowW * v4abs(windowH - radius) + 18 * fan * radius * radius;
+                case WINDOW_DIVIDED:
+                    return 6 * v4abs(windowW / 2 - 0.06f) * v4abs(windowH / 3 - 0.06f);
+                case WINDOW_CIRCULAR:
+                    return 36 * fan * radius * radius;
+                default:
+                    return windowW * windowH;
+            }
+        default:
+            return v4splat(0.0f);
+    }
+}
+
+// Windows and glazed area of a rule over four walls, stepping bay centers
+// with the same FACADE_BAY_LAYOUT() as evaluateFacade(). All lanes visit the same bays of the
+// pattern in the same order, so only the stopping point differs.
+void massingRule(const FacadeRule* rule, v4sf length, v4sf windowW, v4sf windowH, v4sf spacing,
+                 v4si* windows, v4sf* glass) {
+    *windows = (v4si){0, 0, 0, 0};
+    *glass = v4splat(0.0f);
+    if (!rule->numBays) return;
+    
+    v4sf x, xEnd, step, bayWidth;
+    FACADE_BAY_LAYOUT(rule, length, spacing, windowW, v4splat, x, xEnd, step, bayWidth);
+    v4sf area[4];
+    for (int i = 0; i < rule->numBays; i++) {
+        area[i] = bayGlass(&rule->pattern[i], windowW, windowH, bayWidth);
+    }
+    
+    // Lanes that could never leave the loop are given no windows
+    v4si active = FACADE_BAY_FITS(x, xEnd) & (step > 0.0f);
+    for (int bay = 0; v4any(active); bay++) {
+        if (rule->pattern[bay % rule->numBays].terminal != FACADE_BLANK) {
+            *windows -= active;
+            *glass += v4select(active, area[bay % rule->numBays]);
+        }
+        x += step;
+        active &= FACADE_BAY_FITS(x, xEnd);
+    }
+}
+
+// Evaluate configurations [first, first + count), count a multiple of 4
+void evaluateMassing(const MassingConfigs* configs, MassingMetrics* metrics, int first, int count) {
+    for (int i = first; i < first + count; i += 4) {
+        v4sf width, length, windowW, windowH, spacing;
+        v4si floors, grammar;
+        memcpy(&width, &configs->width[i], sizeof(v4sf));
+        memcpy(&length, &configs->length[i], sizeof(v4sf));
+        memcpy(&windowW, &configs->windowWidth[i], sizeof(v4sf));
+        memcpy(&windowH, &configs->windowHeight[i], sizeof(v4sf));
+        memcpy(&spacing, &configs->windowSpacing[i], sizeof(v4sf));
+        memcpy(&floors, &configs->numFloors[i], sizeof(v4si));
+        memcpy(&grammar, &configs->grammar[i], sizeof(v4si));
+        
+        // Every rule along both wall lengths: front and back walls span the
+        // width, left and right walls the length
+        v4si ruleWindows[NUM_FACADE_RULES][2];
+        v4sf ruleGlass[NUM_FACADE_RULES][2];
+        for (int rule = 0; rule < NUM_FACADE_RULES; rule++) {
+            massingRule(&facadeRules[rule], width, windowW, windowH, spacing,
+                        &ruleWindows[rule][0], &ruleGlass[rule][0]);
+            massingRule(&facadeRules[rule], length, windowW, windowH, spacing,
+                        &ruleWindows[rule][1], &ruleGlass[rule][1]);
+        }
+        
+        // Sum over the ground, accent and ordinary floors of each lane's grammar
+        v4si windows[NUM_WALLS] = {{0}};
+        v4sf glass[NUM_WALLS] = {{0}};
+        for (int g = 0; g < NUM_FACADE_GRAMMARS; g++) {
+            v4si mask = grammar == g;
+            if (!v4any(mask)) continue;
+            const FacadeGrammar* facade = &facadeGrammars[g];
+            v4si accent = facade->accentEvery ? (floors - 1) / facade->accentEvery : floors * 0;
+            v4si upper = floors - 1 - accent;
+            v4sf accentF = __builtin_convertvector(accent, v4sf);
+            v4sf upperF = __builtin_convertvector(upper, v4sf);
+            for (int wall = 0; wall < NUM_WALLS; wall++) {
+                int side = wall == WALL_FRONT || wall == WALL_BACK ? 0 : 1;
+                int ground = facade->ground[wall], up = facade->upper[wall], acc = facade->accent[wall];
+                windows[wall] += mask & (ruleWindows[ground][side] + accent * ruleWindows[acc][side] +
+                                         upper * ruleWindows[up][side]);
+                glass[wall] += v4select(mask, ruleGlass[ground][side] + accentF * ruleGlass[acc][side] +
+                                              upperF * ruleGlass[up][side]);
+            }
+        }
+        
+        v4sf floorsF = __builtin_convertvector(floors, v4sf);
+        v4sf grossFloorArea = width * length * floorsF;
+        v4sf wallArea[2] = {width * floorHeight * floorsF, length * floorHeight * floorsF};
+        v4sf facadeArea = 2 * (wallArea[0] + wallArea[1]);
+        v4si stairs = floors - 1;
+        memcpy(&metrics->grossFloorArea[i], &grossFloorArea, sizeof(v4sf));
+        memcpy(&metrics->facadeArea[i], &facadeArea, sizeof(v4sf));
+        memcpy(&metrics->stairs[i], &stairs, sizeof(v4si));
+        for (int wall = 0; wall < NUM_WALLS; wall++) {
+            v4sf ratio = glass[wall] / wallArea[wall == WALL_FRONT || wall == WALL_BACK ? 0 : 1];
+            memcpy(&metrics->windows[wall][i], &windows[wall], sizeof(v4si));
+            memcpy(&metrics->windowToWall[wall][i], &ratio, sizeof(v4sf));
+        }
+        
+        // Front and back faces of the roof rise over half the length, left
+        // and right over half the width
+        for (int lane = 0; lane < 4; lane++) {
+            float w = width[lane], l = length[lane];
+            metrics->roofArea[i + lane] = w * sqrtf(roofHeight * roofHeight + l * l / 4) +
+                                          l * sqrtf(roofHeight * roofHeight + w * w / 4);
+        }
+    }
+}
+
+// Append a number with a fixed count of decimals, without the cost of
+// printf for the millions a sweep writes. NaNs, infinities and magnitudes
+// from MASSING_MAX_VALUE on append nothing, leaving the field empty.
+char* appendFixed(char* out, double value, int decimals) {
+    static const long long scales[] = {1, 10, 100, 1000, 10000};
+    if (!(fabs(value) < MASSING_MAX_VALUE)) return out;
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+    long long scaled = llround(value * scales[decimals]);
+    long long whole = scaled / scales[decimals];
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + whole % 10;
+        whole /= 10;
+    } while (whole);
+    while (n) *out++ = digits[--n];
+    if (decimals) {
+        *out++ = '.';
+        long long fraction = scaled % scales[decimals];
+        for (int d = decimals - 1; d >= 0; d--) {
+            out[d] = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        out += decimals;
+    }
+    return out;
+}
+
+int formatMassing(char* out, const MassingConfigs* configs, const MassingMetrics* metrics, int i) {
+    char* p = out;
+    const char* name = facadeGrammars[configs->grammar[i]].name;
+    float values[] = {configs->width[i], configs->length[i]};
+    for (int k = 0; k < 2; k++) {
+        p = appendFixed(p, values[k], 2);
+        *p++ = ',';
+    }
+    p = appendFixed(p, configs->numFloors[i], 0);
+    *p++ = ',';
+    while (*name) *p++ = *name++;
+    float rest[] = {configs->windowSpacing[i], configs->windowWidth[i], configs->windowHeight[i],
+                    metrics->grossFloorArea[i], metrics->facadeArea[i], metrics->roofArea[i]};
+    for (int k = 0; k < 6; k++) {
+        *p++ = ',';
+        p = appendFixed(p, rest[k], 2);
+    }
+    *p++ = ',';
+    p = appendFixed(p, metrics->stairs[i], 0);
+    for (int wall = 0; wall < NUM_WALLS; wall++) {
+        *p++ = ',';
+        p = appendFixed(p, metrics->windows[wall][i], 0);
+    }
+    for (int wall = 0; wall < NUM_WALLS; wall++) {
+        *p++ = ',';
+        p = appendFixed(p, metrics->windowToWall[wall][i], 4);
+    }
+    *p++ = '\n';
+    return p - out;
+}
+
+typedef struct {
+    const MassingConfigs* configs;
+    MassingMetrics* metrics;
+    char* text;                  // MASSING_CHUNK lines per chunk, or NULL to skip formatting
+    int* textLength;             // per chunk
+    int formatted;               // configurations to format, leaving out the padding
+    int numChunks;
+    atomic_int nextChunk;
+} MassingQueue;
+
+void* massingWorker(void* arg) {
+    MassingQueue* queue = arg;
+    for (;;) {
+        int chunk = atomic_fetch_add(&queue->nextChunk, 1);
+        if (chunk >= queue->numChunks) break;
+        int first = chunk * MASSING_CHUNK;
+        int count = queue->configs->count - first;
+        if (count > MASSING_CHUNK) count = MASSING_CHUNK;
+        evaluateMassing(queue->configs, queue->metrics, first, count);
+        if (!queue->text) continue;
+        
+        char* text = queue->text + (size_t)chunk * MASSING_CHUNK * MASSING_LINE;
+        int length = 0;
+        for (int i = first; i < first + count && i < queue->formatted; i++) {
+            length += formatMassing(text + length, queue->configs, queue->metrics, i);
+        }
+        queue->textLength[chunk] = length;
+    }
+    return NULL;
+}
+
+int massingThreadCount() {
+    int threads = massingThreads;
+    if (threads < 0) {
+        threads = coreCount();
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MASSING_MAX_THREADS) threads = MASSING_MAX_THREADS;
+    return threads;
+}
+
+// Evaluate a padded batch over threads, and format its first formatted
+// configurations when text is given
+void runMassingBatch(const MassingConfigs* configs, MassingMetrics* metrics,
+                     char* text, int* textLength, int formatted, int threads) {
+    MassingQueue queue = {configs, metrics, text, textLength, formatted,
+                          (configs->count + MASSING_CHUNK - 1) / MASSING_CHUNK};
+    atomic_init(&queue.nextChunk, 0);
+    pthread_t workers[MASSING_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads && i < queue.numChunks; i++) {
+        if (pthread_create(&workers[started], NULL, massingWorker, &queue) == 0) started++;
+    }
+    massingWorker(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+int sweepAxis(float min, float max, float step) {
+    return step > 0 && max >= min ? (int)floorf((max - min) / step + 1e-3f) + 1 : 1;
+}
+
+long massingSweepCount(const MassingSweep* sweep) {
+    return (long)sweepAxis(sweep->widthMin, sweep->widthMax, sweep->widthStep) *
+           sweepAxis(sweep->lengthMin, sweep->lengthMax, sweep->lengthStep) *
+           (sweep->floorsMax - sweep->floorsMin + 1) * NUM_FACADE_GRAMMARS *
+           sweepAxis(sweep->spacingMin, sweep->spacingMax, sweep->spacingStep);
+}
+
+// Fill a batch with sweep points from index next on, width varying fastest
+void sweepMassingConfigs(const MassingSweep* sweep, long next, long total, MassingConfigs* configs) {
+    int widths = sweepAxis(sweep->widthMin, sweep->widthMax, sweep->widthStep);
+    int lengths = sweepAxis(sweep->lengthMin, sweep->lengthMax, sweep->lengthStep);
+    int floors = sweep->floorsMax - sweep->floorsMin + 1;
+    configs->count = 0;
+    for (long index = next; index < total && configs->count < MASSING_BATCH; index++) {
+        long rest = index;
+        int w = rest % widths; rest /= widths;
+        int l = rest % lengths; rest /= lengths;
+        int f = rest % floors; rest /= floors;
+        int g = rest % NUM_FACADE_GRAMMARS; rest /= NUM_FACADE_GRAMMARS;
+        addMassingConfig(configs, sweep->widthMin + w * sweep->widthStep,
+                         sweep->lengthMin + l * sweep->lengthStep, sweep->floorsMin + f, g,
+                         sweep->spacingMin + rest * sweep->spacingStep, windowWidth, windowHeight);
+    }
+}
+
+bool massingSizeValid(float size) {
+    return size >= MASSING_MIN_SIZE && size <= MASSING_MAX_SIZE;  // false for NaN
+}
+
+// Fill a batch from CSV lines of width,length,floors,grammar and optionally
+// window spacing, width and height. Grammars are given by name or number.
+// Lines with an unknown grammar, a floor count or a dimension out of range
+// are reported and skipped.
+void readMassingConfigs(FILE* in, MassingConfigs* configs) {
+    char line[512];
+    configs->count = 0;
+    while (configs->count < MASSING_BATCH && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        float width, length, spacing = windowSpacing, windowW = windowWidth, windowH = windowHeight;
+        int floors;
+        char grammarName[64];
+        if (sscanf(line, "%f,%f,%d,%63[^,],%f,%f,%f", &width, &length, &floors, grammarName,
+                   &spacing, &windowW, &windowH) < 4) {
+            continue;  // header or malformed line
+        }
+        char* end;
+        long number = strtol(grammarName, &end, 10);
+        int grammar = end != grammarName && *end == '\0' && number >= 0 && number < NUM_FACADE_GRAMMARS ?
+                      (int)number : -1;
+        for (int g = 0; g < NUM_FACADE_GRAMMARS; g++) {
+            if (strcmp(grammarName, facadeGrammars[g].name) == 0) grammar = g;
+        }
+        if (grammar < 0) {
+            fprintf(stderr, "Massing: unknown grammar \"%s\", skipping: %s\n", grammarName, line);
+            continue;
+        }
+        if (floors < 1 || floors > MAX_FLOORS) {
+            fprintf(stderr, "Massing: floors must be 1 to %d, skipping: %s\n", MAX_FLOORS, line);
+            continue;
+        }
+        if (!massingSizeValid(width) || !massingSizeValid(length) || !massingSizeValid(spacing) ||
+            !massingSizeValid(windowW) || !massingSizeValid(windowH)) {
+            fprintf(stderr, "Massing: dimensions must be %g to %g m, skipping: %s\n",
+                    MASSING_MIN_SIZE, MASSING_MAX_SIZE, line);
+            continue;
+        }
+        addMassingConfig(configs, width, length, floors, grammar, spacing, windowW, windowH);
+    }
+}
+
+// Stream metrics for -massing-in configurations, or the sweep, to a CSV file
+int runMassing(const char* path, const char* inputPath) {
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    FILE* in = NULL;
+    if (!out) {
+        fprintf(stderr, "Massing: cannot write %s\n", path);
+        return 1;
+    }
+    if (inputPath) {
+        in = strcmp(inputPath, "-") == 0 ? stdin : fopen(inputPath, "r");
+        if (!in) {
+            fprintf(stderr, "Massing: cannot read %s\n", inputPath);
+            return 1;
+        }
+    }
+    // Reports go to stderr while the results stream to stdout
+    FILE* report = out == stdout ? stderr : stdout;
+    
+    int threads = massingThreadCount();
+    MassingConfigs configs;
+    MassingMetrics metrics;
+    allocMassing(&configs, &metrics, MASSING_BATCH + 4);
+    int numChunks = (MASSING_BATCH + MASSING_CHUNK - 1) / MASSING_CHUNK;
+    char* text = malloc((size_t)numChunks * MASSING_CHUNK * MASSING_LINE);
+    int* textLength = malloc(numChunks * sizeof(int));
+    
+    fprintf(out, "width,length,floors,grammar,window_spacing,window_width,window_height,"
+                 "gross_floor_area,facade_area,roof_area,stairs,"
+                 "windows_front,windows_back,windows_left,windows_right,"
+                 "wwr_front,wwr_back,wwr_left,wwr_right\n");
+    long total = in ? LONG_MAX : massingSweepCount(&massingSweep);
+    long done = 0;
+    double bytes = 0.0, writeSeconds = 0.0;
+    double t0 = nowSeconds();
+    while (done < total) {
+        if (in) {
+            readMassingConfigs(in, &configs);
+        } else {
+            sweepMassingConfigs(&massingSweep, done, total, &configs);
+        }
+        int count = configs.count;
+        if (!count) break;
+        padMassingConfigs(&configs);
+        runMassingBatch(&configs, &metrics, text, textLength, count, threads);
+        
+        double t1 = nowSeconds();
+        for (int chunk = 0; chunk * MASSING_CHUNK < count; chunk++) {
+            fwrite(text + (size_t)chunk * MASSING_CHUNK * MASSING_LINE, 1, textLength[chunk], out);
+            bytes += textLength[chunk];
+        }
+        writeSeconds += nowSeconds() - t1;
+        done += count;
+    }
+    double seconds = nowSeconds() - t0;
+    
+    if (out != stdout) fclose(out);
+    if (in && in != stdin) fclose(in);
+    fprintf(report, "Massing: %ld configurations in %.2f s on %d threads (%.2f M/s), "
+                    "%.1f MB written in %.2f s\n",
+            done, seconds, threads, done / 1e6 / seconds, bytes / 1e6, writeSeconds);
+    free(text);
+    free(textLength);
+    freeMassing(&configs, &metrics);
+    return 0;
+}
+
+// Count the windows and glazed area of every wall of a configuration from
+// its generated floors, the way it would be drawn
+void measureMassingFloors(const MassingConfigs* configs, int i, int windows[NUM_WALLS],
+                          float glass[NUM_WALLS]) {
+    float savedWidth = windowWidth, savedHeight = windowHeight, savedSpacing = windowSpacing;
+    bool savedWindows = showWindows;
+    windowWidth = configs->windowWidth[i];
+    windowHeight = configs->windowHeight[i];
+    windowSpacing = configs->windowSpacing[i];
+    showWindows = true;
+    
+    BuildingParams params = {configs->width[i], configs->length[i], configs->numFloors[i],
+                             configs->grammar[i]};
+    const FacadeGrammar* grammar = &facadeGrammars[params.grammar];
+    memset(windows, 0, NUM_WALLS * sizeof(int));
+    memset(glass, 0, NUM_WALLS * sizeof(float));
+    for (int floor = 0; floor < params.numFloors; floor++) {
+        SharedMeshKey key;
+        initSharedKey(&key, SHARED_FLOOR, &params);
+        for (int wall = 0; wall < NUM_WALLS; wall++) {
+            key.rules[wall] = facadeRuleFor(grammar, floor, wall);
+        }
+        key.stairwell = floor < params.numFloors - 1;
+        key.opening = floor > 0;
+        Mesh mesh = {0};
+        buildSharedMesh(&mesh, &key);
+        
+        const MeshTag* previous = NULL;
+        for (int t = 0; t < mesh.numIndices / 3; t++) {
+            const MeshTag* tag = &mesh.tags[t];
+            if (tag->kind != ELEMENT_WINDOW) {
+                previous = NULL;
+                continue;
+            }
+            if (!previous || previous->wall != tag->wall || previous->index != tag->index) {
+                windows[tag->wall]++;
+            }
+            previous = tag;
+            const float* a = &mesh.verts[mesh.indices[t * 3]].x;
+            const float* b = &mesh.verts[mesh.indices[t * 3 + 1]].x;
+            const float* c = &mesh.verts[mesh.indices[t * 3 + 2]].x;
+            float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+            float cx = e1[1] * e2[2] - e1[2] * e2[1];
+            float cy = e1[2] * e2[0] - e1[0] * e2[2];
+            float cz = e1[0] * e2[1] - e1[1] * e2[0];
+            glass[tag->wall] += 0.5f * sqrtf(cx * cx + cy * cy + cz * cz);
+        }
+        meshFree(&mesh);
+    }
+    
+    windowWidth = savedWidth;
+    windowHeight = savedHeight;
+    windowSpacing = savedSpacing;
+    showWindows = savedWindows;
+}
+
+// Time the kernel on random configurations, then check a sample of them
+// against their generated floors
+int benchmarkMassing(int count) {
+    MassingConfigs configs;
+    MassingMetrics metrics;
+    allocMassing(&configs, &metrics, count + 4);
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        addMassingConfig(&configs, 8.0f + 52.0f * rand() / RAND_MAX, 8.0f + 52.0f * rand() / RAND_MAX,
+                         1 + rand() % MAX_FLOORS, rand() % NUM_FACADE_GRAMMARS,
+                         1.5f + 3.5f * rand() / RAND_MAX, 0.6f + 1.4f * rand() / RAND_MAX,
+                         1.0f + 1.2f * rand() / RAND_MAX);
+    }
+    padMassingConfigs(&configs);
+    
+    int maxThreads = massingThreadCount();
+    double oneThread = 0.0;
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > maxThreads) threads = maxThreads;
+        double t0 = nowSeconds();
+        runMassingBatch(&configs, &metrics, NULL, NULL, 0, threads);
+        double seconds = nowSeconds() - t0;
+        if (threads == 1) oneThread = seconds;
+        printf("Massing: %d configurations on %d threads in %.1f ms (%.1f M/s, %.2fx)\n",
+               count, threads, seconds * 1000.0, count / 1e6 / seconds, oneThread / seconds);
+        if (threads == maxThreads) break;
+    }
+    
+    int checks = count < 1000 ? count : 1000;
+    int mismatches = 0;
+    double worstRatio = 0.0;
+    for (int i = 0; i < checks; i++) {
+        int windows[NUM_WALLS];
+        float glass[NUM_WALLS];
+        measureMassingFloors(&configs, i, windows, glass);
+        bool match = true;
+        for (int wall = 0; wall < NUM_WALLS; wall++) {
+            float wallLength = wall == WALL_FRONT || wall == WALL_BACK ? configs.width[i] : configs.length[i];
+            float ratio = glass[wall] / (wallLength * floorHeight * configs.numFloors[i]);
+            double error = fabs(ratio - metrics.windowToWall[wall][i]);
+            if (error > worstRatio) worstRatio = error;
+            if (windows[wall] != metrics.windows[wall][i] || error > 1e-4) match = false;
+        }
+        if (!match) {
+            if (mismatches < 5) {
+                printf("Massing: mismatch for %.3f x %.3f, %d floors, %s, spacing %.3f\n",
+                       configs.width[i], configs.length[i], configs.numFloors[i],
+                       facadeGrammars[configs.grammar[i]].name, configs.windowSpacing[i]);
+            }
+            mismatches++;
+        }
+    }
+    printf("Massing: %d configurations checked against generated floors, %d mismatches "
+           "(window-to-wall ratio within %.1e)\n", checks, mismatches, worstRatio);
+    freeMassing(&configs, &metrics);
+    return mismatches ? 1 : 0;
+}
+
+// Frame capture
+// Frames are read back asynchronously through a ring of pixel buffer objects:
+// glReadPixels into a PBO returns immediately, and the PBO is only mapped a
+// couple of frames later once its fence has signalled. Mapped frames are
+// handed to a writer thread that flips, converts and encodes them, so the
+// GLUT thread never waits on the disk or the pipe.
+#define CAPTURE_RING_SIZE 3
+#define CAPTURE_MAX_QUEUED 8
+
+typedef enum {
+    CAPTURE_RAW,  // rgb24 frames back to back (ffmpeg -f rawvideo -pix_fmt rgb24)
+    CAPTURE_PNG   // concatenated PNG images (ffmpeg -f image2pipe -c:v png)
+} CaptureFormat;
+
+typedef struct CaptureFrame {
+    unsigned char* pixels;  // RGBA as read back, bottom row first
+    size_t capacity;
+    int width;
+    int height;
+    struct CaptureFrame* next;
+} CaptureFrame;
+
+typedef struct {
+    bool active;
+    CaptureFormat format;
+    const char* path;       // "-" streams to stdout
+    FILE* out;
+    int width;
+    int height;
+    
+    // Readback ring
+    GLuint pbo[CAPTURE_RING_SIZE];
+    #ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    GLsync fence[CAPTURE_RING_SIZE];
+    #endif
+    int head;               // slot the next frame is read into
+    int pending;            // slots with a readback in flight
+    
+    // Writer thread and its queue
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;  // a frame was queued, or the writer should stop
+    pthread_cond_t freed;   // a frame went back to the free list
+    CaptureFrame* queueHead;
+    CaptureFrame* queueTail;
+    CaptureFrame* freeList;
+    int numAllocated;
+    bool stopping;
+    
+    // Statistics
+    long framesRead;
+    long framesWritten;
+    long writerStalls;      // frames that had to wait for a free buffer
+    double captureSeconds;  // time spent in captureFrame() on the GLUT thread
+    double encodeSeconds;   // time spent encoding and writing on the writer thread
+} Capture;
+
+Capture capture = {
+    .format = CAPTURE_RAW,
+    .path = "capture.rgb",
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .freed = PTHREAD_COND_INITIALIZER
+};
+
+// Render timing, so capture overhead can be compared with plain rendering.
+// CPU time is what display() takes to submit a frame. GPU time comes from
+// timer queries, read back a few frames later once they are done, so
+// timing never makes the CPU wait on the GPU.
+#define TIMER_QUERIES 4         // frames a GPU time query may stay in flight
+
+typedef struct {
+    double seconds;             // CPU
+    long frames;
+    double gpuSeconds;
+    long gpuFrames;             // frames whose query has been read
+} FrameTimer;
+
+FrameTimer renderTimer;         // display() without capture
+FrameTimer renderCaptureTimer;  // display() with capture, readback included
+
+typedef struct {
+    GLuint queries[TIMER_QUERIES];
+    FrameTimer* timers[TIMER_QUERIES];  // timer each query in flight counts for
+    int head;                   // slot the next frame is timed in
+    int pending;
+} GpuTimer;
+
+GpuTimer gpuTimer;
+
+// Add the queries that are done to their timers, oldest first
+void collectGpuTimes() {
+#ifdef GL_TIME_ELAPSED
+    while (gpuTimer.pending) {
+        int slot = (gpuTimer.head - gpuTimer.pending + TIMER_QUERIES) % TIMER_QUERIES;
+        GLint available = 0;
+        glGetQueryObjectiv(gpuTimer.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) break;
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(gpuTimer.queries[slot], GL_QUERY_RESULT, &nanoseconds);
+        gpuTimer.timers[slot]->gpuSeconds += nanoseconds * 1e-9;
+        gpuTimer.timers[slot]->gpuFrames++;
+        gpuTimer.pending--;
+    }
+#endif
+}
+
+// Start timing a frame's GPU work for a timer. Frames are left untimed while
+// every query is still in flight. Returns whether gpuTimerEnd() should follow.
+bool gpuTimerBegin(FrameTimer* timer) {
+#ifdef GL_TIME_ELAPSED
+    if (!gpuTimer.queries[0]) glGenQueries(TIMER_QUERIES, gpuTimer.queries);
+    collectGpuTimes();
+    if (gpuTimer.pending == TIMER_QUERIES) return false;
+    gpuTimer.timers[gpuTimer.head] = timer;
+    glBeginQuery(GL_TIME_ELAPSED, gpuTimer.queries[gpuTimer.head]);
+    return true;
+#else
+    (void)timer;
+    return false;
+#endif
+}
+
+void gpuTimerEnd() {
+#ifdef GL_TIME_ELAPSED
+    glEndQuery(GL_TIME_ELAPSED);
+    gpuTimer.head = (gpuTimer.head + 1) % TIMER_QUERIES;
+    gpuTimer.pending++;
+#endif
+}
+
+// Append one PNG chunk (length, type, data, CRC) at dst, returning the end
+unsigned char* pngChunk(unsigned char* dst, const char* type, const unsigned char* data,
+                        unsigned int length) {
+    unsigned char* start = dst + 4;
+    dst[0] = length >> 24; dst[1] = length >> 16; dst[2] = length >> 8; dst[3] = length;
+    memcpy(dst + 4, type, 4);
+    if (length && data != dst + 8) memcpy(dst + 8, data, length);
+    uLong crc = crc32(0, start, length + 4);
+    dst += 8 + length;
+    dst[0] = crc >> 24; dst[1] = crc >> 16; dst[2] = crc >> 8; dst[3] = crc;
+    return dst + 4;
+}
+
+// Encode tightly packed, top-down RGB rows as a PNG image.
+// Returns a malloc'd buffer and its size, or NULL on failure.
+unsigned char* encodePNG(const unsigned char* rgb, int width, int height, size_t* size) {
+    size_t rowBytes = (size_t)width * 3;
+    size_t rawSize = (rowBytes + 1) * height;
+    uLongf packedSize = compressBound(rawSize);
+    unsigned char* raw = malloc(rawSize);
+    unsigned char* image = malloc(8 + 25 + 12 + packedSize + 12);
+    
+    // Filter type 0 (none) on every row keeps the encoder cheap
+    for (int row = 0; row < height; row++) {
+        raw[row * (rowBytes + 1)] = 0;
+        memcpy(raw + row * (rowBytes + 1) + 1, rgb + row * rowBytes, rowBytes);
+    }
+    
+    // Compress straight into the IDAT chunk's data area
+    unsigned char* idat = image + 8 + 25;
+    if (compress2(idat + 8, &packedSize, raw, rawSize, Z_BEST_SPEED) != Z_OK) {
+        free(raw);
+        free(image);
+        return NULL;
+    }
+    free(raw);
+    
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    unsigned char ihdr[13] = {
+        width >> 24, width >> 16, width >> 8, width,
+        height >> 24, height >> 16, height >> 8, height,
+        8, 2, 0, 0, 0  // 8-bit, truecolor, deflate, no filter, no interlace
+    };
+    memcpy(image, signature, 8);
+    pngChunk(image + 8, "IHDR", ihdr, 13);
+    unsigned char* end = pngChunk(idat, "IDAT", idat + 8, packedSize);
+    end = pngChunk(end, "IEND", NULL, 0);
+    *size = end - image;
+    return image;
+}
+
+// Flip a bottom-up RGBA readback into top-down RGB rows
+void rgbaToRGB(const unsigned char* rgba, unsigned char* rgb, int width, int height) {
+    for (int row = 0; row < height; row++) {
+        const unsigned char* src = rgba + (size_t)(height - 1 - row) * width * 4;
+        unsigned char* dst = rgb + (size_t)row * width * 3;
+        for (int x = 0; x < width; x++) {
+            dst[x * 3 + 0] = src[x * 4 + 0];
+            dst[x * 3 + 1] = src[x * 4 + 1];
+            dst[x * 3 + 2] = src[x * 4 + 2];
+        }
+    }
+}
+
+void* captureWriterThread(void* arg) {
+    unsigned char* rgb = NULL;
+    size_t rgbSize = 0;
+    
+    while (true) {
+        pthread_mutex_lock(&capture.lock);
+        while (!capture.queueHead && !capture.stopping) {
+            pthread_cond_wait(&capture.queued, &capture.lock);
+        }
+        CaptureFrame* frame = capture.queueHead;
+        if (frame) {
+            capture.queueHead = frame->next;
+            if (!capture.queueHead) capture.queueTail = NULL;
+        }
+        pthread_mutex_unlock(&capture.lock);
+        if (!frame) break;  // stopping and drained
+        
+        double t0 = nowSeconds();
+        size_t needed = (size_t)frame->width * frame->height * 3;
+        if (needed > rgbSize) {
+            rgb = realloc(rgb, needed);
+            rgbSize = needed;
+        }
+        rgbaToRGB(frame->pixels, rgb, frame->width, frame->height);
+        
+        if (capture.format == CAPTURE_PNG) {
+            size_t size = 0;
+            unsigned char* png = encodePNG(rgb, frame->width, frame->height, &size);
+            if (png) fwrite(png, 1, size, capture.out);
+            free(png);
+        } else {
+            fwrite(rgb, 1, needed, capture.out);
+        }
+        fflush(capture.out);
+        
+        pthread_mutex_lock(&capture.lock);
+        capture.encodeSeconds += nowSeconds() - t0;
+        capture.framesWritten++;
+        frame->next = capture.freeList;
+        capture.freeList = frame;
+        pthread_cond_signal(&capture.freed);
+        pthread_mutex_unlock(&capture.lock);
+    }
+    free(rgb);
+    return NULL;
+}
+
+// Take a frame buffer from the pool, waiting for the writer if it is behind
+CaptureFrame* captureAcquireFrame() {
+    CaptureFrame* frame;
+    pthread_mutex_lock(&capture.lock);
+    if (!capture.freeList && capture.numAllocated < CAPTURE_MAX_QUEUED) {
+        frame = calloc(1, sizeof(CaptureFrame));
+        capture.numAllocated++;
+    } else {
+        if (!capture.freeList) capture.writerStalls++;
+        while (!capture.freeList) {
+            pthread_cond_wait(&capture.freed, &capture.lock);
+        }
+        frame = capture.freeList;
+        capture.freeList = frame->next;
+    }
+    pthread_mutex_unlock(&capture.lock);
+    
+    size_t needed = (size_t)capture.width * capture.height * 4;
+    if (frame->capacity < needed) {
+        frame->pixels = realloc(frame->pixels, needed);
+        frame->capacity = needed;
+    }
+    frame->width = capture.width;
+    frame->height = capture.height;
+    frame->next = NULL;
+    return frame;
+}
+
+// Map a completed PBO and pass its contents on to the writer thread
+void captureRetire(int slot, bool wait) {
+    #ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    if (capture.fence[slot]) {
+        GLenum status = glClientWaitSync(capture.fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         wait ? 1000000000ull : 0);
+        if (status == GL_TIMEOUT_EXPIRED && !wait) return;
+        glDeleteSync(capture.fence[slot]);
+        capture.fence[slot] = 0;
+    }
+    #else
+    // Without fences, the ring depth alone gives the GPU time to finish
+    if (!wait) return;
+    #endif
+    
+    CaptureFrame* frame = captureAcquireFrame();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[slot]);
+    const void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (pixels) {
+        memcpy(frame->pixels, pixels, (size_t)frame->width * frame->height * 4);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture.pending--;
+    
+    pthread_mutex_lock(&capture.lock);
+    if (capture.queueTail) {
+        capture.queueTail->next = frame;
+    } else {
+        capture.queueHead = frame;
+    }
+    capture.queueTail = frame;
+    pthread_cond_signal(&capture.queued);
+    pthread_mutex_unlock(&capture.lock);
+}
+
+// Retire every readback still in flight, oldest first
+void captureDrain() {
+    while (capture.pending > 0) {
+        captureRetire((capture.head - capture.pending + CAPTURE_RING_SIZE) % CAPTURE_RING_SIZE, true);
+    }
+}
+
+void captureResize(int width, int height) {
+    captureDrain();
+    if (capture.width && capture.format == CAPTURE_RAW) {
+        fprintf(stderr, "Capture: window resized to %dx%d, raw stream dimensions change\n",
+                width, height);
+    }
+    capture.width = width;
+    capture.height = height;
+    if (!capture.pbo[0]) {
+        glGenBuffers(CAPTURE_RING_SIZE, capture.pbo);
+    }
+    for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void printCaptureReport() {
+    collectGpuTimes();
+    double plain = renderTimer.frames ? renderTimer.seconds / renderTimer.frames : 0;
+    double captured = renderCaptureTimer.frames ?
+                      renderCaptureTimer.seconds / renderCaptureTimer.frames : 0;
+    double plainGpu = renderTimer.gpuFrames ? renderTimer.gpuSeconds / renderTimer.gpuFrames : 0;
+    double capturedGpu = renderCaptureTimer.gpuFrames ?
+                         renderCaptureTimer.gpuSeconds / renderCaptureTimer.gpuFrames : 0;
+    fprintf(stderr, "Capture: %ld frames read, %ld written, %ld writer stalls\n",
+            capture.framesRead, capture.framesWritten, capture.writerStalls);
+    fprintf(stderr, "Capture: render %.3f ms/frame CPU, %.3f ms/frame GPU without capture; "
+            "%.3f ms/frame CPU, %.3f ms/frame GPU with capture\n",
+            plain * 1000.0, plainGpu * 1000.0, captured * 1000.0, capturedGpu * 1000.0);
+    if (capture.framesRead) {
+        fprintf(stderr, "Capture: readback %.3f ms/frame of CPU time on the render thread, encode %.3f ms/frame on the writer\n",
+                capture.captureSeconds * 1000.0 / capture.framesRead,
+                capture.framesWritten ? capture.encodeSeconds * 1000.0 / capture.framesWritten : 0.0);
+    }
+}
+
+// Open the capture destination. Streaming to stdout keeps the real stdout for
+// frames and sends console output to stderr from then on.
+bool captureOpenOutput() {
+    static int frameFd = -1;
+    
+    if (capture.out) return true;
+    if (strcmp(capture.path, "-") == 0) {
+        if (frameFd < 0) {
+            fflush(stdout);
+            frameFd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+        capture.out = fdopen(dup(frameFd), "wb");
+    } else {
+        capture.out = fopen(capture.path, "wb");
+    }
+    if (!capture.out) {
+        fprintf(stderr, "Capture: cannot open %s\n", capture.path);
+        return false;
+    }
+    return true;
+}
+
+bool captureStart() {
+    if (capture.active) return true;
+    if (!captureOpenOutput()) return false;
+    
+    capture.width = capture.height = 0;
+    capture.head = capture.pending = 0;
+    capture.stopping = false;
+    pthread_create(&capture.writer, NULL, captureWriterThread, NULL);
+    capture.active = true;
+    fprintf(stderr, "Capture: writing %s frames to %s\n",
+            capture.format == CAPTURE_PNG ? "PNG" : "raw rgb24",
+            strcmp(capture.path, "-") == 0 ? "stdout" : capture.path);
+    return true;
+}
+
+void captureStop() {
+    if (!capture.active) return;
+    
+    captureDrain();
+    pthread_mutex_lock(&capture.lock);
+    capture.stopping = true;
+    pthread_cond_signal(&capture.queued);
+    pthread_mutex_unlock(&capture.lock);
+    pthread_join(capture.writer, NULL);
+    
+    while (capture.freeList) {
+        CaptureFrame* frame = capture.freeList;
+        capture.freeList = frame->next;
+        free(frame->pixels);
+        free(frame);
+    }
+    capture.numAllocated = 0;
+    if (capture.pbo[0]) {
+        glDeleteBuffers(CAPTURE_RING_SIZE, capture.pbo);
+        memset(capture.pbo, 0, sizeof(capture.pbo));
+    }
+    fclose(capture.out);
+    capture.out = NULL;
+    capture.active = false;
+    printCaptureReport();
+}
+
+// Queue an asynchronous readback of the back buffer. Called after the frame
+// is drawn and before the swap.
+void captureFrame() {
+    double t0 = nowSeconds();
+    int width = glutGet(GLUT_WINDOW_WIDTH);
+    int height = glutGet(GLUT_WINDOW_HEIGHT);
+    if (width != capture.width || height != capture.height) {
+        captureResize(width, height);
+    }
+    
+    // Ring full: the oldest slot is the one about to be reused
+    if (capture.pending == CAPTURE_RING_SIZE) {
+        captureRetire(capture.head, true);
+    }
+    
+    int slot = capture.head;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadBuffer(GL_BACK);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[slot]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    #ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    capture.fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    #endif
+    capture.head = (capture.head + 1) % CAPTURE_RING_SIZE;
+    capture.pending++;
+    capture.framesRead++;
+    
+    // Hand on older frames whose readback has already finished
+    while (capture.pending > 1) {
+        int oldest = (capture.head - capture.pending + CAPTURE_RING_SIZE) % CAPTURE_RING_SIZE;
+        int before = capture.pending;
+        captureRetire(oldest, false);
+        if (capture.pending == before) break;
+    }
+    
+    capture.captureSeconds += nowSeconds() - t0;
+}
+
+// Render a view into a framebuffer (0 for the window), drawing a prepared packet if given and
+// the whole scene otherwise
+void renderView(const FrameView* view, GLuint framebuffer, const FramePacket* packet) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+    // First handle shadow pass if enabled
+    if (shadowsEnabled) {
+        // First pass: Render from light's perspective (shadow map)
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        
+        // Set up light's perspective matrix
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        gluPerspective(45.0f, 1.0f, 1.0f, 200.0f);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        gluLookAt(mainLight.position[0], mainLight.position[1], mainLight.position[2],
+                  0.0f, 0.0f, 0.0f,
+                  0.0f, 1.0f, 0.0f);
+        
+        // Render scene for shadow map
+        if (packet) drawPacket(packet); else drawScene();
+        
+        // Second pass: Regular rendering with shadows
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    }
+    
+    // Normal rendering pass
+    glViewport(0, 0, view->width, view->height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    // Set up camera view
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(30.0f, (float)view->width/view->height, 0.1f, farPlane(view->distance));
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    
+    // Calculate camera position
+    float eye[3];
+    frameEye(view, eye);
+    
+    // Set camera
+    gluLookAt(eye[0], eye[1], eye[2],
+              0, view->targetY, 0,
+              0, 1, 0);
+    positionLights();
+    
+    // Draw coordinate axes
+    glDisable(GL_LIGHTING);
+    if (showAxes) {
+        glBegin(GL_LINES);
+        glColor3f(1,0,0); glVertex3f(0,0,0); glVertex3f(10,0,0);
+        glColor3f(0,1,0); glVertex3f(0,0,0); glVertex3f(0,10,0);
+        glColor3f(0,0,1); glVertex3f(0,0,0); glVertex3f(0,0,10);
+        glEnd();
+    }
+    
+    // Enable lighting for the building
+    if (advancedLighting) {
+        glEnable(GL_LIGHTING);
+    }
+    
+    // Draw the building
+    if (packet) drawPacket(packet); else drawScene();
+    drawPickHighlight();
+    drawSolarOverlay();
+}
+
+// Whether a packet prepared for a predicted camera may stand in for the actual one
+bool viewPredicted(const FrameView* predicted, const FrameView* actual) {
+    return predicted->width == actual->width && predicted->height == actual->height &&
+           predicted->targetY == actual->targetY &&
+           fabsf(predicted->angleX - actual->angleX) <= PIPELINE_SLOP &&
+           fabsf(predicted->angleY - actual->angleY) <= PIPELINE_SLOP &&
+           fabsf(predicted->distance - actual->distance) <= PIPELINE_SLOP * actual->distance;
+}
+
+// Draw one frame through the pipeline: take the packet kicked last frame,
+// or prepare one now if there is none or its camera was mispredicted, kick
+// the next frame, then submit. Returns whether the frame drawn differs from
+// the current camera, so another should follow.
+bool pipelineFrame(int width, int height, GLuint framebuffer) {
+    if (geometryDirty) {
+        // Workers, the baker and the solar study read the scene, so it only
+        // changes between packets
+        pipelineDrain();
+        stopLightmapBake(true);
+        stopSolarStudy(true);
+        generateScene();
+    }
+    FrameView view = currentFrameView(width, height);
+    FramePacket* packet = pipeline.inFlight ? pipelineWait() : NULL;
+    if (packet && !viewPredicted(&packet->view, &view)) {
+        atomic_store_explicit(&packet->state, PACKET_FREE, memory_order_relaxed);
+        packet = NULL;
+        pipeline.mispredicted++;
+    }
+    if (!packet) {
+        pipelineKick(&view);
+        packet = pipelineWait();
+    }
+    
+    // Workers prepare the next frame, for the camera moving on as it did
+    // since the last one, while this one is submitted
+    FrameView next = view;
+    if (pipeline.hasLastView) {
+        next.angleX += view.angleX - pipeline.lastView.angleX;
+        next.angleY += view.angleY - pipeline.lastView.angleY;
+        next.distance += view.distance - pipeline.lastView.distance;
+    }
+    pipeline.lastView = view;
+    pipeline.hasLastView = true;
+    pipelineKick(&next);
+    
+    pollLightmapBake();
+    if (lightmapsEnabled && advancedLighting) {
+        startLightmapBake(bakeThreads);
+    }
+    pollSolarStudy();
+    if (solarOverlay && solar.revision != scene.revision) {
+        startSolarStudy();
+    }
+    if (packet->impostors) {
+        resolveImpostors(packet);
+    }
+    
+    double t1 = nowSeconds();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    renderView(&packet->view, framebuffer, packet);
+    pipeline.submitSeconds += nowSeconds() - t1;
+    pipeline.latencySeconds += nowSeconds() - packet->kickTime;
+    
+    pipeline.frames++;
+    pipeline.prepareSeconds += packet->readySeconds;
+    for (int l = 0; l < pipeline.numLanes; l++) {
+        const PacketLane* lane = &packet->lanes[l];
+        pipeline.laneSeconds += lane->seconds;
+        pipeline.full += lane->full;
+        pipeline.boxes += lane->numBoxes;
+        pipeline.impostors += lane->numImpostors;
+        pipeline.culled += lane->culled;
+    }
+    bool behind = memcmp(&packet->view, &view, sizeof(FrameView)) != 0;
+    atomic_store_explicit(&packet->state, PACKET_FREE, memory_order_relaxed);
+    return behind;
+}
+
+double programStart = 0.0;  // cleared once the first frame has been reported
+
+void display() {
+    double frameStart = nowSeconds();
+    FrameTimer* timer = capture.active ? &renderCaptureTimer : &renderTimer;
+    bool timed = gpuTimerBegin(timer);
+    bool behind = pipelineFrame(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), 0);
+    
+    // Read the frame back before it is swapped away
+    if (capture.active) {
+        captureFrame();
+    }
+    if (timed) gpuTimerEnd();
+    timer->seconds += nowSeconds() - frameStart;
+    timer->frames++;
+    
+    // Single buffer swap at the end
+    glutSwapBuffers();
+    // A predicted camera was drawn; catch up with the actual one
+    if (behind) glutPostRedisplay();
+    
+    if (programStart > 0.0) {
+        glFinish();
+        fprintf(stderr, "First frame after %.1f ms\n", (nowSeconds() - programStart) * 1000.0);
+        programStart = 0.0;
+    }
+}
+
+void reshape(int w, int h) {
+    glViewport(0, 0, w, h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(30.0f, (float)w/h, 0.1f, farPlane(cameraDistance));
+    glMatrixMode(GL_MODELVIEW);
+}
+
+void mouseFunc(int button, int state, int x, int y) {
+    // Shift+click picks the element under the cursor
+    if(button == GLUT_LEFT_BUTTON && state == GLUT_DOWN && (glutGetModifiers() & GLUT_ACTIVE_SHIFT)) {
+        pickScreen(x, y);
+        return;
+    }
+    if(button == GLUT_LEFT_BUTTON) {
+        mouseLeftDown = (state == GLUT_DOWN);
+        mouseX = x;
+        mouseY = y;
+    }
+    else if(button == GLUT_RIGHT_BUTTON) {
+        mouseRightDown = (state == GLUT_DOWN);
+        mouseX = x;
+        mouseY = y;
+    }
+}
+
+void motionFunc(int x, int y) {
+    if(mouseLeftDown) {
+        cameraAngleY += (x - mouseX) * 0.01f;
+        cameraAngleX += (y - mouseY) * 0.01f;
+        
+        // Adjusted angle limits
+        if(cameraAngleX > 1.2f) cameraAngleX = 1.2f;
+        if(cameraAngleX < -1.2f) cameraAngleX = -1.2f;
+    }
+    else if(mouseRightDown) {
+        cameraDistance += (y - mouseY) * 0.5f;
+        // Adjusted zoom limits
+        if(cameraDistance < 20.0f) cameraDistance = 20.0f;
+        if(cameraDistance > maxCameraDistance()) cameraDistance = maxCameraDistance();
+    }
+    
+    mouseX = x;
+    mouseY = y;
+    glutPostRedisplay();
+}
+
+
+void keyboard(unsigned char key, int x, int y) {
+    switch(key) {
+        case 'm':
+        case 'M':
+            currentMaterial = (currentMaterial + 1) % 2;
+            break;
+        case 'w':
+        case 'W':
+            showWindows = !showWindows;
+            geometryDirty = true;
+            break;
+        case 'r':
+        case 'R':
+            showRoof = !showRoof;
+            geometryDirty = true;
+            break;
+        case 'a':
+        case 'A':
+            showAllWalls = !showAllWalls;
+            geometryDirty = true;
+            break;
+        case '1':
+            showFrontWall = !showFrontWall;
+            geometryDirty = true;
+            break;
+        case '2':
+            showBackWall = !showBackWall;
+            geometryDirty = true;
+            break;
+        case '3':
+            showLeftWall = !showLeftWall;
+            geometryDirty = true;
+            break;
+        case '4':
+            showRightWall = !showRightWall;
+            geometryDirty = true;
+            break;
+        case '+':
+            if(numFloors < MAX_FLOORS) {
+                numFloors++;
+                buildingHeight = numFloors * floorHeight;
+                geometryDirty = true;
+            }
+            break;
+        case '-':
+            if(numFloors > 1) {
+                numFloors--;
+                buildingHeight = numFloors * floorHeight;
+                geometryDirty = true;
+            }
+            break;
+        case 't':
+        case 'T':
+            // Cycle through window styles
+            currentWindowStyle = (currentWindowStyle + 1) % 4;
+            geometryDirty = true;
+            break;
+        case 'g':
+        case 'G':
+            // Cycle through facade grammars
+            currentGrammar = (currentGrammar + 1) % NUM_FACADE_GRAMMARS;
+            geometryDirty = true;
+            printf("Facade grammar: %s\n", facadeGrammars[currentGrammar].name);
+            break;
+        case 'i':
+        case 'I':
+            // Toggle impostors for distant buildings
+            impostorsEnabled = !impostorsEnabled;
+            printf("Impostors: %s\n", impostorsEnabled ? "on" : "off");
+            break;
+            
+        case 'b':
+        case 'B':
+            // Toggle baked lightmaps, baking what is missing in the background
+            lightmapsEnabled = !lightmapsEnabled;
+            printf("Lightmaps: %s\n", lightmapsEnabled ? "on" : "off");
+            break;
+            
+        case 'o':
+        case 'O':
+            // Toggle the solar exposure overlay; the next frame starts the study
+            // in the background if the scene changed
+            solarOverlay = !solarOverlay;
+            printf("Solar overlay: %s\n", solarOverlay ? "on" : "off");
+            break;
+            
+        case 'l':
+        case 'L':
+            toggleAdvancedLighting();
+            printf("Advanced Lighting: %s\n", advancedLighting ? "ON" : "OFF");
+            break;
+        case 'c':
+        case 'C':
+            if (capture.active) {
+                captureStop();
+            } else {
+                captureStart();
+            }
+            break;
+        case 27: // ESC key
+            captureStop();
+            pipelineStop();
+            printPipelineReport();
+            printImpostorReport();
+            exit(0);
+            break;
+    }
+    glutPostRedisplay();
+}
+
+void init() {
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+    
+    // Enable lighting
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+
+    brickTexture = loadTexture("brick.jpg");
+    concreteTexture = loadTexture("concrete.jpg");
+    windowTexture1 = loadTexture("window1.jpg");
+    windowTexture2 = loadTexture("window2.jpg");
+    marbleTexture = loadTexture("marble.jpg");
+    ledgeTexture = loadTexture("ledge.jpg");
+    
+    // Set light properties
+    GLfloat lightPos[] = {1.0f, 1.0f, 1.0f, 0.0f};
+    GLfloat lightAmbient[] = {0.2f, 0.2f, 0.2f, 1.0f};
+    GLfloat lightDiffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat lightSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    
+    glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
+    glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
+
+    //initShadowMap();
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+    // Initialize materials
+    GLfloat matAmb[] = {0.7f, 0.7f, 0.7f, 1.0f};
+    GLfloat matDiff[] = {0.8f, 0.8f, 0.8f, 1.0f};
+    GLfloat matSpec[] = {0.5f, 0.5f, 0.5f, 1.0f};
+    GLfloat matShin[] = {50.0f};
+    
+    glMaterialfv(GL_FRONT, GL_AMBIENT, matAmb);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, matDiff);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, matSpec);
+    glMaterialfv(GL_FRONT, GL_SHININESS, matShin);
+
+    // Enhanced lighting setup
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+    glLightfv(GL_LIGHT0, GL_POSITION, mainLight.position);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, mainLight.ambient);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, mainLight.diffuse);
+    glLightfv(GL_LIGHT0, GL_SPECULAR, mainLight.specular);
+    
+    // Enable features
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_NORMALIZE);
+    glShadeModel(GL_SMOOTH);
+}
+
+void getUserInput() {
+    printf("Enter building width (meters): ");
+    scanf("%f", &buildingWidth);
+    
+    printf("Enter building length (meters): ");
+    scanf("%f", &buildingLength);
+    
+    printf("Enter number of floors (1-%d): ", MAX_FLOORS);
+    scanf("%d", &numFloors);
+    if(numFloors < 1) numFloors = 1;
+    if(numFloors > MAX_FLOORS) numFloors = MAX_FLOORS;
+    
+    buildingHeight = numFloors * floorHeight;
+}
+
+// LRU cache
+// Entries sit on a recency list (most recent first) and in hash chains.
+// Keys and values are copied in; values are released with free() on eviction.
+typedef struct LRUEntry {
+    struct LRUEntry* prev;
+    struct LRUEntry* next;
+    struct LRUEntry* chain;  // next entry in the same hash bucket
+    unsigned int hash;
+    size_t keySize;
+    size_t valueSize;
+    void* key;
+    void* value;
+} LRUEntry;
+
+typedef struct {
+    LRUEntry** buckets;
+    int numBuckets;
+    LRUEntry* head;
+    LRUEntry* tail;
+    int count;
+    int maxEntries;
+    size_t bytes;     // total size of the cached values
+    size_t maxBytes;
+    long lookups;
+    long hits;
+} LRUCache;
+
+void lruInit(LRUCache* cache, int maxEntries, size_t maxBytes) {
+    memset(cache, 0, sizeof(LRUCache));
+    cache->numBuckets = maxEntries * 2;
+    cache->buckets = calloc(cache->numBuckets, sizeof(LRUEntry*));
+    cache->maxEntries = maxEntries;
+    cache->maxBytes = maxBytes;
+}
+
+void lruUnlink(LRUCache* cache, LRUEntry* entry) {
+    if (entry->prev) entry->prev->next = entry->next; else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+}
+
+void lruPushFront(LRUCache* cache, LRUEntry* entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry; else cache->tail = entry;
+    cache->head = entry;
+}
+
+void lruRemove(LRUCache* cache, LRUEntry* entry) {
+    LRUEntry** link = &cache->buckets[entry->hash % cache->numBuckets];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    lruUnlink(cache, entry);
+    cache->count--;
+    cache->bytes -= entry->valueSize;
+    free(entry->key);
+    free(entry->value);
+    free(entry);
+}
+
+LRUEntry* lruFind(LRUCache* cache, const void* key, size_t keySize, unsigned int hash) {
+    for (LRUEntry* entry = cache->buckets[hash % cache->numBuckets]; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->keySize == keySize &&
+            memcmp(entry->key, key, keySize) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Look up a value and mark it most recently used. Returns NULL on a miss.
+void* lruGet(LRUCache* cache, const void* key, size_t keySize, size_t* valueSize) {
+    cache->lookups++;
+    LRUEntry* entry = lruFind(cache, key, keySize, hashBytes(key, keySize));
+    if (!entry) return NULL;
+    cache->hits++;
+    lruUnlink(cache, entry);
+    lruPushFront(cache, entry);
+    if (valueSize) *valueSize = entry->valueSize;
+    return entry->value;
+}
+
+void lruPut(LRUCache* cache, const void* key, size_t keySize, const void* value, size_t valueSize) {
+    unsigned int hash = hashBytes(key, keySize);
+    LRUEntry* old = lruFind(cache, key, keySize, hash);
+    if (old) lruRemove(cache, old);
+    
+    LRUEntry* entry = malloc(sizeof(LRUEntry));
+    entry->hash = hash;
+    entry->keySize = keySize;
+    entry->valueSize = valueSize;
+    entry->key = malloc(keySize);
+    entry->value = malloc(valueSize);
+    memcpy(entry->key, key, keySize);
+    memcpy(entry->value, value, valueSize);
+    entry->chain = cache->buckets[hash % cache->numBuckets];
+    cache->buckets[hash % cache->numBuckets] = entry;
+    lruPushFront(cache, entry);
+    cache->count++;
+    cache->bytes += valueSize;
+    
+    // Evict least recently used entries, never the one just added
+    while (cache->tail != entry &&
+           (cache->count > cache->maxEntries || cache->bytes > cache->maxBytes)) {
+        lruRemove(cache, cache->tail);
+    }
+}
+
+// Render server
+// A long-running mode for thumbnails and previews. One headless GL context
+// and the shared meshes stay warm between requests. Requests arrive one per
+// line over a Unix or localhost TCP socket:
+//   render width=20 length=30 floors=6 grammar=classic style=0
+//          yaw=0.6 pitch=0.3 distance=70 lighting=1 size=320x240
+//   stats | quit | shutdown
+// Every reply is "OK <bytes> <detail>" or "ERR <message>", followed by
+// <bytes> of payload (a PNG image for render, text for stats).
+typedef struct {
+    float width;
+    float length;
+    int floors;
+    int grammar;
+    int style;
+    int lighting;
+    float yaw;
+    float pitch;
+    float distance;
+    int imageWidth;
+    int imageHeight;
+} RenderRequest;
+
+// The part of a request that shapes the geometry
+typedef struct {
+    float width;
+    float length;
+    int floors;
+    int grammar;
+    int style;
+    int generation;  // meshStore.generation, so flushed meshes never match
+} BuildingRequestKey;
+
+#define LATENCY_SAMPLES 8192
+
+typedef struct {
+    LRUCache images;     // full request -> PNG
+    LRUCache buildings;  // geometry part of a request -> resolved SceneBuilding
+    GLuint fbo;
+    GLuint colorBuffer;
+    GLuint depthBuffer;
+    int fboWidth;
+    int fboHeight;
+    double latencies[LATENCY_SAMPLES];  // most recent render latencies, in seconds
+    long requests;
+    bool running;
+} RenderServer;
+
+RenderServer server;
+
+// Parse "render key=value ..." into req. Returns an error message or NULL.
+const char* parseRenderRequest(char* line, RenderRequest* req) {
+    memset(req, 0, sizeof(RenderRequest));
+    req->width = 20.0f;
+    req->length = 30.0f;
+    req->floors = 6;
+    req->lighting = 1;
+    req->yaw = 0.6f;
+    req->pitch = 0.3f;
+    req->distance = 70.0f;
+    req->imageWidth = 320;
+    req->imageHeight = 240;
+    
+    for (char* token = strtok(line, " \t"); token; token = strtok(NULL, " \t")) {
+        char* value = strchr(token, '=');
+        if (!value) continue;
+        *value++ = '\0';
+        if (strcmp(token, "width") == 0) req->width = atof(value);
+        else if (strcmp(token, "length") == 0) req->length = atof(value);
+        else if (strcmp(token, "floors") == 0) req->floors = atoi(value);
+        else if (strcmp(token, "style") == 0) req->style = atoi(value);
+        else if (strcmp(token, "lighting") == 0) req->lighting = atoi(value) != 0;
+        else if (strcmp(token, "yaw") == 0) req->yaw = atof(value);
+        else if (strcmp(token, "pitch") == 0) req->pitch = atof(value);
+        else if (strcmp(token, "distance") == 0) req->distance = atof(value);
+        else if (strcmp(token, "size") == 0) {
+            if (sscanf(value, "%dx%d", &req->imageWidth, &req->imageHeight) != 2) return "bad size";
+        }
+        else if (strcmp(token, "grammar") == 0) {
+            req->grammar = -1;
+            for (int g = 0; g < NUM_FACADE_GRAMMARS; g++) {
+                if (strcmp(value, facadeGrammars[g].name) == 0) req->grammar = g;
+            }
+            if (req->grammar < 0) return "unknown grammar";
+        }
+        else return "unknown parameter";
+    }
+    
+    if (!(req->width > 0 && req->width <= 500) || !(req->length > 0 && req->length <= 500)) {
+        return "width and length must be in (0, 500]";
+    }
+    if (req->floors < 1 || req->floors > MAX_FLOORS) return "floors out of range";
+    if (req->style < 0 || req->style > WINDOW_CIRCULAR) return "style out of range";
+    if (req->imageWidth < 16 || req->imageHeight < 16 ||
+        req->imageWidth > 4096 || req->imageHeight > 4096) return "size out of range";
+    if (req->pitch > 1.2f) req->pitch = 1.2f;
+    if (req->pitch < -1.2f) req->pitch = -1.2f;
+    return NULL;
+}
+
+void ensureServerFramebuffer(int width, int height) {
+    if (!server.fbo) {
+        glGenFramebuffers(1, &server.fbo);
+        glGenRenderbuffers(1, &server.colorBuffer);
+        glGenRenderbuffers(1, &server.depthBuffer);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, server.fbo);
+    if (width != server.fboWidth || height != server.fboHeight) {
+        glBindRenderbuffer(GL_RENDERBUFFER, server.colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, server.depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, server.colorBuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  GL_RENDERBUFFER, server.depthBuffer);
+        server.fboWidth = width;
+        server.fboHeight = height;
+    }
+}
+
+// Render a request and return it as a malloc'd PNG. *cacheStatus says which
+// cache, if any, answered it.
+unsigned char* serveRender(const RenderRequest* req, size_t* size, const char** cacheStatus) {
+    size_t cachedSize;
+    unsigned char* cached = lruGet(&server.images, req, sizeof(RenderRequest), &cachedSize);
+    if (cached) {
+        unsigned char* png = malloc(cachedSize);
+        memcpy(png, cached, cachedSize);
+        *size = cachedSize;
+        *cacheStatus = "image-hit";
+        return png;
+    }
+    
+    // The selected building's globals drive generation and the camera target
+    buildingWidth = req->width;
+    buildingLength = req->length;
+    numFloors = req->floors;
+    buildingHeight = numFloors * floorHeight;
+    currentGrammar = req->grammar;
+    currentWindowStyle = req->style;
+    
+    // Geometry: a camera-only change reuses the resolved building
+    trimMeshStore();
+    BuildingRequestKey key;
+    memset(&key, 0, sizeof(key));
+    key.width = req->width;
+    key.length = req->length;
+    key.floors = req->floors;
+    key.grammar = req->grammar;
+    key.style = req->style;
+    key.generation = meshStore.generation;
+    
+    SceneBuilding* building = &scene.buildings[0];
+    SceneBuilding* resolved = lruGet(&server.buildings, &key, sizeof(key), NULL);
+    if (resolved) {
+        *building = *resolved;
+        *cacheStatus = "mesh-hit";
+    } else {
+        memset(building, 0, sizeof(SceneBuilding));
+        building->params = (BuildingParams){req->width, req->length, req->floors, req->grammar};
+        resolveBuilding(building);
+        key.generation = meshStore.generation;
+        lruPut(&server.buildings, &key, sizeof(key), building, sizeof(SceneBuilding));
+        *cacheStatus = "miss";
+    }
+    clearInstances();
+    instanceBuilding(building);
+    scene.radius = sqrtf(req->width * req->width + req->length * req->length) / 2;
+    scene.revision++;
+    geometryDirty = false;
+    
+    // View
+    cameraAngleX = req->pitch;
+    cameraAngleY = req->yaw;
+    cameraDistance = req->distance;
+    if (advancedLighting != (req->lighting != 0)) {
+        advancedLighting = req->lighting != 0;
+        applyLightingMode();
+    }
+    
+    ensureServerFramebuffer(req->imageWidth, req->imageHeight);
+    FrameView view = currentFrameView(req->imageWidth, req->imageHeight);
+    renderView(&view, server.fbo, NULL);
+    
+    size_t pixels = (size_t)req->imageWidth * req->imageHeight;
+    unsigned char* rgba = malloc(pixels * 4);
+    unsigned char* rgb = malloc(pixels * 3);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, req->imageWidth, req->imageHeight, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    rgbaToRGB(rgba, rgb, req->imageWidth, req->imageHeight);
+    unsigned char* png = encodePNG(rgb, req->imageWidth, req->imageHeight, size);
+    free(rgba);
+    free(rgb);
+    
+    if (png) {
+        lruPut(&server.images, req, sizeof(RenderRequest), png, *size);
+    }
+    return png;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Write latency percentiles and cache hit rates as text into buffer
+int formatServerStats(char* buffer, size_t size) {
+    int samples = server.requests < LATENCY_SAMPLES ? (int)server.requests : LATENCY_SAMPLES;
+    double sorted[LATENCY_SAMPLES];
+    memcpy(sorted, server.latencies, samples * sizeof(double));
+    qsort(sorted, samples, sizeof(double), compareDoubles);
+    #define PERCENTILE(p) (samples ? sorted[(int)((samples - 1) * (p))] * 1000.0 : 0.0)
+    
+    int length = snprintf(buffer, size,
+        "requests %ld\n"
+        "latency_ms p50 %.3f p90 %.3f p99 %.3f max %.3f\n"
+        "image_cache %ld/%ld hits (%.1f%%), %d entries, %.1f KB\n"
+        "mesh_cache %ld/%ld hits (%.1f%%), %d entries, %d shared meshes\n",
+        server.requests, PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(1.0),
+        server.images.hits, server.images.lookups,
+        server.images.lookups ? 100.0 * server.images.hits / server.images.lookups : 0.0,
+        server.images.count, server.images.bytes / 1024.0,
+        server.buildings.hits, server.buildings.lookups,
+        server.buildings.lookups ? 100.0 * server.buildings.hits / server.buildings.lookups : 0.0,
+        server.buildings.count, meshStore.count);
+    #undef PERCENTILE
+    return length;
+}
+
+#ifndef _WIN32
+// Listen on a localhost TCP port if address is a number, otherwise on a
+// Unix socket at that path
+int openServerSocket(const char* address) {
+    int fd;
+    char* end;
+    long port = strtol(address, &end, 10);
+    
+    if (*address && *end == '\0') {
+        struct sockaddr_in addr;
+        int yes = 1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+        struct stat st;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+        // Only replace a stale socket; any other file makes bind() fail
+        if (lstat(address, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void serveConnection(int fd) {
+    FILE* in = fdopen(fd, "r");
+    FILE* out = fdopen(dup(fd), "w");
+    char line[1024];
+    
+    while (server.running && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* command = line;
+        char* args = line + strcspn(line, " \t");
+        if (*args) *args++ = '\0';
         
-        // Adjusted angle limits
-        if(cameraAngleX > 1.2f) cameraAngleX = 1.2f;
-        if(cameraAngleX < -1.2f) cameraAngleX = -1.2f;
+        if (strcmp(command, "render") == 0) {
+            double t0 = nowSeconds();
+            RenderRequest req;
+            const char* error = parseRenderRequest(args, &req);
+            if (error) {
+                fprintf(out, "ERR %s\n", error);
+                fflush(out);
+                continue;
+            }
+            size_t size = 0;
+            const char* cacheStatus = "miss";
+            unsigned char* png = serveRender(&req, &size, &cacheStatus);
+            if (!png) {
+                fprintf(out, "ERR encoding failed\n");
+            } else {
+                fprintf(out, "OK %zu %s\n", size, cacheStatus);
+                fwrite(png, 1, size, out);
+            }
+            fflush(out);
+            free(png);
+            server.latencies[server.requests % LATENCY_SAMPLES] = nowSeconds() - t0;
+            server.requests++;
+        }
+        else if (strcmp(command, "stats") == 0) {
+            char text[1024];
+            int length = formatServerStats(text, sizeof(text));
+            fprintf(out, "OK %d stats\n%s", length, text);
+            fflush(out);
+        }
+        else if (strcmp(command, "shutdown") == 0) {
+            server.running = false;
+        }
+        else if (strcmp(command, "quit") == 0) {
+            break;
+        }
+        else if (*command) {
+            fprintf(out, "ERR unknown command\n");
+            fflush(out);
+        }
+    }
+    fclose(out);
+    fclose(in);
+}
+#endif
+
+#ifdef USEEGL
+// Headless context without any window system, through EGL
+bool createHeadlessContext(int* argc, char** argv) {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    #ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    #endif
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (!eglInitialize(display, NULL, NULL)) {
+            fprintf(stderr, "Server: cannot initialize EGL\n");
+            return false;
+        }
+    }
+    
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    const EGLint pbufferAttribs[] = {EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE};
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(display, configAttribs, &config, 1, &numConfigs);
+    eglBindAPI(EGL_OPENGL_API);
+    if (numConfigs < 1) {
+        fprintf(stderr, "Server: no suitable EGL config\n");
+        return false;
+    }
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    EGLSurface surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+    if (!eglMakeCurrent(display, surface, surface, context)) {
+        fprintf(stderr, "Server: cannot make the EGL context current\n");
+        return false;
+    }
+    return true;
+}
+#else
+// GLUT always opens a window, so keep it hidden and render into FBOs
+bool createHeadlessContext(int* argc, char** argv) {
+    glutInit(argc, argv);
+    glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH);
+    glutInitWindowSize(16, 16);
+    glutCreateWindow("Building Render Server");
+    glutHideWindow();
+    return true;
+}
+#endif
+
+int runServer(const char* address, int* argc, char** argv) {
+#ifdef _WIN32
+    fprintf(stderr, "Server: not supported on this platform\n");
+    return 1;
+#else
+    if (!createHeadlessContext(argc, argv)) return 1;
+    init();
+    showAxes = false;
+    
+    // One building at the origin, replaced by every request
+    buildingWidth = 20.0f;
+    buildingLength = 30.0f;
+    numFloors = 6;
+    initSingleBuildingScene();
+    lruInit(&server.images, 4096, 64 * 1024 * 1024);
+    lruInit(&server.buildings, 256, 256 * sizeof(SceneBuilding));
+    
+    int listenFd = openServerSocket(address);
+    if (listenFd < 0) {
+        fprintf(stderr, "Server: cannot listen on %s\n", address);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Server: listening on %s (%s)\n", address, (const char*)glGetString(GL_RENDERER));
+    
+    server.running = true;
+    while (server.running) {
+        int client = accept(listenFd, NULL, NULL);
+        if (client < 0) continue;
+        serveConnection(client);
+    }
+    close(listenFd);
+    if (strtol(address, NULL, 10) == 0) unlink(address);
+    
+    char text[1024];
+    formatServerStats(text, sizeof(text));
+    fprintf(stderr, "Server: shutting down\n%s", text);
+    return 0;
+#endif
+}
+
+// Scene files
+// A generated scene saved in a form that can be used straight from mmap:
+// a fixed header with a section table, then 64-byte aligned arrays that
+// have the same layout as the in-memory structures (materials, buildings,
+// mesh records, parts, vertices, indices). Loading maps the file, checks
+// the header and tables, and points meshes and buildings into the mapped
+// pages; vertex buffers are uploaded from there with no parsing or copies.
+#define SCENE_MAGIC "HW5SCENE"
+#define SCENE_VERSION 2
+#define SCENE_ALIGN 64
+
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} SceneSection;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianCheck;  // 0x01020304 in the writer's byte order
+    uint64_t fileSize;
+    
+    // Record sizes, so a layout change is caught instead of misread
+    uint32_t headerSize;
+    uint32_t buildingSize;
+    uint32_t meshSize;
+    uint32_t vertexSize;
+    
+    SceneSection materials;
+    SceneSection buildings;
+    SceneSection meshes;
+    SceneSection parts;
+    SceneSection vertices;
+    SceneSection indices;
+    SceneSection tags;       // one per triangle, in index order
+    
+    // Scene-wide generation parameters the meshes were built with
+    float floorHeight;
+    float windowWidth;
+    float windowHeight;
+    float windowSpacing;
+    float roofHeight;
+    float radius;
+} SceneFileHeader;
+
+typedef struct {
+    SharedMeshKey key;
+    float boundsMin[3];
+    float boundsMax[3];
+    uint32_t firstVertex;  // into the vertex section
+    uint32_t numVertices;
+    uint32_t firstIndex;   // into the index section, and 3x into the tag section;
+    uint32_t numIndices;   // indices are mesh-local
+    uint32_t firstPart;    // into the part section
+    uint32_t numParts;
+} SceneFileMesh;
+
+typedef struct {
+    void* data;   // the mapped file
+    size_t size;
+    const SceneFileHeader* header;
+} SceneFile;
+
+SceneFile loadedScene;
+
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + SCENE_ALIGN - 1) & ~(uint64_t)(SCENE_ALIGN - 1);
+}
+
+void writeSection(FILE* out, SceneSection* section, const void* data, size_t size, uint64_t count) {
+    static const char padding[SCENE_ALIGN];
+    long position = ftell(out);
+    fwrite(padding, 1, alignOffset(position) - position, out);
+    section->offset = ftell(out);
+    section->count = count;
+    if (size) fwrite(data, 1, size, out);
+}
+
+// Save the current scene. Only the meshes its buildings use are written,
+// renumbered in order of first use.
+bool saveSceneFile(const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Scene: cannot write %s\n", path);
+        return false;
     }
-    else if(mouseRightDown) {
-        cameraDistance += (y - mouseY) * 0.5f;
-        // Adjusted zoom limits
-        if(cameraDistance < 20.0f) cameraDistance = 20.0f;
-        if(cameraDistance > 200.0f) cameraDistance = 200.0f;
+    
+    int* remap = malloc(meshStore.count * sizeof(int));
+    int* order = malloc(meshStore.count * sizeof(int));
+    int numMeshes = 0;
+    for (int i = 0; i < meshStore.count; i++) remap[i] = -1;
+    
+    SceneBuilding* buildings = malloc(scene.numBuildings * sizeof(SceneBuilding));
+    memcpy(buildings, scene.buildings, scene.numBuildings * sizeof(SceneBuilding));
+    for (int b = 0; b < scene.numBuildings; b++) {
+        SceneBuilding* building = &buildings[b];
+        int numParts = building->params.numFloors + 1;
+        for (int i = 0; i < numParts; i++) {
+            int* id = i < building->params.numFloors ? &building->floorMeshes[i] : &building->roofMesh;
+            if (*id < 0) continue;
+            if (remap[*id] < 0) {
+                remap[*id] = numMeshes;
+                order[numMeshes++] = *id;
+            }
+            *id = remap[*id];
+        }
     }
     
-    mouseX = x;
-    mouseY = y;
-    glutPostRedisplay();
+    // Mesh records and the concatenated arrays they index into
+    SceneFileMesh* records = calloc(numMeshes, sizeof(SceneFileMesh));
+    uint64_t numVertices = 0, numIndices = 0, numParts = 0;
+    for (int m = 0; m < numMeshes; m++) {
+        const SharedMesh* shared = &meshStore.meshes[order[m]];
+        SceneFileMesh* record = &records[m];
+        record->key = shared->key;
+        memcpy(record->boundsMin, shared->boundsMin, sizeof(record->boundsMin));
+        memcpy(record->boundsMax, shared->boundsMax, sizeof(record->boundsMax));
+        record->firstVertex = numVertices;
+        record->numVertices = shared->mesh.numVerts;
+        record->firstIndex = numIndices;
+        record->numIndices = shared->mesh.numIndices;
+        record->firstPart = numParts;
+        record->numParts = shared->mesh.numParts;
+        numVertices += shared->mesh.numVerts;
+        numIndices += shared->mesh.numIndices;
+        numParts += shared->mesh.numParts;
+    }
+    
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, 8);
+    header.version = SCENE_VERSION;
+    header.endianCheck = 0x01020304;
+    header.headerSize = sizeof(SceneFileHeader);
+    header.buildingSize = sizeof(SceneBuilding);
+    header.meshSize = sizeof(SceneFileMesh);
+    header.vertexSize = sizeof(Vertex);
+    header.floorHeight = floorHeight;
+    header.windowWidth = windowWidth;
+    header.windowHeight = windowHeight;
+    header.windowSpacing = windowSpacing;
+    header.roofHeight = roofHeight;
+    header.radius = scene.radius;
+    
+    // The header is rewritten once the section offsets are known
+    fwrite(&header, sizeof(header), 1, out);
+    writeSection(out, &header.materials, materials, sizeof(materials),
+                 sizeof(materials) / sizeof(Material));
+    writeSection(out, &header.buildings, buildings, scene.numBuildings * sizeof(SceneBuilding),
+                 scene.numBuildings);
+    writeSection(out, &header.meshes, records, numMeshes * sizeof(SceneFileMesh), numMeshes);
+    writeSection(out, &header.parts, NULL, 0, numParts);
+    for (int m = 0; m < numMeshes; m++) {
+        const Mesh* mesh = &meshStore.meshes[order[m]].mesh;
+        fwrite(mesh->parts, sizeof(MeshPart), mesh->numParts, out);
+    }
+    writeSection(out, &header.vertices, NULL, 0, numVertices);
+    for (int m = 0; m < numMeshes; m++) {
+        const Mesh* mesh = &meshStore.meshes[order[m]].mesh;
+        fwrite(mesh->verts, sizeof(Vertex), mesh->numVerts, out);
+    }
+    writeSection(out, &header.indices, NULL, 0, numIndices);
+    for (int m = 0; m < numMeshes; m++) {
+        const Mesh* mesh = &meshStore.meshes[order[m]].mesh;
+        fwrite(mesh->indices, sizeof(GLuint), mesh->numIndices, out);
+    }
+    writeSection(out, &header.tags, NULL, 0, numIndices / 3);
+    for (int m = 0; m < numMeshes; m++) {
+        const Mesh* mesh = &meshStore.meshes[order[m]].mesh;
+        fwrite(mesh->tags, sizeof(MeshTag), mesh->numIndices / 3, out);
+    }
+    header.fileSize = ftell(out);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    
+    printf("Scene: saved %d buildings, %d meshes, %.1f MB to %s\n",
+           scene.numBuildings, numMeshes, header.fileSize / (1024.0 * 1024.0), path);
+    free(records);
+    free(buildings);
+    free(order);
+    free(remap);
+    return ok;
 }
 
+bool sectionFits(const SceneSection* section, size_t recordSize, size_t fileSize) {
+    return section->offset % SCENE_ALIGN == 0 &&
+           section->offset <= fileSize &&
+           section->count <= (fileSize - section->offset) / recordSize;
+}
 
-void keyboard(unsigned char key, int x, int y) {
-    switch(key) {
-        case 'm':
-        case 'M':
-            currentMaterial = (currentMaterial + 1) % 2;
-            break;
-        case 'w':
-        case 'W':
-            showWindows = !showWindows;
-            break;
-        case 'r':
-        case 'R':
-            showRoof = !showRoof;
-            break;
-        case 'a':
-        case 'A':
-            showAllWalls = !showAllWalls;
-            break;
-        case '1':
-            showFrontWall = !showFrontWall;
-            break;
-        case '2':
-            showBackWall = !showBackWall;
-            break;
-        case '3':
-            showLeftWall = !showLeftWall;
-            break;
-        case '4':
-            showRightWall = !showRightWall;
-            break;
-        case '+':
-            if(numFloors < 20) {
-                numFloors++;
-                buildingHeight = numFloors * floorHeight;
+// Check a mapped scene file. Structure, and every index and tag, are checked
+// before loading, since meshes are drawn and ray cast straight from the
+// mapping; deep checks also scan every vertex for non-finite values.
+const char* validateSceneData(const void* data, size_t size, bool deep) {
+    const SceneFileHeader* header = data;
+    if (size < sizeof(SceneFileHeader)) return "file too small for a header";
+    if (memcmp(header->magic, SCENE_MAGIC, 8) != 0) return "not a scene file";
+    if (header->version != SCENE_VERSION) return "unsupported version";
+    if (header->endianCheck != 0x01020304) return "written with a different byte order";
+    if (header->fileSize != size) return "file size does not match the header";
+    if (header->headerSize != sizeof(SceneFileHeader) ||
+        header->buildingSize != sizeof(SceneBuilding) ||
+        header->meshSize != sizeof(SceneFileMesh) ||
+        header->vertexSize != sizeof(Vertex)) return "record layout does not match this build";
+    
+    if (!sectionFits(&header->materials, sizeof(Material), size) ||
+        !sectionFits(&header->buildings, sizeof(SceneBuilding), size) ||
+        !sectionFits(&header->meshes, sizeof(SceneFileMesh), size) ||
+        !sectionFits(&header->parts, sizeof(MeshPart), size) ||
+        !sectionFits(&header->vertices, sizeof(Vertex), size) ||
+        !sectionFits(&header->indices, sizeof(GLuint), size) ||
+        !sectionFits(&header->tags, sizeof(MeshTag), size)) return "section out of bounds";
+    if (header->tags.count * 3 != header->indices.count) return "wrong tag count";
+    if (header->materials.count != sizeof(materials) / sizeof(Material)) return "wrong material count";
+    if (header->buildings.count == 0) return "no buildings";
+    
+    const char* base = data;
+    const SceneFileMesh* meshes = (const SceneFileMesh*)(base + header->meshes.offset);
+    const MeshPart* parts = (const MeshPart*)(base + header->parts.offset);
+    const GLuint* indices = (const GLuint*)(base + header->indices.offset);
+    const Vertex* vertices = (const Vertex*)(base + header->vertices.offset);
+    const MeshTag* tags = (const MeshTag*)(base + header->tags.offset);
+    for (uint64_t m = 0; m < header->meshes.count; m++) {
+        const SceneFileMesh* mesh = &meshes[m];
+        if ((uint64_t)mesh->firstVertex + mesh->numVertices > header->vertices.count ||
+            (uint64_t)mesh->firstIndex + mesh->numIndices > header->indices.count ||
+            (uint64_t)mesh->firstPart + mesh->numParts > header->parts.count) {
+            return "mesh range out of bounds";
+        }
+        if (mesh->numIndices % 3 || mesh->firstIndex % 3) return "mesh indices are not whole triangles";
+        for (uint32_t p = 0; p < mesh->numParts; p++) {
+            const MeshPart* part = &parts[mesh->firstPart + p];
+            if (part->slot < 0 || part->slot >= NUM_SLOTS || part->firstIndex < 0 ||
+                part->numIndices < 0 ||
+                (uint64_t)part->firstIndex + part->numIndices > mesh->numIndices) {
+                return "bad mesh part";
             }
-            break;
-        case '-':
-            if(numFloors > 1) {
-                numFloors--;
-                buildingHeight = numFloors * floorHeight;
+        }
+        for (uint32_t i = 0; i < mesh->numIndices; i++) {
+            if (indices[mesh->firstIndex + i] >= mesh->numVertices) return "index out of range";
+        }
+        for (uint32_t i = 0; i < mesh->numIndices / 3; i++) {
+            const MeshTag* tag = &tags[mesh->firstIndex / 3 + i];
+            if (tag->kind >= NUM_ELEMENTS || tag->wall < -1 || tag->wall >= NUM_WALLS) return "bad triangle tag";
+        }
+        if (!deep) continue;
+        for (uint32_t v = 0; v < mesh->numVertices; v++) {
+            const float* f = &vertices[mesh->firstVertex + v].x;
+            for (int k = 0; k < 6; k++) {
+                if (!isfinite(f[k])) return "non-finite vertex";
             }
-            break;
-        case 't':
-        case 'T':
-            // Cycle through window styles
-            currentWindowStyle = (currentWindowStyle + 1) % 4;
-            break;
-            
-        case 'l':
-        case 'L':
-            toggleAdvancedLighting();
-            printf("Advanced Lighting: %s\n", advancedLighting ? "ON" : "OFF");
-            break;
-        case 27: // ESC key
-            exit(0);
-            break;
+        }
     }
-    glutPostRedisplay();
+    
+    const SceneBuilding* buildings = (const SceneBuilding*)(base + header->buildings.offset);
+    for (uint64_t b = 0; b < header->buildings.count; b++) {
+        const SceneBuilding* building = &buildings[b];
+        if (building->params.numFloors < 1 || building->params.numFloors > MAX_FLOORS) {
+            return "building floor count out of range";
+        }
+        if (building->params.grammar < 0 || building->params.grammar >= NUM_FACADE_GRAMMARS) {
+            return "building grammar out of range";
+        }
+        for (int f = 0; f < building->params.numFloors; f++) {
+            if (building->floorMeshes[f] < 0 ||
+                (uint64_t)building->floorMeshes[f] >= header->meshes.count) {
+                return "building floor mesh out of range";
+            }
+        }
+        if (building->roofMesh < -1 || building->roofMesh >= (int64_t)header->meshes.count) {
+            return "building roof mesh out of range";
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            if (!(building->boundsMin[axis] <= building->boundsMax[axis])) return "bad building bounds";
+        }
+    }
+    return NULL;
 }
 
-void init() {
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-    
-    // Enable lighting
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
+// Map a scene file read-only into memory (copy-on-write, so buildings can
+// still be edited in place)
+bool mapSceneFile(const char* path, SceneFile* file) {
+#ifdef _WIN32
+    int fd = open(path, O_RDONLY | O_BINARY);
+#else
+    int fd = open(path, O_RDONLY);
+#endif
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    file->size = info.st_size;
+#ifdef _WIN32
+    // No mmap here: read the file in one go instead
+    file->data = malloc(file->size);
+    bool ok = read(fd, file->data, file->size) == (ssize_t)file->size;
+    close(fd);
+    if (!ok) return false;
+#else
+    file->data = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->data == MAP_FAILED) return false;
+#endif
+    file->header = file->data;
+    return true;
+}
 
-    brickTexture = loadTexture("brick.jpg");
-    concreteTexture = loadTexture("concrete.jpg");
-    windowTexture1 = loadTexture("window1.jpg");
-    windowTexture2 = loadTexture("window2.jpg");
-    marbleTexture = loadTexture("marble.jpg");
-    ledgeTexture = loadTexture("ledge.jpg");
+void unmapSceneFile(SceneFile* file) {
+#ifdef _WIN32
+    free(file->data);
+#else
+    munmap(file->data, file->size);
+#endif
+    memset(file, 0, sizeof(SceneFile));
+}
+
+// Load a scene file in place of the current scene
+bool loadSceneFile(const char* path) {
+    SceneFile file;
+    if (!mapSceneFile(path, &file)) {
+        fprintf(stderr, "Scene: cannot map %s\n", path);
+        return false;
+    }
+    const char* error = validateSceneData(file.data, file.size, false);
+    if (error) {
+        fprintf(stderr, "Scene: %s: %s\n", path, error);
+        unmapSceneFile(&file);
+        return false;
+    }
     
-    // Set light properties
-    GLfloat lightPos[] = {1.0f, 1.0f, 1.0f, 0.0f};
-    GLfloat lightAmbient[] = {0.2f, 0.2f, 0.2f, 1.0f};
-    GLfloat lightDiffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat lightSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    const SceneFileHeader* header = file.header;
+    char* base = file.data;
+    floorHeight = header->floorHeight;
+    windowWidth = header->windowWidth;
+    windowHeight = header->windowHeight;
+    windowSpacing = header->windowSpacing;
+    roofHeight = header->roofHeight;
+    memcpy(materials, base + header->materials.offset, sizeof(materials));
     
-    glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
+    // Meshes point into the mapped pages
+    clearMeshStore();
+    const SceneFileMesh* records = (const SceneFileMesh*)(base + header->meshes.offset);
+    Vertex* vertices = (Vertex*)(base + header->vertices.offset);
+    GLuint* indices = (GLuint*)(base + header->indices.offset);
+    MeshPart* parts = (MeshPart*)(base + header->parts.offset);
+    MeshTag* tags = (MeshTag*)(base + header->tags.offset);
+    for (uint64_t m = 0; m < header->meshes.count; m++) {
+        const SceneFileMesh* record = &records[m];
+        unsigned int slot;
+        if (findSharedMesh(&record->key, &slot) >= 0) {
+            fprintf(stderr, "Scene: %s: duplicate mesh %d\n", path, (int)m);
+            clearMeshStore();
+            unmapSceneFile(&file);
+            return false;
+        }
+        int index = addSharedMesh(&record->key, slot);  // may move meshStore.meshes
+        SharedMesh* shared = &meshStore.meshes[index];
+        Mesh* mesh = &shared->mesh;
+        mesh->mapped = true;
+        mesh->verts = vertices + record->firstVertex;
+        mesh->numVerts = mesh->capVerts = record->numVertices;
+        mesh->indices = indices + record->firstIndex;
+        mesh->numIndices = mesh->capIndices = record->numIndices;
+        mesh->parts = parts + record->firstPart;
+        mesh->numParts = mesh->capParts = record->numParts;
+        mesh->tags = tags + record->firstIndex / 3;
+        memcpy(shared->boundsMin, record->boundsMin, sizeof(shared->boundsMin));
+        memcpy(shared->boundsMax, record->boundsMax, sizeof(shared->boundsMax));
+    }
+    
+    // Buildings are used in place; release the previous scene's storage
+    if (loadedScene.data) {
+        unmapSceneFile(&loadedScene);
+    } else {
+        free(scene.buildings);
+    }
+    scene.buildings = (SceneBuilding*)(base + header->buildings.offset);
+    scene.numBuildings = header->buildings.count;
+    scene.radius = header->radius;
+    loadedScene = file;
+    
+    clearInstances();
+    for (int b = 0; b < scene.numBuildings; b++) {
+        instanceBuilding(&scene.buildings[b]);
+    }
+    selectBuilding(0);
+    scene.revision++;
+    geometryDirty = false;
+    return true;
+}
 
-    //initShadowMap();
-    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
-    // Initialize materials
-    GLfloat matAmb[] = {0.7f, 0.7f, 0.7f, 1.0f};
-    GLfloat matDiff[] = {0.8f, 0.8f, 0.8f, 1.0f};
-    GLfloat matSpec[] = {0.5f, 0.5f, 0.5f, 1.0f};
-    GLfloat matShin[] = {50.0f};
+// Upload every mesh of the scene, as the first frame would
+void uploadScene() {
+    for (int i = 0; i < meshStore.count; i++) {
+        if (meshStore.meshes[i].numInstances) uploadMesh(&meshStore.meshes[i].mesh);
+    }
+    glFinish();
+}
+
+int validateSceneFile(const char* path) {
+    SceneFile file;
+    if (!mapSceneFile(path, &file)) {
+        fprintf(stderr, "%s: cannot map file\n", path);
+        return 1;
+    }
+    const char* error = validateSceneData(file.data, file.size, true);
+    if (error) {
+        printf("%s: invalid: %s\n", path, error);
+    } else {
+        printf("%s: valid, version %u, %llu buildings, %llu meshes, %llu vertices, %llu indices\n",
+               path, file.header->version,
+               (unsigned long long)file.header->buildings.count,
+               (unsigned long long)file.header->meshes.count,
+               (unsigned long long)file.header->vertices.count,
+               (unsigned long long)file.header->indices.count);
+    }
+    unmapSceneFile(&file);
+    return error ? 1 : 0;
+}
+
+// Compare generating a scene file's buildings from their parameters against
+// loading the file cold (pages evicted from the cache) and warm. Every
+// variant ends with all meshes uploaded.
+int benchmarkSceneLoad(const char* path, int* argc, char** argv) {
+    if (!createHeadlessContext(argc, argv)) return 1;
+    init();
+    if (!loadSceneFile(path)) return 1;
     
-    glMaterialfv(GL_FRONT, GL_AMBIENT, matAmb);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, matDiff);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, matSpec);
-    glMaterialfv(GL_FRONT, GL_SHININESS, matShin);
+    // Generate: same buildings and positions, meshes built from scratch
+    int count = scene.numBuildings;
+    SceneBuilding* buildings = malloc(count * sizeof(SceneBuilding));
+    memcpy(buildings, scene.buildings, count * sizeof(SceneBuilding));
+    double t0 = nowSeconds();
+    clearMeshStore();
+    clearFacadeCache();
+    for (int b = 0; b < count; b++) {
+        resolveBuilding(&buildings[b]);
+        instanceBuilding(&buildings[b]);
+    }
+    uploadScene();
+    double generateSeconds = nowSeconds() - t0;
+    free(buildings);
+    
+    double loadSeconds[2];
+    for (int pass = 0; pass < 2; pass++) {
+#ifdef POSIX_FADV_DONTNEED
+        if (pass == 0) {
+            // Drop the file's pages from the page cache for a cold load
+            int fd = open(path, O_RDONLY);
+            if (fd >= 0) {
+                fdatasync(fd);
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+        }
+#endif
+        clearMeshStore();
+        double t1 = nowSeconds();
+        if (!loadSceneFile(path)) return 1;
+        uploadScene();
+        loadSeconds[pass] = nowSeconds() - t1;
+    }
+    
+    printf("Scene: %d buildings, %d meshes, %.1f MB\n",
+           count, meshStore.count, loadedScene.size / (1024.0 * 1024.0));
+    printf("Scene: generate %.1f ms, cold load %.1f ms, warm load %.1f ms (to meshes uploaded)\n",
+           generateSeconds * 1000.0, loadSeconds[0] * 1000.0, loadSeconds[1] * 1000.0);
+    return 0;
+}
 
-    // Enhanced lighting setup
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    glLightfv(GL_LIGHT0, GL_POSITION, mainLight.position);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, mainLight.ambient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, mainLight.diffuse);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, mainLight.specular);
+// Orbit the scene through the frame pipeline with a growing number of
+// workers and report how the frame rate scales
+int benchmarkPipeline(int frames, int* argc, char** argv) {
+    if (!createHeadlessContext(argc, argv)) return 1;
+    init();
+    const int width = 800, height = 600;
+    ensureServerFramebuffer(width, height);
+    if (geometryDirty) generateScene();
+    uploadScene();
     
-    // Enable features
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_NORMALIZE);
-    glShadeModel(GL_SMOOTH);
+    int maxWorkers = pipelineWorkers;
+    if (maxWorkers < 0) {
+        maxWorkers = coreCount() - 1;
+    }
+    cameraAngleX = 0.35f;
+    cameraDistance = fmaxf(100.0f, scene.radius);
+    
+    double serialFps = 0.0;
+    for (int workers = 0; ; workers = workers ? workers * 2 : 1) {
+        if (workers > maxWorkers) workers = maxWorkers;
+        pipelineStart(workers);
+        double t0 = nowSeconds();
+        for (int f = 0; f < frames; f++) {
+            cameraAngleY = 2.0f * M_PI * f / frames;
+            pipelineFrame(width, height, server.fbo);
+        }
+        glFinish();
+        double fps = frames / (nowSeconds() - t0);
+        if (workers == 0) serialFps = fps;
+        printPipelineReport();
+        pipelineStop();
+        fprintf(stderr, "  %.1f fps, %.2fx the serial rate\n", fps, fps / serialFps);
+        if (workers == maxWorkers) break;
+    }
+    printImpostorReport();
+    return 0;
 }
 
-void getUserInput() {
-    printf("Enter building width (meters): ");
-    scanf("%f", &buildingWidth);
+// Time building the pick index, picking through random pixels of random
+// views, and updating the index after one building is edited. Needs no GL.
+int benchmarkPicking(int picks) {
+    const int width = 800, height = 600;
+    if (geometryDirty) generateScene();
+    double t0 = nowSeconds();
+    updatePickIndex();
+    double buildSeconds = nowSeconds() - t0;
+    printf("Pick: index over %d buildings, %d meshes built in %.1f ms\n",
+           scene.numBuildings, pickIndex.meshesBuilt, buildSeconds * 1000.0);
     
-    printf("Enter building length (meters): ");
-    scanf("%f", &buildingLength);
+    double* latencies = malloc(picks * sizeof(double));
+    int hits = 0;
+    srand(1);
+    for (int i = 0; i < picks; i++) {
+        FrameView view = {
+            .angleX = 0.1f + 0.9f * rand() / RAND_MAX,
+            .angleY = 2.0f * M_PI * rand() / RAND_MAX,
+            .distance = fmaxf(100.0f, scene.radius * (0.3f + 1.2f * rand() / RAND_MAX)),
+            .targetY = buildingHeight / 2,
+            .width = width,
+            .height = height
+        };
+        float origin[3], dir[3];
+        viewRay(&view, rand() % width, rand() % height, origin, dir);
+        PickHit hit;
+        double t1 = nowSeconds();
+        hits += pickRay(origin, dir, &hit);
+        latencies[i] = nowSeconds() - t1;
+    }
+    qsort(latencies, picks, sizeof(double), compareDoubles);
+    printf("Pick: %d picks, %.1f%% hit, latency p50 %.4f ms, p99 %.4f ms, max %.4f ms\n",
+           picks, picks ? 100.0 * hits / picks : 0.0,
+           latencies[(int)((picks - 1) * 0.5)] * 1000.0,
+           latencies[(int)((picks - 1) * 0.99)] * 1000.0,
+           latencies[picks - 1] * 1000.0);
+    free(latencies);
     
-    printf("Enter number of floors (1-20): ");
-    scanf("%d", &numFloors);
-    if(numFloors < 1) numFloors = 1;
-    if(numFloors > 20) numFloors = 20;
+    // Add a floor to one building, the way the keyboard would
+    selectBuilding(scene.numBuildings / 2);
+    if (numFloors < MAX_FLOORS) numFloors++; else numFloors--;
+    generateScene();
+    updatePickIndex();
+    printf("Pick: after editing one building, %d building and %d mesh BVHs rebuilt, scene %s in %.3f ms\n",
+           pickIndex.buildingsRebuilt, pickIndex.meshesBuilt,
+           pickIndex.sceneRebuilt ? "rebuilt" : "refit", pickIndex.updateSeconds * 1000.0);
+    return 0;
+}
+
+// Bake the scene's lightmaps with a growing number of threads, reload them
+// from the disk cache, then compare frame rates with lighting evaluated per
+// vertex and read from the lightmaps
+int benchmarkLightmaps(int frames, int* argc, char** argv) {
+    if (geometryDirty) generateScene();
+    int maxThreads = bakeThreads;
+    if (maxThreads < 1) {
+        maxThreads = coreCount();
+    }
+    printf("Lightmaps: baking with up to %d threads on %d cores\n", maxThreads, coreCount());
+    double serialSeconds = 0.0;
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > maxThreads) threads = maxThreads;
+        clearLightmaps();
+        double seconds = bakeLightmaps(threads, false);
+        if (threads == 1) serialSeconds = seconds;
+        printf("  %d threads: traced in %.0f ms, %.2fx the single thread rate\n",
+               threads, seconds * 1000.0, serialSeconds / seconds);
+        if (threads == maxThreads) break;
+    }
+    clearLightmaps();
+    bakeLightmaps(maxThreads, true);
+    clearLightmaps();
+    double t0 = nowSeconds();
+    bakeLightmaps(maxThreads, true);
+    printf("Lightmaps: reloaded from %s/ in %.1f ms\n", LIGHTMAP_CACHE_DIR, (nowSeconds() - t0) * 1000.0);
     
-    buildingHeight = numFloors * floorHeight;
+    if (!createHeadlessContext(argc, argv)) return 1;
+    init();
+    applyLightingMode();
+    const int width = 800, height = 600;
+    ensureServerFramebuffer(width, height);
+    uploadScene();
+    cameraAngleX = 0.35f;
+    cameraDistance = fmaxf(100.0f, scene.radius);
+    pipelineStart(pipelineWorkers);
+    for (int mode = 0; mode < 2; mode++) {
+        lightmapsEnabled = mode == 1;
+        pipelineFrame(width, height, server.fbo);  // uploads and impostor cells
+    }
+    // The modes take turns over several rounds so that drift in the machine's
+    // speed hits both, and the median round of each is reported
+    #define LIGHTMAP_BENCH_ROUNDS 5
+    double fps[2][LIGHTMAP_BENCH_ROUNDS];
+    for (int round = 0; round < LIGHTMAP_BENCH_ROUNDS; round++) {
+        for (int mode = 0; mode < 2; mode++) {
+            lightmapsEnabled = mode == 1;
+            glFinish();
+            double t1 = nowSeconds();
+            for (int f = 0; f < frames; f++) {
+                cameraAngleY = 2.0f * M_PI * f / frames;
+                pipelineFrame(width, height, server.fbo);
+            }
+            glFinish();
+            fps[mode][round] = frames / (nowSeconds() - t1);
+        }
+    }
+    pipelineStop();
+    for (int mode = 0; mode < 2; mode++) {
+        qsort(fps[mode], LIGHTMAP_BENCH_ROUNDS, sizeof(double), compareDoubles);
+    }
+    double vertexFps = fps[0][LIGHTMAP_BENCH_ROUNDS / 2], lightmapFps = fps[1][LIGHTMAP_BENCH_ROUNDS / 2];
+    printf("Lightmaps: %.1f fps with per-vertex lighting, %.1f fps with lightmaps (%.2fx), "
+           "median of %d rounds of %d frames\n",
+           vertexFps, lightmapFps, lightmapFps / vertexFps, LIGHTMAP_BENCH_ROUNDS, frames);
+    return 0;
 }
 
 void printControls() {
     printf("\nControls:\n");
     printf("Left Mouse: Rotate camera\n");
     printf("Right Mouse: Zoom in/out\n");
+    printf("Shift+Left Mouse: Pick a building element\n");
     printf("M: Change material\n");
     printf("W: Toggle windows\n");
     printf("R: Toggle roof\n");
     printf("+: Add floor\n");
     printf("-: Remove floor\n");
     printf("T: Change window style\n");
+    printf("G: Change facade grammar\n");
+    printf("I: Toggle impostors for distant buildings\n");
+    printf("B: Toggle baked lightmaps\n");
+    printf("O: Toggle solar exposure overlay\n");
     printf("L: Toggle advanced lighting\n");
+    printf("C: Start/stop frame capture\n");
     printf("ESC: Exit\n\n");
 }
 
+// Parse program options; anything unrecognized is left for glutInit
+bool startCapture = false;
+int cityBuildings = 0;       // -city: generate a grid instead of prompting
+unsigned int citySeed = 1;
+const char* serverAddress = NULL;  // -server: run headless and serve renders
+const char* saveScenePath = NULL;  // -save: write the generated scene to a file
+const char* loadScenePath = NULL;  // -load: start from a saved scene
+const char* validatePath = NULL;   // -validate: check a scene file and exit
+const char* benchLoadPath = NULL;  // -bench-load: time loading a scene file and exit
+int benchFrames = 0;               // -bench-frames: time the frame pipeline and exit
+int benchPicks = 0;                // -bench-pick: time CPU picking and exit
+int benchBakeFrames = 0;           // -bench-bake: time baking and drawing lightmaps and exit
+const char* solarPath = NULL;      // -solar: write per-window sun hours to a CSV file
+const char* massingPath = NULL;    // -massing: write metrics of many configurations and exit
+const char* massingInput = NULL;   // -massing-in: configurations to evaluate instead of the sweep
+int benchMassing = 0;              // -bench-massing: time and check the massing kernel and exit
+
+void parseArgs(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-capture") == 0 && i + 1 < argc) {
+            capture.path = argv[++i];
+            startCapture = true;
+            const char* ext = strrchr(capture.path, '.');
+            if (ext && strcmp(ext, ".png") == 0) capture.format = CAPTURE_PNG;
+        }
+        else if (strcmp(argv[i], "-grammar") == 0 && i + 1 < argc) {
+            i++;
+            for (int g = 0; g < NUM_FACADE_GRAMMARS; g++) {
+                if (strcmp(argv[i], facadeGrammars[g].name) == 0) currentGrammar = g;
+            }
+        }
+        else if (strcmp(argv[i], "-city") == 0 && i + 1 < argc) {
+            cityBuildings = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-server") == 0 && i + 1 < argc) {
+            serverAddress = argv[++i];
+        }
+        else if (strcmp(argv[i], "-save") == 0 && i + 1 < argc) {
+            saveScenePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-load") == 0 && i + 1 < argc) {
+            loadScenePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-validate") == 0 && i + 1 < argc) {
+            validatePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-bench-load") == 0 && i + 1 < argc) {
+            benchLoadPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-no-impostors") == 0) {
+            impostorsEnabled = false;
+        }
+        else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+            pipelineWorkers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bench-frames") == 0 && i + 1 < argc) {
+            benchFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-lightmaps") == 0) {
+            lightmapsEnabled = true;
+        }
+        else if (strcmp(argv[i], "-bake-threads") == 0 && i + 1 < argc) {
+            bakeThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bench-bake") == 0 && i + 1 < argc) {
+            benchBakeFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-solar") == 0 && i + 1 < argc) {
+            solarPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-solar-overlay") == 0) {
+            solarOverlay = true;
+        }
+        else if (strcmp(argv[i], "-solar-latitude") == 0 && i + 1 < argc) {
+            solarLatitude = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-solar-dates") == 0 && i + 1 < argc) {
+            i++;
+            const char* end = strchr(argv[i], ':');
+            solarFirstDay = parseDay(argv[i]);
+            solarLastDay = end ? parseDay(end + 1) : solarFirstDay;
+        }
+        else if (strcmp(argv[i], "-solar-step") == 0 && i + 1 < argc) {
+            solarStepMinutes = atoi(argv[++i]);
+            if (solarStepMinutes < 1) solarStepMinutes = 1;
+        }
+        else if (strcmp(argv[i], "-solar-threads") == 0 && i + 1 < argc) {
+            solarThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-massing") == 0 && i + 1 < argc) {
+            massingPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-massing-in") == 0 && i + 1 < argc) {
+            massingInput = argv[++i];
+        }
+        else if (strcmp(argv[i], "-massing-sweep") == 0 && i + 1 < argc) {
+            MassingSweep* sweep = &massingSweep;
+            if (sscanf(argv[++i], "%f:%f:%f,%f:%f:%f,%d:%d,%f:%f:%f",
+                       &sweep->widthMin, &sweep->widthMax, &sweep->widthStep,
+                       &sweep->lengthMin, &sweep->lengthMax, &sweep->lengthStep,
+                       &sweep->floorsMin, &sweep->floorsMax,
+                       &sweep->spacingMin, &sweep->spacingMax, &sweep->spacingStep) != 11) {
+                fprintf(stderr, "Massing: expected a sweep like 10:60:0.5,10:60:0.5,1:20,2:4:0.5\n");
+            }
+            if (sweep->floorsMin < 1) sweep->floorsMin = 1;
+            if (sweep->floorsMax > MAX_FLOORS) sweep->floorsMax = MAX_FLOORS;
+        }
+        else if (strcmp(argv[i], "-massing-threads") == 0 && i + 1 < argc) {
+            massingThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bench-massing") == 0 && i + 1 < argc) {
+            benchMassing = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bench-pick") == 0 && i + 1 < argc) {
+            benchPicks = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            citySeed = (unsigned int)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-capture-format") == 0 && i + 1 < argc) {
+            i++;
+            capture.format = strcmp(argv[i], "png") == 0 ? CAPTURE_PNG : CAPTURE_RAW;
+        }
+    }
+}
+
 int main(int argc, char** argv) {
-    getUserInput();
+    programStart = nowSeconds();
+    parseArgs(argc, argv);
+    if (serverAddress) {
+        return runServer(serverAddress, &argc, argv);
+    }
+    // Analytics and scene file tools that exit without opening a window
+    if (massingPath) return runMassing(massingPath, massingInput);
+    if (benchMassing > 0) return benchmarkMassing(benchMassing);
+    if (validatePath) return validateSceneFile(validatePath);
+    if (benchLoadPath) return benchmarkSceneLoad(benchLoadPath, &argc, argv);
+    if (startCapture && !captureOpenOutput()) {
+        return 1;
+    }
+    if (loadScenePath) {
+        double loadStart = nowSeconds();
+        if (!loadSceneFile(loadScenePath)) return 1;
+        printf("Scene: loaded %d buildings, %d meshes from %s in %.1f ms\n",
+               scene.numBuildings, meshStore.count, loadScenePath,
+               (nowSeconds() - loadStart) * 1000.0);
+    } else if (cityBuildings > 0 || benchFrames > 0 || benchPicks > 0 || benchBakeFrames > 0) {
+        initCityScene(cityBuildings > 0 ? cityBuildings : 1000, citySeed);
+    } else {
+        getUserInput();
+        initSingleBuildingScene();
+    }
+    if (saveScenePath) {
+        if (geometryDirty) generateScene();
+        if (!saveSceneFile(saveScenePath)) return 1;
+    }
+    if (benchPicks > 0) {
+        return benchmarkPicking(benchPicks);
+    }
+    if (benchBakeFrames > 0) {
+        return benchmarkLightmaps(benchBakeFrames, &argc, argv);
+    }
+    if (benchFrames > 0) {
+        return benchmarkPipeline(benchFrames, &argc, argv);
+    }
+    if (solarPath || solarOverlay) {
+        runSolarStudy();
+        if (solarPath && !writeSolarCSV(solarPath)) return 1;
+        if (!solarOverlay) return 0;
+    }
     printControls();
     
     glutInit(&argc, argv);
@@ -916,6 +7144,11 @@ int main(int argc, char** argv) {
     glutKeyboardFunc(keyboard);
     
     init();
+    pipelineStart(pipelineWorkers);
+    if (startCapture) {
+        captureStart();
+    }
+    viewerRunning = true;
     glutMainLoop();
     
     return 0;